@@ -0,0 +1,324 @@
+#ifndef __ASYNC_VALIDATOR_HPP__
+#define __ASYNC_VALIDATOR_HPP__
+
+#include "perceptron_layer.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * AsyncValidator
+ * ==============
+ *
+ * Evaluates a validation set on snapshots of the weights of a network, in
+ * the background of its training.
+ *
+ * The validator holds a copy of the network (same layer sizes), on a second
+ * command queue of the same device. submit() enqueues a device to device copy
+ * of the weights into it, after the training commands already enqueued, and
+ * returns at once: a thread of the validator waits for the copy, runs the
+ * validation set through the copy on its own queue, and records whether the
+ * network has converged. Training goes on meanwhile, and only polls
+ * hasConverged().
+ *
+ * A snapshot submitted while the previous one is still being validated is
+ * skipped (see Stats): validation never makes training wait.
+ *
+ * An error of the validation thread is rethrown by the next call to
+ * hasConverged() or wait().
+ *
+ * The network converges as in Perceptron::train: when the error on every
+ * output of every sample is at most 1 - confidence.
+ *
+ * How to use
+ * ----------
+ * AsyncValidator<float> validator(context, queue, kernel, p.getFirstLayer(), validation_in, validation_out, confidence);
+ * p.setValidator(&validator, 100);
+ * p.train(...);
+ *
+ * Or, with a training loop of your own:
+ * validator.submit(p.getFirstLayer(), queue, iteration);
+ * ...
+ * if(validator.hasConverged()) {
+ *     validator.enqueueRestore(p.getFirstLayer(), queue);
+ * }
+ **/
+template<typename T>
+class AsyncValidator
+{
+    typedef NeuronLayer<T> NLayer;
+
+    public:
+        struct Stats {
+            size_t validations = 0;
+            // Snapshots submitted while a validation was running
+            size_t skipped = 0;
+            // Max error of the last validation
+            float max_error = 0.f;
+            // Iteration of the snapshot that converged, -1 if none did
+            int converged_iteration = -1;
+            // Time spent validating, in the validation thread
+            double seconds = 0.;
+        };
+
+    private:
+        cl::CommandQueue mQueue;
+        // Copy of the network the snapshots are copied into
+        NLayer* mFirstLayer = nullptr;
+        std::vector<NLayer*> mLayers;
+        std::vector<BoundKernel> mForward;
+
+        std::vector<std::vector<T>> mValidationIn;
+        std::vector<T> mValidationOut;
+        std::vector<T> mOutputs;
+        cl_int mOutSize;
+        float mConfidence;
+
+        std::mutex mMutex;
+        std::condition_variable mCondition;
+        std::thread mThread;
+        bool mBusy = false;
+        bool mQuit = false;
+        std::vector<cl::Event> mCopied;
+        int mIteration = 0;
+        std::atomic<bool> mConverged;
+        Stats mStats;
+        // Failure of the last validation, rethrown in the training thread
+        std::exception_ptr mError;
+        std::atomic<bool> mFailed;
+
+        /**
+         * @brief Rethrows the failure of a validation, once
+         */
+        void rethrowError()
+        {
+            std::exception_ptr error;
+            {
+                std::lock_guard<std::mutex> lock(mMutex);
+                error = mError;
+                mError = nullptr;
+                mFailed = false;
+            }
+            if(error) std::rethrow_exception(error);
+        }
+
+        void waitIdle()
+        {
+            std::unique_lock<std::mutex> lock(mMutex);
+            mCondition.wait(lock, [this]() { return !mBusy; });
+        }
+
+        /**
+         * @brief Runs the validation set through the copy of the network,
+         * returns the max error
+         */
+        float validate()
+        {
+            const LaunchOrder order = LaunchOrder::inOrder(&mQueue);
+            for(size_t i=0; i < mValidationIn.size(); i++) {
+                mFirstLayer->enqueueWriteValues(mValidationIn[i].data(), order);
+                for(size_t l=0; l < mForward.size(); l++) {
+                    if(mLayers[l]->enqueueBound(mForward[l], order) != CL_SUCCESS)
+                        throw std::runtime_error("AsyncValidator::validate - Error running kernel");
+                }
+                mLayers.back()->enqueueReadValues(mOutputs.data() + i * mOutSize, order);
+            }
+            if(mQueue.finish() != CL_SUCCESS) {
+                throw std::runtime_error("AsyncValidator::validate - command queue failed to execute");
+            }
+            float max_error = 0.f;
+            for(size_t i=0; i < mOutputs.size(); i++) {
+                max_error = std::fmax(max_error, std::fabs(mOutputs[i] - mValidationOut[i]));
+            }
+            return max_error;
+        }
+
+        void run()
+        {
+            std::unique_lock<std::mutex> lock(mMutex);
+            while(true) {
+                mCondition.wait(lock, [this]() { return mQuit || mBusy; });
+                if(mQuit) return;
+                const int iteration = mIteration;
+                lock.unlock();
+
+                const auto start = std::chrono::steady_clock::now();
+                float max_error = 1.f;
+                std::exception_ptr error;
+                try {
+                    for(cl::Event& copied : mCopied) copied.wait();
+                    max_error = validate();
+                } catch(...) {
+                    error = std::current_exception();
+                }
+                const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+                lock.lock();
+                if(error) {
+                    mError = error;
+                    mFailed = true;
+                } else {
+                    mStats.validations++;
+                    mStats.max_error = max_error;
+                }
+                mStats.seconds += seconds;
+                if(!error && max_error <= 1.f - mConfidence) {
+                    mStats.converged_iteration = iteration;
+                    mConverged = true;
+                }
+                mCopied.clear();
+                mBusy = false;
+                mCondition.notify_all();
+            }
+        }
+
+    public:
+        /**
+         * @brief Validator of the network of first_layer, trained on
+         * training_queue, with the forward kernel kernel. The validation runs
+         * on a new queue of the same device.
+         */
+        AsyncValidator(cl::Context& context, const cl::CommandQueue& training_queue, const cl::Kernel& kernel, NLayer* first_layer, const std::vector<std::vector<T>>& validation_in_values, const std::vector<std::vector<T>>& validation_out_values, float confidence) : mValidationIn(validation_in_values), mConfidence(confidence), mConverged(false), mFailed(false)
+        {
+            if(first_layer == nullptr || first_layer->getNextLayer() == nullptr) {
+                throw std::runtime_error("AsyncValidator - You must have more than one layer to validate a perceptron !");
+            }
+            if(validation_in_values.empty() || validation_in_values.size() != validation_out_values.size()) {
+                throw std::runtime_error("AsyncValidator - Validation input and output size must match!");
+            }
+            mQueue = cl::CommandQueue(context, training_queue.getInfo<CL_QUEUE_DEVICE>());
+
+            NLayer* previous = nullptr;
+            for(NLayer* layer = first_layer; layer != nullptr; layer = layer->getNextLayer()) {
+                NLayer* copy = new NLayer(layer->getSize()-1, mQueue);
+                if(previous == nullptr) {
+                    mFirstLayer = copy;
+                } else {
+                    previous->setOutputLayer(copy);
+                    previous->createBuffers(context);
+                    copy->setInputLayer(previous);
+                }
+                copy->setNumber(mLayers.size());
+                copy->setIndex(mLayers.size());
+                mLayers.push_back(copy);
+                previous = copy;
+            }
+            previous->createBuffers(context);
+            for(size_t l=0; l+1 < mLayers.size(); l++) {
+                mForward.push_back(mLayers[l]->prepareRun(kernel));
+            }
+
+            const cl_int in_size = mFirstLayer->getSize()-1;
+            mOutSize = mLayers.back()->getSize()-1;
+            for(size_t i=0; i < validation_in_values.size(); i++) {
+                if(validation_in_values[i].size() != static_cast<size_t>(in_size) || validation_out_values[i].size() != static_cast<size_t>(mOutSize)) {
+                    delete mFirstLayer;
+                    throw std::runtime_error("AsyncValidator - Validation samples must match the layer sizes!");
+                }
+                mValidationOut.insert(mValidationOut.end(), validation_out_values[i].begin(), validation_out_values[i].end());
+            }
+            mOutputs.resize(mValidationOut.size());
+
+            mThread = std::thread(&AsyncValidator::run, this);
+        }
+
+        ~AsyncValidator()
+        {
+            {
+                std::lock_guard<std::mutex> lock(mMutex);
+                mQuit = true;
+            }
+            mCondition.notify_all();
+            mThread.join();
+            mQueue.finish();
+            delete mFirstLayer;
+        }
+
+        /**
+         * @brief Snapshots the weights of the network of first_layer, after
+         * the commands already enqueued on queue, for validation in the
+         * background. Returns false, without snapshot, if the previous one
+         * is still being validated or the network has already converged.
+         */
+        bool submit(NLayer* first_layer, cl::CommandQueue& queue, int iteration)
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            if(mBusy || mConverged) {
+                if(mBusy) mStats.skipped++;
+                return false;
+            }
+            mCopied.clear();
+            NLayer* layer = first_layer;
+            for(size_t l=0; l+1 < mLayers.size(); l++, layer = layer->getNextLayer()) {
+                cl::Event copied;
+                layer->enqueueCopyWeights(*mLayers[l], LaunchOrder(&copied, nullptr, &queue));
+                mCopied.push_back(copied);
+            }
+            queue.flush();
+            mIteration = iteration;
+            mBusy = true;
+            mCondition.notify_all();
+            return true;
+        }
+
+        /**
+         * @brief Whether a validated snapshot has converged. Rethrows the
+         * failure of the last validation, if any.
+         */
+        bool hasConverged() {
+            if(mFailed.load(std::memory_order_relaxed)) rethrowError();
+            return mConverged.load(std::memory_order_relaxed);
+        }
+
+        /**
+         * @brief Waits for the validation in progress, if any, and rethrows
+         * its failure
+         */
+        void wait()
+        {
+            waitIdle();
+            rethrowError();
+        }
+
+        /**
+         * @brief Forgets the previous validations, before a new training
+         */
+        void reset()
+        {
+            waitIdle();
+            std::lock_guard<std::mutex> lock(mMutex);
+            mError = nullptr;
+            mFailed = false;
+            mConverged = false;
+            mStats = Stats();
+        }
+
+        /**
+         * @brief Copies the weights of the snapshot that converged back into
+         * the network of first_layer (training went on after the snapshot)
+         */
+        void enqueueRestore(NLayer* first_layer, cl::CommandQueue& queue)
+        {
+            wait();
+            if(!hasConverged()) throw std::runtime_error("AsyncValidator::enqueueRestore - No snapshot has converged");
+            NLayer* layer = first_layer;
+            for(size_t l=0; l+1 < mLayers.size(); l++, layer = layer->getNextLayer()) {
+                mLayers[l]->enqueueCopyWeights(*layer, LaunchOrder::inOrder(&queue));
+            }
+            queue.finish();
+        }
+
+        Stats getStats()
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            return mStats;
+        }
+};
+
+#endif
@@ -0,0 +1,281 @@
+#include <CL/cl.hpp>
+#include <chrono>
+#include <cstring>
+#include <iomanip>
+#include <thread>
+
+#include <unistd.h>
+
+#include "data_parallel_trainer.hpp"
+#include "mixed_precision_trainer.hpp"
+#include "model_batch.hpp"
+#include "perceptron.hpp"
+#include "sparse_perceptron.hpp"
+
+
+using namespace std;
+
+/**
+ * Micro-benchmarks of the perceptron kernels
+ *
+ * Usage: perceptron_benchmark [--device cpu|gpu] [--vendor amd|intel|nvidia]
+ *                             [--size neurons] [--repetitions n]
+ *
+ * Times are averaged over the repetitions, in milliseconds per launch.
+ **/
+
+struct Kernels
+{
+    cl::Kernel run;
+    cl::Kernel trainOutputLayer;
+    cl::Kernel trainBackpropagate;
+    cl::Kernel trainUpdateWeights;
+
+    Kernels(cl::Program& program) :
+        run(program, "perceptron"),
+        trainOutputLayer(program, "perceptron_train_output_layer"),
+        trainBackpropagate(program, "perceptron_train_backpropagate"),
+        trainUpdateWeights(program, "perceptron_train_update_weights") {}
+};
+
+template<typename Launch>
+double millisecondsPerLaunch(cl::CommandQueue& queue, int repetitions, Launch launch)
+{
+    // Warm up
+    launch();
+    queue.finish();
+
+    auto start = std::chrono::steady_clock::now();
+    for(int i=0; i<repetitions; i++) {
+        launch();
+    }
+    queue.finish();
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+    return elapsed.count() / repetitions;
+}
+
+/**
+ * @brief Forward pass, backpropagation and weight update of a size x size
+ * layer, for each weight layout
+ */
+void benchmarkWeightLayouts(cl::Context& context, cl::CommandQueue& queue, Kernels& kernels, int size, int repetitions)
+{
+    cout << "Weight layouts (" << size << "x" << size << " weights)" << endl;
+    cout << setw(12) << "layout" << setw(14) << "forward" << setw(14) << "backward" << setw(14) << "update" << endl;
+
+    const WeightLayout layouts[] = {WeightLayout::RowMajor, WeightLayout::Mirrored};
+    const char* names[] = {"row-major", "mirrored"};
+    for(int i=0; i<2; i++) {
+        Perceptron<cl_float> perceptron(context, queue);
+        perceptron.setWeightLayout(layouts[i]);
+        perceptron.createLayer(size);
+        perceptron.createLayer(size);
+        perceptron.createLayer(size);
+        perceptron.upload();
+
+        StepPlan<cl_float>& plan = perceptron.getStepPlan(kernels.run, kernels.trainOutputLayer, kernels.trainBackpropagate, kernels.trainUpdateWeights, 0.1f);
+        const LaunchOrder order = LaunchOrder::inOrder(&queue);
+
+        double forward = millisecondsPerLaunch(queue, repetitions, [&]() { plan.enqueueForward(0, order); });
+        double backward = millisecondsPerLaunch(queue, repetitions, [&]() { plan.enqueueBackpropagate(1, order); });
+        double update = millisecondsPerLaunch(queue, repetitions, [&]() { plan.enqueueUpdateWeights(1, order); });
+        cout << setw(12) << names[i] << setw(14) << forward << setw(14) << backward << setw(14) << update << endl;
+    }
+    cout << endl;
+}
+
+/**
+ * @brief Inference of a network of three size-wide layers, dense and after
+ * magnitude pruning
+ */
+void benchmarkSparsity(cl::Context& context, cl::CommandQueue& queue, cl::Program& program, Kernels& kernels, int size, int repetitions)
+{
+    cout << "Sparse inference (3 layers of " << size << " neurons)" << endl;
+    cout << setw(12) << "sparsity" << setw(14) << "run" << setw(14) << "speedup" << endl;
+
+    Perceptron<cl_float> dense(context, queue);
+    dense.createLayer(size);
+    dense.createLayer(size);
+    dense.createLayer(size);
+    dense.upload();
+    StepPlan<cl_float>& plan = dense.getStepPlan(kernels.run, kernels.trainOutputLayer, kernels.trainBackpropagate, kernels.trainUpdateWeights, 0.1f);
+    double dense_time = millisecondsPerLaunch(queue, repetitions, [&]() { plan.enqueueRun(); });
+    cout << setw(12) << "dense" << setw(14) << dense_time << setw(14) << 1. << endl;
+
+    const float sparsities[] = {0.5f, 0.8f, 0.9f, 0.95f};
+    for(float sparsity : sparsities) {
+        SparsePerceptron<cl_float> sparse(dense, sparsity, context, queue, program);
+        double time = millisecondsPerLaunch(queue, repetitions, [&]() { sparse.run(); });
+        cout << setw(12) << sparsity << setw(14) << time << setw(14) << dense_time / time << endl;
+    }
+    cout << endl;
+}
+
+/**
+ * @brief Data-parallel training of a student network to imitate a random
+ * teacher network of the same topology, by 4 workers (threads, each with its
+ * own queue and ring connection), for each gradient compression.
+ * Reports the bytes each worker sends per step, the compression ratio of the
+ * changes, and the test error after the same number of steps.
+ */
+void benchmarkGradientCompression(cl::Context& context, cl::CommandQueue& queue, cl::Program& program, Kernels& kernels, int size)
+{
+    const int nb_workers = 4;
+    const int steps = 500;
+    const std::vector<int> sizes = {32, std::max(size / 4, 8), 8};
+    cout << "Gradient compression (" << nb_workers << " workers, " << sizes[0] << "-" << sizes[1] << "-" << sizes[2] << " network, " << steps << " steps)" << endl;
+    cout << setw(12) << "format" << setw(16) << "bytes/step" << setw(14) << "ratio" << setw(14) << "test mse" << setw(14) << "seconds" << endl;
+
+    // Samples labelled by the teacher
+    Perceptron<cl_float> teacher(context, queue);
+    for(int layer_size : sizes) teacher.createLayer(layer_size);
+    teacher.initWeights(WeightInit::Uniform, 1);
+    teacher.upload();
+    std::vector<std::vector<cl_float>> inputs(nb_workers * steps + 256), outputs(inputs.size());
+    std::mt19937 eng(2);
+    std::uniform_real_distribution<float> distr(0.f, 1.f);
+    for(size_t i=0; i < inputs.size(); i++) {
+        inputs[i].resize(sizes[0]);
+        for(cl_float& x : inputs[i]) x = distr(eng);
+        teacher.predict(kernels.run, inputs[i], outputs[i]).wait();
+    }
+    const size_t first_test = nb_workers * steps;
+
+    const GradientCompression formats[] = {GradientCompression::None, GradientCompression::TopK, GradientCompression::Int8, GradientCompression::Sign};
+    const char* names[] = {"fp32", "top-1%", "int8", "sign"};
+    for(int f=0; f < 4; f++) {
+        const std::string prefix = "/tmp/perceptron_benchmark_" + std::to_string(getpid());
+        double mse = 0., seconds = 0.;
+        size_t bytes_sent = 0, dense_bytes = 0, compressed_bytes = 0;
+
+        auto worker = [&](int rank) {
+            cl::Device device = context.getInfo<CL_CONTEXT_DEVICES>()[0];
+            cl::CommandQueue worker_queue(context, device);
+            Kernels worker_kernels(program);
+            Perceptron<cl_float> student(context, worker_queue);
+            for(int layer_size : sizes) student.createLayer(layer_size);
+            student.initWeights(WeightInit::Uniform, 3);
+            student.upload();
+
+            RingAllReduce ring(prefix, rank, nb_workers);
+            DataParallelTrainer<cl_float> trainer(student, worker_queue, ring);
+            trainer.setCompression(formats[f], program);
+            StepPlan<cl_float>& plan = student.getStepPlan(worker_kernels.run, worker_kernels.trainOutputLayer, worker_kernels.trainBackpropagate, worker_kernels.trainUpdateWeights, 0.5f);
+
+            auto start = std::chrono::steady_clock::now();
+            for(int step=0; step < steps; step++) {
+                const size_t sample = step * nb_workers + rank;
+                trainer.trainStep(plan, inputs[sample], outputs[sample]);
+            }
+            worker_queue.finish();
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+            if(rank != 0) return;
+            seconds = elapsed.count();
+            bytes_sent = ring.getStats().bytes_sent;
+            dense_bytes = trainer.getCompressionStats().dense_bytes;
+            compressed_bytes = trainer.getCompressionStats().compressed_bytes;
+            std::vector<cl_float> prediction;
+            for(size_t i = first_test; i < inputs.size(); i++) {
+                student.predict(worker_kernels.run, inputs[i], prediction).wait();
+                for(size_t k=0; k < prediction.size(); k++) {
+                    mse += (prediction[k] - outputs[i][k]) * (prediction[k] - outputs[i][k]);
+                }
+            }
+            mse /= (inputs.size() - first_test) * prediction.size();
+        };
+        std::vector<std::thread> threads;
+        for(int rank=0; rank < nb_workers; rank++) threads.push_back(std::thread(worker, rank));
+        for(std::thread& thread : threads) thread.join();
+
+        const double ratio = (compressed_bytes == 0) ? 1. : static_cast<double>(dense_bytes) / compressed_bytes;
+        cout << setw(12) << names[f] << setw(16) << bytes_sent / steps << setw(14) << ratio << setw(14) << mse << setw(14) << seconds << endl;
+    }
+    cout << endl;
+}
+
+/**
+ * @brief Training steps of K 2-2-1 XOR networks: one Perceptron after the
+ * other, and all of them in a ModelBatch
+ */
+void benchmarkModelBatch(cl::Context& context, cl::CommandQueue& queue, cl::Program& program, Kernels& kernels, int repetitions)
+{
+    cout << "Model batch (2-2-1 networks, milliseconds per step of all the networks)" << endl;
+    cout << setw(12) << "networks" << setw(14) << "separate" << setw(14) << "batch" << setw(14) << "speedup" << endl;
+
+    Perceptron<cl_float> single(context, queue);
+    single.createLayer(2);
+    single.createLayer(2);
+    single.createLayer(1);
+    single.initWeights(WeightInit::Uniform, 1);
+    single.upload();
+    StepPlan<cl_float>& plan = single.getStepPlan(kernels.run, kernels.trainOutputLayer, kernels.trainBackpropagate, kernels.trainUpdateWeights, 1.f);
+    // Launches do not depend on the other networks: K networks take K times longer
+    const double single_time = millisecondsPerLaunch(queue, repetitions, [&]() { plan.enqueueTrainStep({0, 1}, {1}); });
+
+    const int nb_networks[] = {1, 100, 1000, 10000};
+    for(int k : nb_networks) {
+        ModelBatch<cl_float> batch({2, 2, 1}, k, context, queue, program);
+        batch.initWeights(WeightInit::Uniform, 1);
+        const double time = millisecondsPerLaunch(queue, repetitions, [&]() { batch.trainStep({0, 1}, {1}); });
+        cout << setw(12) << k << setw(14) << single_time * k << setw(14) << time << setw(14) << single_time * k / time << endl;
+    }
+    cout << endl;
+}
+
+/**
+ * @brief Training step of a network of three size-wide layers, in single and
+ * in mixed precision
+ */
+void benchmarkMixedPrecision(cl::Context& context, cl::CommandQueue& queue, cl::Program& program, Kernels& kernels, int size, int repetitions)
+{
+    cout << "Mixed precision (" << size << "x" << size << " weights, milliseconds per training step)" << endl;
+
+    Perceptron<cl_float> perceptron(context, queue);
+    perceptron.createLayer(size);
+    perceptron.createLayer(size);
+    perceptron.createLayer(size);
+    perceptron.initWeights(WeightInit::Xavier, 1);
+    perceptron.upload();
+    const std::vector<cl_float> in(size, 0.5f);
+    const std::vector<cl_float> out(size, 1.f);
+
+    StepPlan<cl_float>& plan = perceptron.getStepPlan(kernels.run, kernels.trainOutputLayer, kernels.trainBackpropagate, kernels.trainUpdateWeights, 0.1f);
+    const double single = millisecondsPerLaunch(queue, repetitions, [&]() { plan.enqueueTrainStep(in, out); });
+
+    MixedPrecisionTrainer<cl_float> trainer(context, queue, program, perceptron, 0.1f);
+    const double mixed = millisecondsPerLaunch(queue, repetitions, [&]() { trainer.trainStep(in, out); });
+    cout << setw(12) << "single" << setw(14) << single << endl;
+    cout << setw(12) << (trainer.isNativeHalf() ? "mixed" : "fp16 storage") << setw(14) << mixed << setw(14) << single / mixed << "x" << endl;
+    cout << "loss scale: " << trainer.getStats().scale << ", skipped steps: " << trainer.getStats().skipped_steps << endl;
+    cout << endl;
+}
+
+int main(int argc, char **argv)
+{
+    int size = 2048;
+    int repetitions = 20;
+    for(int i = 0; i < argc-1; i++) {
+        if(strcmp(argv[i], "--size") == 0) {
+            size = atoi(argv[++i]);
+        } else if(strcmp(argv[i], "--repetitions") == 0) {
+            repetitions = atoi(argv[++i]);
+        }
+    }
+
+    cl::Context context = createCLContextFromArguments(argc, argv);
+    cl::Device device = context.getInfo<CL_CONTEXT_DEVICES>()[0];
+    cout << "Using device: " << device.getInfo<CL_DEVICE_NAME>() << endl << endl;
+
+    cl::CommandQueue queue(context, device);
+    cl::Program program = buildProgramFromSource(context, "../src/perceptron_layer.cl");
+    Kernels kernels(program);
+
+    benchmarkWeightLayouts(context, queue, kernels, size, repetitions);
+    benchmarkSparsity(context, queue, program, kernels, size, repetitions);
+    benchmarkModelBatch(context, queue, program, kernels, repetitions);
+    benchmarkGradientCompression(context, queue, program, kernels, size);
+    benchmarkMixedPrecision(context, queue, program, kernels, size, repetitions);
+
+    return 0;
+}
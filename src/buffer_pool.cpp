@@ -0,0 +1,120 @@
+#include "buffer_pool.hpp"
+
+BufferPool::BufferPool(const cl::Context& context) : mContext(context)
+{
+}
+
+namespace {
+
+std::mutex pools_mutex;
+std::map<cl_context, std::shared_ptr<BufferPool>> pools;
+
+}
+
+BufferPool& BufferPool::forContext(const cl::Context& context)
+{
+    return *sharedForContext(context);
+}
+
+std::shared_ptr<BufferPool> BufferPool::sharedForContext(const cl::Context& context)
+{
+    std::lock_guard<std::mutex> lock(pools_mutex);
+    std::shared_ptr<BufferPool>& pool = pools[context()];
+    if(!pool) pool = std::make_shared<BufferPool>(context);
+    return pool;
+}
+
+void BufferPool::releaseContext(const cl::Context& context)
+{
+    std::shared_ptr<BufferPool> pool;
+    {
+        std::lock_guard<std::mutex> lock(pools_mutex);
+        auto found = pools.find(context());
+        if(found == pools.end()) return;
+        pool = found->second;
+        pools.erase(found);
+    }
+    pool->trim();
+}
+
+size_t BufferPool::sizeClass(size_t size)
+{
+    size_t size_class = MIN_SIZE_CLASS;
+    while(size_class < size) size_class *= 2;
+    return size_class;
+}
+
+cl::Buffer BufferPool::acquire(size_t size, cl_mem_flags flags)
+{
+    const Key key(flags, sizeClass(size));
+
+    std::lock_guard<std::mutex> lock(mMutex);
+    cl::Buffer buffer;
+    std::vector<cl::Buffer>& free_buffers = mFree[key];
+    if(free_buffers.empty()) {
+        buffer = cl::Buffer(mContext, flags, key.second);
+        mStats.misses++;
+        mStats.bytes_held += key.second;
+    } else {
+        buffer = free_buffers.back();
+        free_buffers.pop_back();
+        mStats.hits++;
+    }
+    mStats.bytes_in_use += key.second;
+    mInUse[buffer()] = key;
+    return buffer;
+}
+
+void BufferPool::release(const cl::Buffer& buffer)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    auto found = mInUse.find(buffer());
+    if(found == mInUse.end()) return;
+
+    const Key key = found->second;
+    mInUse.erase(found);
+    mStats.bytes_in_use -= key.second;
+    mFree[key].push_back(buffer);
+}
+
+void BufferPool::trim()
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    for(auto& free_buffers : mFree) {
+        mStats.bytes_held -= free_buffers.first.second * free_buffers.second.size();
+    }
+    mFree.clear();
+}
+
+BufferPool::Stats BufferPool::getStats() const
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mStats;
+}
+
+PooledBuffer::PooledBuffer(const std::shared_ptr<BufferPool>& pool, size_t size, cl_mem_flags flags) : mPool(pool), mBuffer(pool->acquire(size, flags))
+{
+}
+
+PooledBuffer::PooledBuffer(PooledBuffer&& other) : mPool(std::move(other.mPool)), mBuffer(other.mBuffer)
+{
+    other.mBuffer = cl::Buffer();
+}
+
+PooledBuffer& PooledBuffer::operator=(PooledBuffer&& other)
+{
+    if(this != &other) {
+        reset();
+        mPool = std::move(other.mPool);
+        mBuffer = other.mBuffer;
+        other.mBuffer = cl::Buffer();
+    }
+    return *this;
+}
+
+void PooledBuffer::reset()
+{
+    if(mPool && mBuffer() != nullptr) mPool->release(mBuffer);
+    mPool.reset();
+    mBuffer = cl::Buffer();
+}
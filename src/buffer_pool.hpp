@@ -0,0 +1,150 @@
+#ifndef __BUFFER_POOL_HPP__
+#define __BUFFER_POOL_HPP__
+
+#include "openCLUtilities.hpp"
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+/**
+ * BufferPool
+ * ==========
+ *
+ * Recycles the scratch device buffers of training (delta of each layer,
+ * expected output, see StepPlan).
+ *
+ * Creating buffers costs a driver call and fragments the device memory, which
+ * shows when many short training runs (or many small models) are started one
+ * after the other. Released buffers are kept by the pool of their context and
+ * handed out again to the next request of the same size class.
+ *
+ * Sizes are rounded up to the next power of two (with a minimum), so that
+ * slightly different topologies share the same buffers. An acquired buffer
+ * may thus be larger than requested.
+ *
+ * There is one pool per context (see forContext), shared by all the models of
+ * the context. Pools are thread safe. A pool holds its context (and its free
+ * buffers) until releaseContext is called.
+ *
+ * How to use
+ * ----------
+ * BufferPool& pool = BufferPool::forContext(context);
+ * cl::Buffer delta = pool.acquire(sizeof(float) * size);
+ * ...
+ * pool.release(delta);
+ *
+ * Or, given back automatically:
+ * std::shared_ptr<BufferPool> pool = BufferPool::sharedForContext(context);
+ * PooledBuffer delta(pool, sizeof(float) * size);
+ * ...
+ * BufferPool::releaseContext(context);
+ */
+class BufferPool
+{
+    public:
+        struct Stats {
+            // Requests served by a recycled buffer
+            size_t hits = 0;
+            // Requests that created a new buffer
+            size_t misses = 0;
+            // Device memory of the buffers created by the pool, in use or not
+            size_t bytes_held = 0;
+            // Part of bytes_held currently handed out
+            size_t bytes_in_use = 0;
+        };
+
+        explicit BufferPool(const cl::Context& context);
+
+        /**
+         * @brief Pool of context, created on first use
+         */
+        static BufferPool& forContext(const cl::Context& context);
+
+        /**
+         * @brief Same as forContext, the pool stays alive as long as the
+         * returned pointer, even after releaseContext
+         */
+        static std::shared_ptr<BufferPool> sharedForContext(const cl::Context& context);
+
+        /**
+         * @brief Drops the pool of context and its free buffers, so that the
+         * context can be released. Buffers still handed out keep their pool
+         * alive until they are given back (see PooledBuffer).
+         */
+        static void releaseContext(const cl::Context& context);
+
+        /**
+         * @brief A buffer of at least size bytes. Should be given back with
+         * release once its last user is done with it.
+         */
+        cl::Buffer acquire(size_t size, cl_mem_flags flags = CL_MEM_READ_WRITE);
+
+        /**
+         * @brief Makes buffer available to the next acquire. The caller must
+         * not use it anymore, nor any command still enqueued on it.
+         * Buffers that were not acquired from this pool are ignored.
+         */
+        void release(const cl::Buffer& buffer);
+
+        /**
+         * @brief Frees the buffers that are not handed out
+         */
+        void trim();
+
+        Stats getStats() const;
+
+    private:
+        static const size_t MIN_SIZE_CLASS = 256;
+
+        static size_t sizeClass(size_t size);
+
+        typedef std::pair<cl_mem_flags, size_t> Key;
+
+        cl::Context mContext;
+        mutable std::mutex mMutex;
+        std::map<Key, std::vector<cl::Buffer>> mFree;
+        // Key of every buffer handed out
+        std::map<cl_mem, Key> mInUse;
+        Stats mStats;
+};
+
+/**
+ * @brief Buffer acquired from a BufferPool, given back when the handle is
+ * destroyed. The handle keeps its pool alive.
+ */
+class PooledBuffer
+{
+    public:
+        PooledBuffer() {}
+
+        PooledBuffer(const std::shared_ptr<BufferPool>& pool, size_t size, cl_mem_flags flags = CL_MEM_READ_WRITE);
+
+        PooledBuffer(PooledBuffer&& other);
+        PooledBuffer& operator=(PooledBuffer&& other);
+
+        PooledBuffer(const PooledBuffer&) = delete;
+        PooledBuffer& operator=(const PooledBuffer&) = delete;
+
+        ~PooledBuffer() {
+            reset();
+        }
+
+        /**
+         * @brief Gives the buffer back to its pool. The caller must not use
+         * it anymore, nor any command still enqueued on it.
+         */
+        void reset();
+
+        cl::Buffer& get() {
+            return mBuffer;
+        }
+
+    private:
+        std::shared_ptr<BufferPool> mPool;
+        cl::Buffer mBuffer;
+};
+
+#endif
@@ -0,0 +1,215 @@
+#ifndef __DATA_PARALLEL_TRAINER_HPP__
+#define __DATA_PARALLEL_TRAINER_HPP__
+
+#include "perceptron.hpp"
+#include "gradient_compressor.hpp"
+#include "ring_allreduce.hpp"
+
+#include <memory>
+
+#include <stdexcept>
+#include <vector>
+
+/**
+ * DataParallelTrainer
+ * ===================
+ *
+ * Synchronous data-parallel training: N processes of a host each train a
+ * replica of the same perceptron on their own samples, and after every step
+ * the replicas are averaged, so that they stay identical.
+ *
+ * Each step runs the existing training kernels (StepPlan) on the local
+ * sample. What a step changed in the weights of a layer (its gradient, scaled
+ * by epsilon) is summed across the processes by a ring all-reduce (see
+ * RingAllReduce), and every process applies the average of the changes to
+ * the weights agreed on at the previous step.
+ *
+ * Communication overlaps computation: the backward pass runs from the last
+ * layer to the first, and the weights of each layer are read back as soon as
+ * they are updated. The exchange of the last layers starts while the device
+ * still backpropagates into the first ones.
+ *
+ * Unlike ParameterServer, there is no server process and no stale weights:
+ * all the processes must call trainStep the same number of times.
+ *
+ * The changes can be compressed before the exchange (see setCompression and
+ * GradientCompressor): the compression and the application of the changes
+ * then run on the device, and only the compressed changes are read back.
+ *
+ * How to use
+ * ----------
+ * In each of the N processes (rank in [0, N)), once the perceptron is
+ * uploaded:
+ * RingAllReduce ring("/tmp/xor", rank, N);
+ * DataParallelTrainer<float> trainer(perceptron, queue, ring); // Weights of rank 0
+ * StepPlan<float>& plan = perceptron.getStepPlan(...);
+ * for(size_t i = rank; ...; i += N) {
+ *     trainer.trainStep(plan, training_in[i % size], training_out[i % size]);
+ * }
+ **/
+template<typename T>
+class DataParallelTrainer
+{
+    typedef NeuronLayer<T> NLayer;
+
+    private:
+        cl::CommandQueue mQueue;
+        RingAllReduce& mRing;
+        std::vector<NLayer*> mLayers;
+        // Weights agreed on by all the processes, per layer
+        std::vector<std::vector<T>> mShared;
+        // Weights after the local step, then their change
+        std::vector<std::vector<T>> mLocal;
+        std::vector<cl::Event> mRead;
+        // Per layer, when the changes are compressed
+        std::vector<std::unique_ptr<GradientCompressor<T>>> mCompressors;
+
+    public:
+        /**
+         * @brief Replaces the weights of perceptron by those of the process
+         * of rank 0. All the processes must build their trainer together.
+         */
+        DataParallelTrainer(Perceptron<T>& perceptron, cl::CommandQueue& queue, RingAllReduce& ring) : mQueue(queue), mRing(ring)
+        {
+            for(NLayer* layer = perceptron.getFirstLayer(); layer != nullptr; layer = layer->getNextLayer()) {
+                mLayers.push_back(layer);
+            }
+            if(mLayers.size() < 2) {
+                throw std::runtime_error("DataParallelTrainer - You must have more than one layer to train a perceptron !");
+            }
+            for(size_t l=0; l+1 < mLayers.size(); l++) {
+                if(mLayers[l]->isSharedVirtualMemory()) {
+                    throw std::runtime_error("DataParallelTrainer - Layers in shared virtual memory are not supported");
+                }
+                mShared.push_back(std::vector<T>(mLayers[l]->getNbWeights()));
+                mLocal.push_back(std::vector<T>(mLayers[l]->getNbWeights()));
+            }
+            mRead.resize(mShared.size());
+            broadcastWeights();
+        }
+
+        /**
+         * @brief Trains the replica on one sample, and averages the change
+         * of the weights with the other processes
+         */
+        void trainStep(StepPlan<T>& plan, const std::vector<T>& training_in, const std::vector<T>& training_out)
+        {
+            const int n = plan.getNbLayers();
+            const LaunchOrder order = LaunchOrder::inOrder(&mQueue);
+            if(n != static_cast<int>(mLayers.size())) {
+                throw std::runtime_error("DataParallelTrainer::trainStep - The plan does not match the perceptron");
+            }
+            if(training_out.size() != static_cast<size_t>(mLayers[n-1]->getSize()-1)) {
+                throw std::runtime_error("DataParallelTrainer::trainStep - Expected output size must match the output layer size!");
+            }
+
+            mLayers[0]->setValues(training_in);
+            mLayers[0]->uploadInputValues(order);
+            mQueue.enqueueWriteBuffer(plan.getExpectedOutputBuf(), CL_FALSE, 0, sizeof(T)*training_out.size(), training_out.data());
+            for(int l=0; l < n-1; l++) {
+                plan.enqueueForward(l, order);
+            }
+            plan.enqueueOutputDelta(order);
+
+            // The backpropagation into layer l reads its weights before they
+            // are updated
+            for(int l=n-2; l >= 0; l--) {
+                if(plan.isFused()) {
+                    plan.enqueueBackpropagateUpdateWeights(l, order);
+                } else {
+                    if(l >= 1) plan.enqueueBackpropagate(l, order);
+                    plan.enqueueUpdateWeights(l, order);
+                }
+                if(!mCompressors.empty()) {
+                    mCompressors[l]->enqueueCompress();
+                } else {
+                    mQueue.enqueueReadBuffer(mLayers[l]->getWeightsBuf(), CL_FALSE, 0, sizeof(T) * mLocal[l].size(), mLocal[l].data(), nullptr, &mRead[l]);
+                }
+                // Starts the device before the first exchange
+                mQueue.flush();
+            }
+
+            // In the same order as the reads: the device keeps working on the
+            // first layers during the exchanges
+            const float scale = 1.f / mRing.getNbProcesses();
+            if(!mCompressors.empty()) {
+                for(int l=n-2; l >= 0; l--) {
+                    mCompressors[l]->exchange(mRing);
+                    mCompressors[l]->enqueueDecompress(scale);
+                }
+                return;
+            }
+            for(int l=n-2; l >= 0; l--) {
+                mRead[l].wait();
+                std::vector<T>& change = mLocal[l];
+                std::vector<T>& shared = mShared[l];
+                for(size_t i=0; i < change.size(); i++) change[i] -= shared[i];
+                mRing.allReduce(change.data(), change.size());
+                for(size_t i=0; i < change.size(); i++) shared[i] += change[i] * scale;
+                mLayers[l]->setWeights(shared.data());
+            }
+        }
+
+        /**
+         * @brief Exchanges the changes of the weights in the format mode from
+         * now on (kernels of program). With TopK, about top_k_ratio of the
+         * changes of each layer are sent at each step.
+         * All the processes must switch together.
+         */
+        void setCompression(GradientCompression mode, cl::Program& program, float top_k_ratio = 0.01f)
+        {
+            // The weights agreed on are now kept on the device, or on the host
+            if(!mCompressors.empty()) {
+                mQueue.finish();
+                for(size_t l=0; l < mShared.size(); l++) {
+                    const T* weights = mLayers[l]->getWeights();
+                    std::copy(weights, weights + mShared[l].size(), mShared[l].begin());
+                }
+            }
+            mCompressors.clear();
+            if(mode == GradientCompression::None) return;
+
+            cl::Context context = mQueue.getInfo<CL_QUEUE_CONTEXT>();
+            for(size_t l=0; l < mShared.size(); l++) {
+                mCompressors.push_back(std::unique_ptr<GradientCompressor<T>>(new GradientCompressor<T>(context, mQueue, program, mLayers[l], mode, mRing.getNbProcesses(), top_k_ratio)));
+                mCompressors[l]->setSharedWeights(mShared[l].data());
+            }
+        }
+
+        /**
+         * @brief Size of the changes exchanged by this process, before and
+         * after compression (all layers)
+         */
+        typename GradientCompressor<T>::Stats getCompressionStats() const
+        {
+            typename GradientCompressor<T>::Stats stats;
+            for(const auto& compressor : mCompressors) {
+                stats.exchanges = compressor->getStats().exchanges;
+                stats.dense_bytes += compressor->getStats().dense_bytes;
+                stats.compressed_bytes += compressor->getStats().compressed_bytes;
+            }
+            return stats;
+        }
+
+        const RingAllReduce::Stats& getStats() const {
+            return mRing.getStats();
+        }
+
+    private:
+        /**
+         * @brief Sum in which only rank 0 contributes
+         */
+        void broadcastWeights()
+        {
+            for(size_t l=0; l < mShared.size(); l++) {
+                if(mRing.getRank() == 0) {
+                    const T* weights = mLayers[l]->getWeights();
+                    std::copy(weights, weights + mShared[l].size(), mShared[l].begin());
+                }
+                mRing.allReduce(mShared[l].data(), mShared[l].size());
+                mLayers[l]->setWeights(mShared[l].data());
+            }
+        }
+};
+
+#endif
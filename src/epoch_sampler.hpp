@@ -0,0 +1,142 @@
+#ifndef __EPOCH_SAMPLER_HPP__
+#define __EPOCH_SAMPLER_HPP__
+
+#include "perceptron_layer.hpp"
+#include "permutation.hpp"
+
+#include <limits>
+#include <vector>
+
+/**
+ * EpochSampler
+ * ============
+ *
+ * Training set on the device, visited in a new random order at each epoch
+ * (see the kernels of the epoch loop).
+ *
+ * The samples are uploaded once. enqueueShuffle computes the order of an
+ * epoch on the device, and enqueueGather copies the sample of a step into
+ * the input layer and the expected output buffer of a StepPlan: a training
+ * step has no upload, and shuffling no host pass over the samples.
+ * The order of the samples is known on the host too (getSampleIndex).
+ *
+ * How to use
+ * ----------
+ * EpochSampler<float> sampler(context, queue, kernel, first_layer, plan.getExpectedOutputBuf(), training_in, training_out, seed);
+ * for(uint32_t epoch = 0; ...; epoch++) {
+ *     sampler.enqueueShuffle(epoch);
+ *     for(uint32_t step = 0; step < sampler.getNbSamples(); step++) {
+ *         sampler.enqueueGather(step, order);
+ *         plan.enqueueTrainStages(order);
+ *     }
+ * }
+ **/
+template<typename T>
+class EpochSampler
+{
+    typedef NeuronLayer<T> NLayer;
+
+    private:
+        cl::CommandQueue mQueue;
+        NLayer* mInputLayer;
+        cl_uint mNbSamples;
+        uint64_t mSeed;
+        cl::Buffer mInputs;
+        cl::Buffer mOutputs;
+        cl::Buffer mPermutation;
+        cl::Kernel mShuffle;
+        BoundKernel mGather;
+
+        /**
+         * @brief Uploads the samples, one after the other
+         */
+        cl::Buffer upload(cl::Context& context, const std::vector<std::vector<T>>& samples, size_t size, const char* what)
+        {
+            std::vector<T> stacked(size * samples.size());
+            for(size_t i=0; i < samples.size(); i++) {
+                if(samples[i].size() != size) {
+                    throw std::runtime_error(std::string("EpochSampler - ") + what + " size must match the layer size!");
+                }
+                std::copy(samples[i].begin(), samples[i].end(), stacked.begin() + i * size);
+            }
+            cl::Buffer buffer(context, CL_MEM_READ_ONLY, sizeof(T) * stacked.size());
+            mQueue.enqueueWriteBuffer(buffer, CL_TRUE, 0, sizeof(T) * stacked.size(), stacked.data());
+            return buffer;
+        }
+
+    public:
+        /**
+         * @brief Uploads the training set, for the input layer input_layer
+         * and the expected output buffer expected_out (bias excluded). The
+         * kernels come from the program of kernel. seed picks the orders of
+         * the epochs.
+         */
+        EpochSampler(cl::Context& context, cl::CommandQueue& queue, const cl::Kernel& kernel, NLayer* input_layer, const cl::Buffer& expected_out, const std::vector<std::vector<T>>& training_in_values, const std::vector<std::vector<T>>& training_out_values, uint64_t seed) : mQueue(queue), mInputLayer(input_layer), mSeed(seed)
+        {
+            if(training_in_values.empty() || training_in_values.size() != training_out_values.size()) {
+                throw std::runtime_error("EpochSampler - Training input and output size must match!");
+            }
+            if(training_in_values.size() > std::numeric_limits<cl_uint>::max()) {
+                throw std::runtime_error("EpochSampler - Too many samples");
+            }
+            mNbSamples = training_in_values.size();
+            const cl_int in_size = input_layer->getSize()-1;
+            const cl_int out_size = training_out_values[0].size();
+            mInputs = upload(context, training_in_values, in_size, "Input");
+            mOutputs = upload(context, training_out_values, out_size, "Output");
+            mPermutation = cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(cl_uint) * mNbSamples);
+
+            mShuffle = cloneKernel(kernel, "perceptron_shuffle");
+            mShuffle.setArg(0, mNbSamples);
+            mShuffle.setArg(1, static_cast<cl_uint>(permutation::halfBits(mNbSamples)));
+            mShuffle.setArg(2, static_cast<cl_uint>(seed));
+            mShuffle.setArg(3, static_cast<cl_uint>(seed >> 32));
+            mShuffle.setArg(5, mPermutation);
+
+            mGather.kernel = cloneKernel(kernel, "perceptron_gather_sample");
+            mGather.global = cl::NDRange(std::max(in_size, out_size));
+            mGather.local = cl::NullRange;
+            mGather.writes = WritesValues;
+            mGather.kernel.setArg(1, in_size);
+            mGather.kernel.setArg(2, out_size);
+            mGather.kernel.setArg(3, mPermutation);
+            mGather.kernel.setArg(4, mInputs);
+            mGather.kernel.setArg(5, mOutputs);
+            input_layer->setValuesArg(mGather.kernel, 6);
+            mGather.kernel.setArg(7, expected_out);
+        }
+
+        cl_uint getNbSamples() const {
+            return mNbSamples;
+        }
+
+        /**
+         * @brief Enqueues the computation of the order of the samples of epoch
+         */
+        void enqueueShuffle(cl_uint epoch)
+        {
+            mShuffle.setArg(4, epoch);
+            mQueue.enqueueNDRangeKernel(mShuffle, cl::NullRange, cl::NDRange(mNbSamples), cl::NullRange);
+        }
+
+        /**
+         * @brief Enqueues the copy of the sample of step (in the order of the
+         * last shuffle) into the input layer and the expected output
+         */
+        void enqueueGather(cl_uint step, const LaunchOrder& order = LaunchOrder())
+        {
+            mGather.kernel.setArg(0, step);
+            if(mInputLayer->enqueueBound(mGather, order) != CL_SUCCESS) {
+                throw std::runtime_error("EpochSampler::enqueueGather - Error running kernel");
+            }
+        }
+
+        /**
+         * @brief Index in the training set of the sample of step, in epoch
+         */
+        cl_uint getSampleIndex(cl_uint step, cl_uint epoch) const {
+            return permutation::index(step, mNbSamples, mSeed, epoch);
+        }
+};
+
+#endif
@@ -0,0 +1,342 @@
+#ifndef __GRADIENT_COMPRESSOR_HPP__
+#define __GRADIENT_COMPRESSOR_HPP__
+
+#include "perceptron_layer.hpp"
+#include "ring_allreduce.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <stdexcept>
+#include <vector>
+
+/**
+ * @brief Format of the weight changes exchanged by DataParallelTrainer
+ * - None: dense floats, summed by the ring all-reduce
+ * - TopK: the largest changes only (a fraction of them), with their indices
+ * - Int8: 8 bits per change, plus a scale per block of changes
+ * - Sign: 1 bit per change (its sign), plus a scale per block of changes
+ */
+enum class GradientCompression {
+    None,
+    TopK,
+    Int8,
+    Sign
+};
+
+/**
+ * GradientCompressor
+ * ==================
+ *
+ * Compressed exchange of the weight changes of one layer between the
+ * processes of a DataParallelTrainer.
+ *
+ * Compression and decompression run on the device (perceptron_compress_*
+ * kernels): only the compressed changes are read back, exchanged, and
+ * uploaded again. The device keeps the weights agreed on by all the
+ * processes (shared), and what the compression dropped (residual), which is
+ * added to the next changes (error feedback).
+ *
+ * Compressed changes cannot be summed as they travel around the ring: all
+ * the processes gather the changes of all the others (RingAllReduce::allGather),
+ * and apply them in the order of the ranks, so that they all get the same
+ * weights. Each process receives (N-1) compressed arrays, against 2 (N-1)/N
+ * dense arrays for the all-reduce: 8-bit quantization sends less when N < 8,
+ * 1-bit quantization when N < 64.
+ *
+ * The top-k threshold is adapted at each exchange, so that about top_k_ratio
+ * of the changes are above it. The changes above the threshold that do not
+ * fit are kept in the residual.
+ *
+ * How to use
+ * ----------
+ * Through DataParallelTrainer::setCompression.
+ */
+template<typename T>
+class GradientCompressor
+{
+    typedef NeuronLayer<T> NLayer;
+
+    public:
+        // Weights per scale of the quantized formats (COMPRESSION_BLOCK)
+        static const size_t BLOCK = 256;
+
+        struct Stats {
+            size_t exchanges = 0;
+            // Size of the changes before and after compression
+            size_t dense_bytes = 0;
+            size_t compressed_bytes = 0;
+        };
+
+    private:
+        NLayer* mLayer;
+        GradientCompression mMode;
+        size_t mNbWeights;
+        size_t mNbBlocks;
+        cl::CommandQueue mQueue;
+
+        cl::Buffer mShared;
+        cl::Buffer mResidual;
+        cl::Buffer mCount;
+        // Compressed changes of this process, and of all of them
+        cl::Buffer mIndices, mValues;
+        cl::Buffer mGatheredIndices, mGatheredValues;
+        cl::Buffer mScales, mGatheredScales;
+        cl::Buffer mQuantized, mGatheredQuantized;
+
+        BoundKernel mCompress;
+        BoundKernel mDecompress;
+        BoundKernel mApply;
+        cl_int mZero = 0;
+
+        // Top-k
+        size_t mCapacity = 0;
+        float mThreshold = -1.f;
+        // Changes above the threshold at the last compression
+        cl_int mSelected = 0;
+        std::vector<cl_uint> mHostIndices, mAllIndices;
+        std::vector<float> mHostValues, mAllValues;
+        std::vector<size_t> mCounts;
+
+        // Quantized formats
+        std::vector<float> mHostScales, mAllScales;
+        std::vector<cl_char> mHostInt8, mAllInt8;
+        std::vector<cl_uint> mHostSigns, mAllSigns;
+
+        cl::Event mRead;
+        Stats mStats;
+
+        size_t signWords() const {
+            return mNbBlocks * (BLOCK / 32);
+        }
+
+        BoundKernel bind(cl::Program& program, const char* name, size_t global, unsigned writes) const {
+            BoundKernel bound;
+            bound.kernel = cl::Kernel(program, name);
+            bound.global = cl::NDRange(global);
+            bound.local = cl::NullRange;
+            bound.writes = writes;
+            return bound;
+        }
+
+        void enqueue(const BoundKernel& bound) {
+            if(mLayer->enqueueBound(bound, LaunchOrder::inOrder(&mQueue)) != CL_SUCCESS) {
+                throw std::runtime_error("GradientCompressor - Error running kernel");
+            }
+        }
+
+        /**
+         * @brief First top-k threshold: magnitude of the k-th largest change
+         * of the first step, computed on the host
+         */
+        void initThreshold()
+        {
+            std::vector<T> weights(mNbWeights), shared(mNbWeights);
+            mQueue.enqueueReadBuffer(mLayer->getWeightsBuf(), CL_FALSE, 0, sizeof(T) * mNbWeights, weights.data());
+            mQueue.enqueueReadBuffer(mShared, CL_TRUE, 0, sizeof(T) * mNbWeights, shared.data());
+            for(size_t i=0; i < mNbWeights; i++) weights[i] = std::fabs(weights[i] - shared[i]);
+            std::nth_element(weights.begin(), weights.begin() + (mCapacity - 1), weights.end(), std::greater<T>());
+            mThreshold = weights[mCapacity - 1];
+        }
+
+    public:
+        /**
+         * @brief Compressor of the weights of layer, exchanged between
+         * nb_processes processes. The kernels come from program.
+         */
+        GradientCompressor(cl::Context& context, cl::CommandQueue& queue, cl::Program& program, NLayer* layer, GradientCompression mode, int nb_processes, float top_k_ratio = 0.01f) : mLayer(layer), mMode(mode), mNbWeights(layer->getNbWeights()), mNbBlocks((layer->getNbWeights() + BLOCK - 1) / BLOCK), mQueue(queue)
+        {
+            if(mode == GradientCompression::None) {
+                throw std::runtime_error("GradientCompressor - Dense changes are exchanged without compressor");
+            }
+            if(layer->getWeightLayout() != WeightLayout::RowMajor) {
+                throw std::runtime_error("GradientCompressor - Only the RowMajor weight layout is supported");
+            }
+            const size_t bytes = sizeof(T) * mNbWeights;
+            mShared = cl::Buffer(context, CL_MEM_READ_WRITE, bytes);
+            mResidual = cl::Buffer(context, CL_MEM_READ_WRITE, bytes);
+            const std::vector<T> zeros(mNbWeights, T(0));
+            mQueue.enqueueWriteBuffer(mResidual, CL_TRUE, 0, bytes, zeros.data());
+
+            const unsigned weights = WritesWeights;
+            switch(mode) {
+                case GradientCompression::TopK:
+                    if(mNbWeights > std::numeric_limits<cl_uint>::max()) {
+                        throw std::runtime_error("GradientCompressor - Top-k indices are 32 bits");
+                    }
+                    mCapacity = std::max<size_t>(1, static_cast<size_t>(std::ceil(top_k_ratio * mNbWeights)));
+                    mCount = cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(cl_int));
+                    mIndices = cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(cl_uint) * mCapacity);
+                    mValues = cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(float) * mCapacity);
+                    mGatheredIndices = cl::Buffer(context, CL_MEM_READ_ONLY, sizeof(cl_uint) * mCapacity * nb_processes);
+                    mGatheredValues = cl::Buffer(context, CL_MEM_READ_ONLY, sizeof(float) * mCapacity * nb_processes);
+                    mHostIndices.resize(mCapacity);
+                    mHostValues.resize(mCapacity);
+
+                    mCompress = bind(program, "perceptron_compress_topk", mNbWeights, WritesNothing);
+                    mCompress.kernel.setArg(1, static_cast<cl_int>(mCapacity));
+                    layer->setWeightsArg(mCompress.kernel, 2);
+                    mCompress.kernel.setArg(3, mShared);
+                    mCompress.kernel.setArg(4, mResidual);
+                    mCompress.kernel.setArg(5, mIndices);
+                    mCompress.kernel.setArg(6, mValues);
+                    mCompress.kernel.setArg(7, mCount);
+
+                    mDecompress = bind(program, "perceptron_decompress_topk", 0, WritesNothing);
+                    mDecompress.kernel.setArg(2, mGatheredIndices);
+                    mDecompress.kernel.setArg(3, mGatheredValues);
+                    mDecompress.kernel.setArg(4, mShared);
+
+                    mApply = bind(program, "perceptron_compress_apply", mNbWeights, weights);
+                    mApply.kernel.setArg(0, mShared);
+                    layer->setWeightsArg(mApply.kernel, 1);
+                    break;
+
+                case GradientCompression::Int8:
+                case GradientCompression::Sign: {
+                    const bool int8 = (mode == GradientCompression::Int8);
+                    const size_t quantized_bytes = int8 ? sizeof(cl_char) * mNbWeights : sizeof(cl_uint) * signWords();
+                    mScales = cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(float) * mNbBlocks);
+                    mGatheredScales = cl::Buffer(context, CL_MEM_READ_ONLY, sizeof(float) * mNbBlocks * nb_processes);
+                    mQuantized = cl::Buffer(context, CL_MEM_READ_WRITE, quantized_bytes);
+                    mGatheredQuantized = cl::Buffer(context, CL_MEM_READ_ONLY, quantized_bytes * nb_processes);
+                    mHostScales.resize(mNbBlocks);
+                    if(int8) mHostInt8.resize(mNbWeights);
+                    else mHostSigns.resize(signWords());
+
+                    mCompress = bind(program, int8 ? "perceptron_compress_int8" : "perceptron_compress_sign", mNbBlocks, WritesNothing);
+                    mCompress.kernel.setArg(0, static_cast<cl_ulong>(mNbWeights));
+                    layer->setWeightsArg(mCompress.kernel, 1);
+                    mCompress.kernel.setArg(2, mShared);
+                    mCompress.kernel.setArg(3, mResidual);
+                    mCompress.kernel.setArg(4, mScales);
+                    mCompress.kernel.setArg(5, mQuantized);
+
+                    mDecompress = bind(program, int8 ? "perceptron_decompress_int8" : "perceptron_decompress_sign", mNbWeights, weights);
+                    mDecompress.kernel.setArg(0, static_cast<cl_ulong>(mNbWeights));
+                    mDecompress.kernel.setArg(1, static_cast<cl_int>(nb_processes));
+                    mDecompress.kernel.setArg(3, mGatheredScales);
+                    mDecompress.kernel.setArg(4, mGatheredQuantized);
+                    mDecompress.kernel.setArg(5, mShared);
+                    layer->setWeightsArg(mDecompress.kernel, 6);
+                    break;
+                }
+
+                default:
+                    break;
+            }
+        }
+
+        GradientCompressor(const GradientCompressor&) = delete;
+        GradientCompressor& operator=(const GradientCompressor&) = delete;
+
+        /**
+         * @brief Uploads the weights agreed on by all the processes
+         */
+        void setSharedWeights(const T* shared) {
+            mQueue.enqueueWriteBuffer(mShared, CL_TRUE, 0, sizeof(T) * mNbWeights, shared);
+        }
+
+        /**
+         * @brief Enqueues the compression of the changes of the weights since
+         * the last exchange, and the read back of the result
+         */
+        void enqueueCompress()
+        {
+            if(mMode == GradientCompression::TopK) {
+                if(mThreshold < 0.f) initThreshold();
+                mCompress.kernel.setArg(0, mThreshold);
+                mQueue.enqueueWriteBuffer(mCount, CL_FALSE, 0, sizeof(cl_int), &mZero);
+                enqueue(mCompress);
+                mQueue.enqueueReadBuffer(mIndices, CL_FALSE, 0, sizeof(cl_uint) * mCapacity, mHostIndices.data());
+                mQueue.enqueueReadBuffer(mValues, CL_FALSE, 0, sizeof(float) * mCapacity, mHostValues.data());
+                mQueue.enqueueReadBuffer(mCount, CL_FALSE, 0, sizeof(cl_int), &mSelected, nullptr, &mRead);
+                return;
+            }
+            enqueue(mCompress);
+            mQueue.enqueueReadBuffer(mScales, CL_FALSE, 0, sizeof(float) * mNbBlocks, mHostScales.data());
+            if(mMode == GradientCompression::Int8) {
+                mQueue.enqueueReadBuffer(mQuantized, CL_FALSE, 0, sizeof(cl_char) * mNbWeights, mHostInt8.data(), nullptr, &mRead);
+            } else {
+                mQueue.enqueueReadBuffer(mQuantized, CL_FALSE, 0, sizeof(cl_uint) * signWords(), mHostSigns.data(), nullptr, &mRead);
+            }
+        }
+
+        /**
+         * @brief Waits for the compressed changes, exchanges them with the
+         * other processes, and enqueues their upload
+         */
+        void exchange(RingAllReduce& ring)
+        {
+            mRead.wait();
+            size_t bytes = 0;
+            if(mMode == GradientCompression::TopK) {
+                const size_t count = std::min<size_t>(mSelected, mCapacity);
+                // The values have as many entries as the indices
+                ring.allGather(mHostIndices.data(), count, mAllIndices, mCounts);
+                ring.allGather(mHostValues.data(), mCounts, mAllValues);
+                bytes = count * (sizeof(cl_uint) + sizeof(float));
+                if(!mAllIndices.empty()) {
+                    mQueue.enqueueWriteBuffer(mGatheredIndices, CL_FALSE, 0, sizeof(cl_uint) * mAllIndices.size(), mAllIndices.data());
+                    mQueue.enqueueWriteBuffer(mGatheredValues, CL_FALSE, 0, sizeof(float) * mAllValues.size(), mAllValues.data());
+                }
+                // About mCapacity changes above the threshold next time
+                const float ratio = static_cast<float>(mSelected) / mCapacity;
+                mThreshold *= std::min(2.f, std::max(0.5f, std::sqrt(ratio)));
+                // No change at all: estimated again at the next step
+                if(mThreshold <= 0.f) mThreshold = -1.f;
+            } else {
+                // Same topology in every process: the sizes are known
+                mCounts.assign(ring.getNbProcesses(), mHostScales.size());
+                ring.allGather(mHostScales.data(), mCounts, mAllScales);
+                mQueue.enqueueWriteBuffer(mGatheredScales, CL_FALSE, 0, sizeof(float) * mAllScales.size(), mAllScales.data());
+                if(mMode == GradientCompression::Int8) {
+                    mCounts.assign(ring.getNbProcesses(), mHostInt8.size());
+                    ring.allGather(mHostInt8.data(), mCounts, mAllInt8);
+                    mQueue.enqueueWriteBuffer(mGatheredQuantized, CL_FALSE, 0, sizeof(cl_char) * mAllInt8.size(), mAllInt8.data());
+                    bytes = sizeof(cl_char) * mHostInt8.size();
+                } else {
+                    mCounts.assign(ring.getNbProcesses(), mHostSigns.size());
+                    ring.allGather(mHostSigns.data(), mCounts, mAllSigns);
+                    mQueue.enqueueWriteBuffer(mGatheredQuantized, CL_FALSE, 0, sizeof(cl_uint) * mAllSigns.size(), mAllSigns.data());
+                    bytes = sizeof(cl_uint) * mHostSigns.size();
+                }
+                bytes += sizeof(float) * mHostScales.size();
+            }
+            mStats.exchanges++;
+            mStats.dense_bytes += sizeof(T) * mNbWeights;
+            mStats.compressed_bytes += bytes;
+        }
+
+        /**
+         * @brief Enqueues the application of scale times the changes of all
+         * the processes to the shared weights, and their copy into the layer
+         */
+        void enqueueDecompress(float scale)
+        {
+            mDecompress.kernel.setArg(mMode == GradientCompression::TopK ? 1 : 2, scale);
+            if(mMode == GradientCompression::TopK) {
+                // One launch per process: a weight may be changed by several
+                size_t first = 0;
+                for(size_t count : mCounts) {
+                    if(count > 0) {
+                        mDecompress.kernel.setArg(0, static_cast<cl_int>(first));
+                        mDecompress.global = cl::NDRange(count);
+                        enqueue(mDecompress);
+                    }
+                    first += count;
+                }
+                enqueue(mApply);
+                return;
+            }
+            enqueue(mDecompress);
+        }
+
+        const Stats& getStats() const {
+            return mStats;
+        }
+};
+
+#endif
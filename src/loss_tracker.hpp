@@ -0,0 +1,201 @@
+#ifndef __LOSS_TRACKER_HPP__
+#define __LOSS_TRACKER_HPP__
+
+#include "perceptron_layer.hpp"
+#include "step_plan.hpp"
+
+#include <cfloat>
+
+/**
+ * LossTracker
+ * ===========
+ *
+ * Running estimate of the training loss, computed on the device during the
+ * training steps (see the kernels of the loss tracker).
+ *
+ * The output delta of each step also accumulates the loss and the max error
+ * of its sample:
+ * - exponential moving averages over the last steps
+ * - the mean loss and the max error of the last complete epoch
+ *
+ * Checking convergence then only reads back a scalar, the max error of the
+ * last epoch, instead of running the training set through the network. The
+ * read is not waited for: pollConverged checks the value read at its
+ * previous call, and enqueues a new read.
+ *
+ * The max error of an epoch is measured while the network learns, before the
+ * update of each sample: it is an estimate of the error on the training set,
+ * not the error of the final weights.
+ *
+ * How to use
+ * ----------
+ * LossTracker<float> tracker(context, queue, kernel);
+ * p.setLossTracker(&tracker, 100);
+ * p.train(...);
+ * LossTracker<float>::Stats stats = tracker.getStats();
+ *
+ * Or, with a training loop of your own:
+ * plan.setOutputDelta(tracker.prepareOutputDelta(plan));
+ * ... training steps of an epoch ...
+ * tracker.enqueueEndEpoch(nb_samples);
+ * if(tracker.pollConverged(1.f - confidence)) ...
+ **/
+template<typename T>
+class LossTracker
+{
+    typedef NeuronLayer<T> NLayer;
+
+    public:
+        // Layout of the tracker buffer, as in perceptron_layer.cl
+        enum Field {
+            Ema = 0,
+            EmaMaxError,
+            EpochSum,
+            EpochMaxError,
+            LastEpoch,
+            LastEpochMaxError,
+            Started,
+            NbFields
+        };
+
+        struct Stats {
+            // Moving averages of the loss and of the max error per sample
+            float ema_loss = 0.f;
+            float ema_max_error = 0.f;
+            // Mean loss and max error of the last complete epoch
+            float epoch_loss = 0.f;
+            float epoch_max_error = 0.f;
+            size_t epochs = 0;
+        };
+
+    private:
+        // Work-items of the output delta (LOSS_TRACKER_BLOCK)
+        static const size_t BLOCK = 64;
+
+        cl::CommandQueue mQueue;
+        cl::Kernel mKernel;
+        cl::Kernel mEndEpoch;
+        cl::Buffer mTracker;
+        float mDecay;
+        size_t mEpochs = 0;
+
+        // Pending read of LastEpochMaxError (see pollConverged)
+        bool mReadPending = false;
+        cl::Event mRead;
+        float mLastEpochMaxError = FLT_MAX;
+
+    public:
+        /**
+         * @brief Tracker for the network trained on queue, with the kernels
+         * of the program of kernel. decay is the weight of the past in the
+         * moving averages.
+         */
+        LossTracker(cl::Context& context, const cl::CommandQueue& queue, const cl::Kernel& kernel, float decay = 0.99f) : mQueue(queue), mKernel(kernel), mDecay(decay)
+        {
+            if(decay < 0.f || decay >= 1.f) {
+                throw std::runtime_error("LossTracker - decay must be in [0, 1)");
+            }
+            mTracker = cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(float) * NbFields);
+            mEndEpoch = cloneKernel(kernel, "perceptron_loss_end_epoch");
+            mEndEpoch.setArg(1, mTracker);
+            reset();
+        }
+
+        ~LossTracker()
+        {
+            if(mReadPending) mRead.wait();
+        }
+
+        /**
+         * @brief Forgets the previous steps, before a new training
+         */
+        void reset()
+        {
+            if(mReadPending) mRead.wait();
+            mReadPending = false;
+            mLastEpochMaxError = FLT_MAX;
+            mEpochs = 0;
+            float initial[NbFields] = {0.f};
+            // No epoch has ended yet
+            initial[LastEpochMaxError] = FLT_MAX;
+            mQueue.enqueueWriteBuffer(mTracker, CL_TRUE, 0, sizeof(initial), initial);
+        }
+
+        /**
+         * @brief Output delta of the training steps of plan, which also
+         * accumulates the loss (see StepPlan::setOutputDelta)
+         */
+        BoundKernel prepareOutputDelta(StepPlan<T>& plan)
+        {
+            NLayer* output_layer = plan.getOutputLayer();
+            BoundKernel bound;
+            bound.kernel = cloneKernel(mKernel, "perceptron_train_output_layer_tracked");
+            bound.global = cl::NDRange(BLOCK);
+            bound.local = cl::NDRange(BLOCK);
+            bound.writes = WritesNothing;
+            output_layer->setValuesArg(bound.kernel, 0);
+            bound.kernel.setArg(1, plan.getExpectedOutputBuf());
+            bound.kernel.setArg(2, plan.getDeltaBuf(plan.getNbLayers()-1));
+            bound.kernel.setArg(3, static_cast<cl_int>(output_layer->getSize()-1));
+            bound.kernel.setArg(4, mDecay);
+            bound.kernel.setArg(5, mTracker);
+            return bound;
+        }
+
+        /**
+         * @brief Closes the epoch of nb_samples steps enqueued since the last
+         * call
+         */
+        void enqueueEndEpoch(cl_uint nb_samples)
+        {
+            mEndEpoch.setArg(0, nb_samples);
+            mQueue.enqueueNDRangeKernel(mEndEpoch, cl::NullRange, cl::NDRange(1), cl::NullRange);
+            mEpochs++;
+        }
+
+        /**
+         * @brief Whether the max error of the last complete epoch, as read at
+         * the previous call, is at most max_error. Does not block: enqueues
+         * the read checked by the next call.
+         */
+        bool pollConverged(float max_error)
+        {
+            bool converged = false;
+            if(mReadPending) {
+                // Enqueued a while ago, most likely complete
+                mRead.wait();
+                mReadPending = false;
+                converged = mLastEpochMaxError <= max_error;
+            }
+            if(!converged) {
+                mQueue.enqueueReadBuffer(mTracker, CL_FALSE, sizeof(float) * LastEpochMaxError, sizeof(float), &mLastEpochMaxError, nullptr, &mRead);
+                mQueue.flush();
+                mReadPending = true;
+            }
+            return converged;
+        }
+
+        /**
+         * @brief Reads the whole tracker back (blocking)
+         */
+        Stats getStats()
+        {
+            if(mReadPending) {
+                mRead.wait();
+                mReadPending = false;
+            }
+            float tracker[NbFields];
+            mQueue.enqueueReadBuffer(mTracker, CL_TRUE, 0, sizeof(tracker), tracker);
+            Stats stats;
+            stats.ema_loss = tracker[Ema];
+            stats.ema_max_error = tracker[EmaMaxError];
+            stats.epochs = mEpochs;
+            if(mEpochs > 0) {
+                stats.epoch_loss = tracker[LastEpoch];
+                stats.epoch_max_error = tracker[LastEpochMaxError];
+            }
+            return stats;
+        }
+};
+
+#endif
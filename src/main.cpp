@@ -67,10 +67,15 @@ int main(int argc, char **argv)
     cl::Kernel perceptronTrainOutputKernel(program, "perceptron_train_output_layer");
     cl::Kernel perceptronTrainBackpropagate(program, "perceptron_train_backpropagate");
     cl::Kernel perceptronTrainUpdateWeights(program, "perceptron_train_update_weights");
+    // Backpropagation and weight update in a single pass over the weights
+    cl::Kernel perceptronTrainBackpropagateUpdateWeights(program, "perceptron_train_backpropagate_update_weights");
 
     cl::CommandQueue queue(context, default_device);
 
     Perceptron<cl_float> perceptron(context, queue);
+    perceptron.useFusedTrainingKernel(perceptronTrainBackpropagateUpdateWeights);
+    // Devices using the host memory work on the host arrays, without copies
+    perceptron.setHostMemory(HostMemory::ZeroCopy);
     // Creates the layers, reserve data on GPU
     perceptron.createLayer(2);
     perceptron.createLayer(2);
@@ -99,11 +104,12 @@ int main(int argc, char **argv)
     //perceptron.setWeights( {{0.25, -0.25, 0.25, -0.35, 0.25, 0.25},
     //                        {0.25, -0.35, -0.35, 0.15, -0.25, 0.15},
     //                        {0.5, 0.5, 0.35}} );
-    perceptron.initRandomWeights();
+    // Initializes the weights on the device, nothing to upload
+    cl::Kernel perceptronInitWeights(program, "perceptron_init_weights");
+    perceptron.enqueueInitWeights(perceptronInitWeights, WeightInit::Uniform, std::time(0));
     cout << endl;
     cout << "Perceptron before training" << endl;
     perceptron.run(perceptronKernel);
-    perceptron.enqueueReadAllBuffers();
     perceptron.displayAll();
     cout << endl;
 
@@ -119,6 +125,8 @@ int main(int argc, char **argv)
     cout << "____________________________________________" << endl;
     cout << "___________  Training Finished      ________" << endl;
     cout << "____________________________________________" << endl;
+    const BufferPool::Stats pool_stats = BufferPool::forContext(context).getStats();
+    cout << "Training buffers: " << pool_stats.hits << " reused, " << pool_stats.misses << " created, " << pool_stats.bytes_held << " bytes held" << endl;
 
 
     //// Run the kernel 
@@ -129,27 +137,28 @@ int main(int argc, char **argv)
     cout << "Running xor(1, 0)" << endl;
     perceptron.setInputValues({1,0});
     perceptron.run(perceptronKernel);
-    perceptron.enqueueReadAllBuffers();
     perceptron.displayAll();
 
     cout << "Running xor(0, 1)" << endl;
     perceptron.setInputValues({0,1});
     perceptron.run(perceptronKernel);
-    perceptron.enqueueReadAllBuffers();
     perceptron.displayAll();
 
     cout << "Running xor(1, 1)" << endl;
     perceptron.setInputValues({1,1});
     perceptron.run(perceptronKernel);
-    perceptron.enqueueReadAllBuffers();
     perceptron.displayAll();
 
     cout << "Running xor(0, 0)" << endl;
     perceptron.setInputValues({0,0});
     perceptron.run(perceptronKernel);
-    perceptron.enqueueReadAllBuffers();
     perceptron.displayAll();
 
+    // Inference only moves the input and the output over the bus
+    std::vector<cl_float> prediction;
+    perceptron.predict(perceptronKernel, {1, 0}, prediction).wait();
+    cout << "Predicted xor(1, 0): " << prediction[0] << endl;
+
     end = std::chrono::system_clock::now();
 
 
@@ -0,0 +1,335 @@
+#ifndef __MIXED_PRECISION_TRAINER_HPP__
+#define __MIXED_PRECISION_TRAINER_HPP__
+
+#include "perceptron.hpp"
+#include "permutation.hpp"
+
+#include <random>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+/**
+ * MixedPrecisionTrainer
+ * =====================
+ *
+ * Trains a Perceptron<float> with half precision values, weights and deltas
+ * (see the kernels of mixed precision training).
+ *
+ * The forward and backward passes read half precision copies of the values
+ * and of the weights, which halves their memory traffic. The weights of the
+ * perceptron stay the single precision master copy: each step updates them,
+ * and writes the half precision copy again. The update reads and writes the
+ * master weights, so it costs a little more than in single precision.
+ *
+ * The deltas are multiplied by a loss scale so that they do not vanish in
+ * half precision. The scale adapts on the device, without reading anything
+ * back: a step whose deltas overflow is skipped and halves the scale, and
+ * growth_interval steps without overflow double it.
+ *
+ * Devices with cl_khr_fp16 multiply in half precision. The others only store
+ * half values, and compute in single precision (isNativeHalf).
+ *
+ * How to use
+ * ----------
+ * Perceptron<float> p(context, queue);
+ * ... createLayer, initWeights, upload ...
+ * MixedPrecisionTrainer<float> trainer(context, queue, program, p, epsilon);
+ * trainer.train(training_in, training_out, confidence, max_iterations);
+ * // p holds the trained (single precision) weights
+ *
+ * When the weights of the perceptron are changed between trainings,
+ * syncWeights() must be called.
+ **/
+template<typename T>
+class MixedPrecisionTrainer
+{
+    static_assert(std::is_same<T, float>::value, "MixedPrecisionTrainer - The master weights must be single precision");
+
+    typedef NeuronLayer<T> NLayer;
+
+    public:
+        struct Stats {
+            float scale = 0.f;
+            // Steps skipped because a delta overflowed
+            size_t skipped_steps = 0;
+        };
+
+    private:
+        // Layout of the scaler buffer, as in perceptron_layer.cl
+        enum ScalerField {
+            Scale = 0,
+            Overflow,
+            GoodSteps,
+            SkippedSteps,
+            NbScalerFields
+        };
+
+        /**
+         * A layer of the perceptron, with its half precision arrays.
+         * size includes the bias neuron.
+         */
+        struct Layer {
+            NLayer* layer = nullptr;
+            cl_int size = 0;
+            cl::Buffer buf_values;
+            cl::Buffer buf_delta;
+            // Half precision copy of the weights to the next layer
+            cl::Buffer buf_weights;
+            // Kernels with their arguments bound
+            cl::Kernel forward;
+            cl::Kernel backpropagate;
+            // Enqueued on the perceptron layer: they read its weights
+            BoundKernel update;
+            BoundKernel to_half;
+        };
+
+        Perceptron<T>& mPerceptron;
+        cl::CommandQueue mQueue;
+        std::vector<Layer> mLayers;
+        cl::Buffer mInputBuf;
+        cl::Buffer mExpectedOutBuf;
+        cl::Buffer mScalerBuf;
+        cl::Kernel mInputToHalf;
+        cl::Kernel mOutputDelta;
+        cl::Kernel mUpdateScale;
+        cl::Kernel mRunKernel;
+        bool mNativeHalf;
+
+        // Staging of the uploads, kept until they complete
+        std::vector<T> mInput;
+        std::vector<T> mExpected;
+        cl::Event mInputUploaded;
+        cl::Event mExpectedUploaded;
+
+        void check(cl_int status, const char* what) const {
+            if(status != CL_SUCCESS) throw std::runtime_error(std::string("MixedPrecisionTrainer::") + what + " - Error running kernel");
+        }
+
+        void stage(const std::vector<T>& values, std::vector<T>& staging, cl::Event& uploaded, const char* what)
+        {
+            if(values.size() != staging.size()) {
+                throw std::runtime_error(std::string("MixedPrecisionTrainer::") + what + " - Size must match the layer size!");
+            }
+            // The previous upload reads the staging array
+            if(uploaded() != nullptr) uploaded.wait();
+            std::copy(values.begin(), values.end(), staging.begin());
+        }
+
+    public:
+        /**
+         * @brief Trainer of perceptron, which must have been uploaded, with
+         * the learning rate epsilon
+         */
+        MixedPrecisionTrainer(cl::Context& context, cl::CommandQueue& queue, cl::Program& program, Perceptron<T>& perceptron, float epsilon, float initial_scale = 1024.f, int growth_interval = 2000) : mPerceptron(perceptron), mQueue(queue)
+        {
+            for(NLayer* layer = perceptron.getFirstLayer(); layer != nullptr; layer = layer->getNextLayer()) {
+                if(layer->getWeightLayout() != WeightLayout::RowMajor) {
+                    throw std::runtime_error("MixedPrecisionTrainer - Only the RowMajor layout is supported");
+                }
+                Layer half_layer;
+                half_layer.layer = layer;
+                half_layer.size = layer->getSize();
+                mLayers.push_back(half_layer);
+            }
+            if(mLayers.size() < 2) {
+                throw std::runtime_error("MixedPrecisionTrainer - You must have more than one layer to train a perceptron !");
+            }
+            const std::string extensions = queue.getInfo<CL_QUEUE_DEVICE>().getInfo<CL_DEVICE_EXTENSIONS>();
+            mNativeHalf = extensions.find("cl_khr_fp16") != std::string::npos;
+
+            for(size_t l=0; l < mLayers.size(); l++) {
+                Layer& layer = mLayers[l];
+                // Bias neurons are set once: the kernels never write them.
+                // 0x3C00 is 1 in half precision.
+                std::vector<cl_half> values(layer.size, 0);
+                values.back() = 0x3C00;
+                layer.buf_values = cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(cl_half) * values.size());
+                layer.buf_delta = cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(cl_half) * values.size());
+                mQueue.enqueueWriteBuffer(layer.buf_values, CL_TRUE, 0, sizeof(cl_half) * values.size(), values.data());
+                if(l+1 < mLayers.size()) {
+                    layer.buf_weights = cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(cl_half) * layer.layer->getNbWeights());
+                }
+            }
+            mScalerBuf = cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(float) * NbScalerFields);
+            const float scaler[NbScalerFields] = {initial_scale, 0.f, 0.f, 0.f};
+            mQueue.enqueueWriteBuffer(mScalerBuf, CL_TRUE, 0, sizeof(scaler), scaler);
+
+            const cl_int in_size = mLayers.front().size-1;
+            const cl_int out_size = mLayers.back().size-1;
+            mInput.resize(in_size);
+            mExpected.resize(out_size);
+            mInputBuf = cl::Buffer(context, CL_MEM_READ_ONLY, sizeof(T) * in_size);
+            mExpectedOutBuf = cl::Buffer(context, CL_MEM_READ_ONLY, sizeof(T) * out_size);
+
+            mInputToHalf = cl::Kernel(program, "perceptron_half_convert");
+            mInputToHalf.setArg(0, static_cast<cl_uint>(in_size));
+            mInputToHalf.setArg(1, mInputBuf);
+            mInputToHalf.setArg(2, mLayers.front().buf_values);
+
+            for(size_t l=0; l+1 < mLayers.size(); l++) {
+                Layer& layer = mLayers[l];
+                Layer& next = mLayers[l+1];
+                layer.forward = cl::Kernel(program, "perceptron_half");
+                layer.forward.setArg(0, layer.size);
+                layer.forward.setArg(1, next.size-1);
+                layer.forward.setArg(2, layer.buf_values);
+                layer.forward.setArg(3, layer.buf_weights);
+                layer.forward.setArg(4, next.buf_values);
+
+                if(l >= 1) {
+                    layer.backpropagate = cl::Kernel(program, "perceptron_half_train_backpropagate");
+                    layer.backpropagate.setArg(0, layer.size);
+                    layer.backpropagate.setArg(1, next.size-1);
+                    layer.backpropagate.setArg(2, layer.buf_values);
+                    layer.backpropagate.setArg(3, layer.buf_weights);
+                    layer.backpropagate.setArg(4, next.buf_delta);
+                    layer.backpropagate.setArg(5, mScalerBuf);
+                    layer.backpropagate.setArg(6, layer.buf_delta);
+                }
+
+                layer.update.kernel = cl::Kernel(program, "perceptron_half_train_update_weights");
+                layer.update.global = cl::NDRange(static_cast<size_t>(layer.size) * (next.size-1));
+                layer.update.local = cl::NullRange;
+                layer.update.writes = WritesWeights;
+                layer.update.kernel.setArg(0, layer.size);
+                layer.update.kernel.setArg(1, epsilon);
+                layer.update.kernel.setArg(2, layer.buf_values);
+                layer.update.kernel.setArg(3, next.buf_delta);
+                layer.update.kernel.setArg(4, mScalerBuf);
+                layer.layer->setWeightsArg(layer.update.kernel, 5);
+                layer.update.kernel.setArg(6, layer.buf_weights);
+
+                layer.to_half.kernel = cl::Kernel(program, "perceptron_half_convert");
+                layer.to_half.global = cl::NDRange(layer.layer->getNbWeights());
+                layer.to_half.local = cl::NullRange;
+                layer.to_half.writes = WritesNothing;
+                layer.to_half.kernel.setArg(0, static_cast<cl_uint>(layer.layer->getNbWeights()));
+                layer.layer->setWeightsArg(layer.to_half.kernel, 1);
+                layer.to_half.kernel.setArg(2, layer.buf_weights);
+            }
+
+            mOutputDelta = cl::Kernel(program, "perceptron_half_train_output_layer");
+            mOutputDelta.setArg(0, mLayers.back().buf_values);
+            mOutputDelta.setArg(1, mExpectedOutBuf);
+            mOutputDelta.setArg(2, mScalerBuf);
+            mOutputDelta.setArg(3, mLayers.back().buf_delta);
+
+            mUpdateScale = cl::Kernel(program, "perceptron_half_update_scale");
+            mUpdateScale.setArg(0, growth_interval);
+            mUpdateScale.setArg(1, mScalerBuf);
+
+            mRunKernel = cl::Kernel(program, "perceptron");
+            syncWeights();
+        }
+
+        MixedPrecisionTrainer(const MixedPrecisionTrainer&) = delete;
+        MixedPrecisionTrainer& operator=(const MixedPrecisionTrainer&) = delete;
+
+        ~MixedPrecisionTrainer()
+        {
+            // Uploads may still read the staging arrays
+            mQueue.finish();
+        }
+
+        /**
+         * @brief Whether the device multiplies in half precision
+         * (cl_khr_fp16), rather than only storing half values
+         */
+        bool isNativeHalf() const {
+            return mNativeHalf;
+        }
+
+        /**
+         * @brief Copies the weights of the perceptron into their half
+         * precision copy
+         */
+        void syncWeights()
+        {
+            for(size_t l=0; l+1 < mLayers.size(); l++) {
+                check(mLayers[l].layer->enqueueBound(mLayers[l].to_half, LaunchOrder::inOrder(&mQueue)), "syncWeights");
+            }
+            finish();
+        }
+
+        /**
+         * @brief Enqueues one training step, without waiting
+         */
+        void trainStep(const std::vector<T>& training_in, const std::vector<T>& training_out)
+        {
+            stage(training_in, mInput, mInputUploaded, "trainStep");
+            mQueue.enqueueWriteBuffer(mInputBuf, CL_FALSE, 0, sizeof(T) * mInput.size(), mInput.data(), nullptr, &mInputUploaded);
+            stage(training_out, mExpected, mExpectedUploaded, "trainStep");
+            mQueue.enqueueWriteBuffer(mExpectedOutBuf, CL_FALSE, 0, sizeof(T) * mExpected.size(), mExpected.data(), nullptr, &mExpectedUploaded);
+
+            const int n = mLayers.size();
+            check(mQueue.enqueueNDRangeKernel(mInputToHalf, cl::NullRange, cl::NDRange(mInput.size()), cl::NullRange), "trainStep");
+            for(int l=0; l < n-1; l++) {
+                check(mQueue.enqueueNDRangeKernel(mLayers[l].forward, cl::NullRange, cl::NDRange(mLayers[l+1].size-1), cl::NullRange), "trainStep");
+            }
+            check(mQueue.enqueueNDRangeKernel(mOutputDelta, cl::NullRange, cl::NDRange(mExpected.size()), cl::NullRange), "trainStep");
+            // All the deltas are known before any update: a step whose deltas
+            // overflow is skipped as a whole
+            for(int l=n-2; l >= 1; l--) {
+                check(mQueue.enqueueNDRangeKernel(mLayers[l].backpropagate, cl::NullRange, cl::NDRange(mLayers[l].size-1), cl::NullRange), "trainStep");
+            }
+            for(int l=0; l < n-1; l++) {
+                check(mLayers[l].layer->enqueueBound(mLayers[l].update, LaunchOrder::inOrder(&mQueue)), "trainStep");
+            }
+            check(mQueue.enqueueNDRangeKernel(mUpdateScale, cl::NullRange, cl::NDRange(1), cl::NullRange), "trainStep");
+        }
+
+        void finish()
+        {
+            if(mQueue.finish() != CL_SUCCESS) {
+                throw std::runtime_error("MixedPrecisionTrainer::finish - command queue failed to execute");
+            }
+        }
+
+        /**
+         * @brief Trains the perceptron as Perceptron::train does, by epochs
+         * over the training set in a random order. Convergence is checked
+         * every 100 iterations, on the single precision weights.
+         */
+        bool train(const std::vector<std::vector<T>>& training_in_values, const std::vector<std::vector<T>>& training_out_values, const float& confidence=0.8, const int& max_iterations=100000)
+        {
+            if(training_in_values.empty() || training_in_values.size() != training_out_values.size()) {
+                throw std::runtime_error("MixedPrecisionTrainer::train - Training input and output size must match!");
+            }
+            std::random_device rd; // obtain a random number from hardware
+            const uint64_t seed = (static_cast<uint64_t>(rd()) << 32) | rd();
+            const cl_uint nb_samples = training_in_values.size();
+
+            int train = 0;
+            for(cl_uint epoch = 0; train < max_iterations; epoch++) {
+                for(cl_uint step = 0; step < nb_samples && train++ < max_iterations; step++) {
+                    if(train%100 == 0) {
+                        finish();
+                        if(mPerceptron.hasConvergedForAllInputs(mRunKernel, training_in_values, training_out_values, confidence)) {
+                            cout << "Trained in " << train << " iterations (mixed precision, loss scale " << getStats().scale << "), under confidence: " << confidence << endl;
+                            return true;
+                        }
+                    }
+                    const cl_uint sample = permutation::index(step, nb_samples, seed, epoch);
+                    trainStep(training_in_values[sample], training_out_values[sample]);
+                }
+            }
+            finish();
+            return false;
+        }
+
+        /**
+         * @brief Current loss scale and skipped steps (blocking)
+         */
+        Stats getStats()
+        {
+            float scaler[NbScalerFields];
+            mQueue.enqueueReadBuffer(mScalerBuf, CL_TRUE, 0, sizeof(scaler), scaler);
+            Stats stats;
+            stats.scale = scaler[Scale];
+            stats.skipped_steps = static_cast<size_t>(scaler[SkippedSteps]);
+            return stats;
+        }
+};
+
+#endif
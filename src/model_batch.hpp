@@ -0,0 +1,349 @@
+#ifndef __MODEL_BATCH_HPP__
+#define __MODEL_BATCH_HPP__
+
+#include "perceptron.hpp"
+#include "philox.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+/**
+ * ModelBatch
+ * ==========
+ *
+ * K perceptrons of the same topology, each with its own weights and learning
+ * rate, trained side by side (hyperparameter search, random restarts).
+ *
+ * With one Perceptron per network, a training step of a tiny network such as
+ * the 2-2-1 XOR network costs about ten kernel launches, whatever its size:
+ * thousands of them are bound by the launch overhead. A ModelBatch stacks the
+ * arrays of the K networks in the buffers of each layer (see the
+ * perceptron_batch kernels), and runs each stage of the step for all of them
+ * in a single launch: forward pass of each layer, delta of the output layer,
+ * and fused backpropagation and weight update of each layer.
+ *
+ * The weights of each model have the layout of the NeuronLayer weights, so
+ * that a model can be copied from or to a Perceptron (setModel, getModel).
+ *
+ * Steps are enqueued without waiting on the (in-order) queue: finish() waits
+ * for them, and reading the outputs or the weights does too.
+ *
+ * How to use
+ * ----------
+ * ModelBatch<float> batch({2, 2, 1}, 1000, context, queue, program);
+ * batch.initWeights(WeightInit::Uniform, seed); // A different init per model
+ * batch.setLearningRates(epsilons);             // One per model
+ * for(...) {
+ *     batch.trainStep({0, 1}, {1});             // Same sample for all models
+ * }
+ * std::vector<float> errors = batch.maxErrors(training_in, training_out);
+ * batch.getModel(best, perceptron);
+ **/
+template<typename T>
+class ModelBatch
+{
+    private:
+        /**
+         * A layer of the K networks, and their weights to the next one.
+         * size includes the bias neuron, whose value is always 1.
+         */
+        struct Layer {
+            cl_int size = 0;
+            cl::Buffer buf_values;
+            cl::Buffer buf_delta;
+            cl::Buffer buf_weights;
+            // Forward pass to the next layer, backpropagation and update of
+            // the weights to the next layer (arguments bound)
+            cl::Kernel forward;
+            cl::Kernel backward;
+        };
+
+        cl::Context mContext;
+        cl::CommandQueue mQueue;
+        int mNbModels;
+        std::vector<Layer> mLayers;
+        cl::Buffer mEpsilonsBuf;
+        cl::Buffer mExpectedOutBuf;
+        cl::Kernel mOutputDeltaKernel;
+
+        // Staging of the uploads, kept until they complete
+        std::vector<T> mInputs;
+        std::vector<T> mExpected;
+        cl::Event mInputUploaded;
+        cl::Event mExpectedUploaded;
+        std::vector<T> mOutputValues;
+
+        size_t getNbWeights(int l) const {
+            return static_cast<size_t>(mLayers[l].size) * mLayers[l+1].size;
+        }
+
+        void check(cl_int status, const char* what) const {
+            if(status != CL_SUCCESS) throw std::runtime_error(std::string("ModelBatch::") + what + " - Error running kernel");
+        }
+
+        /**
+         * @brief Copies one sample (given to all models) or K stacked samples
+         * into staging, K rows of stride, each starting at its first value
+         */
+        void stage(const std::vector<T>& values, size_t size, std::vector<T>& staging, size_t stride, cl::Event& uploaded, const char* what)
+        {
+            if(values.size() != size && values.size() != size * mNbModels) {
+                throw std::runtime_error(std::string("ModelBatch::") + what + " - Size must match the layer size, for one or all of the models");
+            }
+            // The previous upload reads the staging array
+            if(uploaded() != nullptr) uploaded.wait();
+            const bool shared = (values.size() == size);
+            for(int k=0; k < mNbModels; k++) {
+                std::copy(values.begin() + (shared ? 0 : k * size), values.begin() + (shared ? 0 : k * size) + size, staging.begin() + k * stride);
+            }
+        }
+
+        /**
+         * @brief Layers of perceptron, which must have the topology of the
+         * batch
+         */
+        std::vector<NeuronLayer<T>*> checkTopology(Perceptron<T>& perceptron, const char* what) const
+        {
+            std::vector<NeuronLayer<T>*> layers;
+            for(NeuronLayer<T>* layer = perceptron.getFirstLayer(); layer != nullptr; layer = layer->getNextLayer()) {
+                if(layers.size() >= mLayers.size() || layer->getSize() != mLayers[layers.size()].size) {
+                    throw std::runtime_error(std::string("ModelBatch::") + what + " - The topology of the perceptron does not match the batch");
+                }
+                layers.push_back(layer);
+            }
+            if(layers.size() != mLayers.size()) {
+                throw std::runtime_error(std::string("ModelBatch::") + what + " - The topology of the perceptron does not match the batch");
+            }
+            return layers;
+        }
+
+        void enqueueForward()
+        {
+            for(size_t l=0; l+1 < mLayers.size(); l++) {
+                check(mQueue.enqueueNDRangeKernel(mLayers[l].forward, cl::NullRange, cl::NDRange(mLayers[l+1].size-1, mNbModels), cl::NullRange), "run");
+            }
+        }
+
+    public:
+        /**
+         * @brief nb_models networks of the given layer sizes (bias
+         * excluded, as in Perceptron::createLayer), with zero weights and a
+         * learning rate of 1
+         */
+        ModelBatch(const std::vector<int>& sizes, int nb_models, cl::Context& context, cl::CommandQueue& queue, cl::Program& program) : mContext(context), mQueue(queue), mNbModels(nb_models)
+        {
+            if(sizes.size() < 2) {
+                throw std::runtime_error("ModelBatch - You must have more than one layer !");
+            }
+            if(nb_models < 1) {
+                throw std::runtime_error("ModelBatch - The batch needs at least one model");
+            }
+            mLayers.resize(sizes.size());
+            for(size_t l=0; l < sizes.size(); l++) {
+                mLayers[l].size = sizes[l] + 1;
+            }
+            for(size_t l=0; l < mLayers.size(); l++) {
+                Layer& layer = mLayers[l];
+                // Bias neurons are set once: the kernels never write them
+                std::vector<T> values(static_cast<size_t>(layer.size) * nb_models, 0);
+                for(int k=0; k < nb_models; k++) values[static_cast<size_t>(k) * layer.size + layer.size-1] = 1;
+                layer.buf_values = cl::Buffer(mContext, CL_MEM_READ_WRITE, sizeof(T) * values.size());
+                layer.buf_delta = cl::Buffer(mContext, CL_MEM_READ_WRITE, sizeof(T) * values.size());
+                mQueue.enqueueWriteBuffer(layer.buf_values, CL_TRUE, 0, sizeof(T) * values.size(), values.data());
+                if(l+1 < mLayers.size()) {
+                    const std::vector<T> zeros(getNbWeights(l) * nb_models, 0);
+                    layer.buf_weights = cl::Buffer(mContext, CL_MEM_READ_WRITE, sizeof(T) * zeros.size());
+                    mQueue.enqueueWriteBuffer(layer.buf_weights, CL_TRUE, 0, sizeof(T) * zeros.size(), zeros.data());
+                }
+            }
+            mEpsilonsBuf = cl::Buffer(mContext, CL_MEM_READ_ONLY, sizeof(float) * nb_models);
+            setLearningRate(1.f);
+            mExpectedOutBuf = cl::Buffer(mContext, CL_MEM_READ_ONLY, sizeof(T) * (mLayers.back().size-1) * nb_models);
+            mInputs.assign(static_cast<size_t>(mLayers.front().size) * nb_models, 1);
+            mExpected.resize((mLayers.back().size-1) * nb_models);
+
+            for(size_t l=0; l+1 < mLayers.size(); l++) {
+                Layer& layer = mLayers[l];
+                Layer& next = mLayers[l+1];
+                layer.forward = cl::Kernel(program, "perceptron_batch");
+                layer.forward.setArg(0, layer.size);
+                layer.forward.setArg(1, next.size);
+                layer.forward.setArg(2, layer.buf_values);
+                layer.forward.setArg(3, layer.buf_weights);
+                layer.forward.setArg(4, next.buf_values);
+
+                layer.backward = cl::Kernel(program, "perceptron_batch_train_backpropagate_update_weights");
+                layer.backward.setArg(0, layer.size);
+                layer.backward.setArg(1, next.size);
+                layer.backward.setArg(2, mEpsilonsBuf);
+                layer.backward.setArg(3, layer.buf_values);
+                layer.backward.setArg(4, layer.buf_weights);
+                layer.backward.setArg(5, next.buf_delta);
+                layer.backward.setArg(6, layer.buf_delta);
+            }
+            mOutputDeltaKernel = cl::Kernel(program, "perceptron_batch_train_output_layer");
+            mOutputDeltaKernel.setArg(0, mLayers.back().size);
+            mOutputDeltaKernel.setArg(1, mLayers.back().buf_values);
+            mOutputDeltaKernel.setArg(2, mExpectedOutBuf);
+            mOutputDeltaKernel.setArg(3, mLayers.back().buf_delta);
+        }
+
+        ModelBatch(const ModelBatch&) = delete;
+        ModelBatch& operator=(const ModelBatch&) = delete;
+
+        ~ModelBatch()
+        {
+            // Uploads may still read the staging arrays
+            mQueue.finish();
+        }
+
+        int getNbModels() const {
+            return mNbModels;
+        }
+
+        /**
+         * @brief Initializes the weights of all the models, reproducibly from
+         * seed. Model k uses the streams of the generator after those of
+         * model k-1, so model 0 gets the weights of NeuronLayer::initWeights
+         * with the same seed.
+         */
+        void initWeights(WeightInit init, uint64_t seed, float min = -0.5f, float max = 0.5f)
+        {
+            const uint32_t nb_streams = mLayers.size() - 1;
+            for(size_t l=0; l+1 < mLayers.size(); l++) {
+                float layer_min = min, layer_max = max;
+                weightInitRange(init, mLayers[l].size, mLayers[l+1].size-1, layer_min, layer_max);
+                std::vector<T> weights(getNbWeights(l) * mNbModels);
+                for(int k=0; k < mNbModels; k++) {
+                    philox::fillUniform(weights.data() + k * getNbWeights(l), getNbWeights(l), seed, k * nb_streams + l, layer_min, layer_max);
+                }
+                mQueue.enqueueWriteBuffer(mLayers[l].buf_weights, CL_TRUE, 0, sizeof(T) * weights.size(), weights.data());
+            }
+        }
+
+        void setLearningRate(float epsilon)
+        {
+            setLearningRates(std::vector<float>(mNbModels, epsilon));
+        }
+
+        /**
+         * @brief Learning rate of each model
+         */
+        void setLearningRates(const std::vector<float>& epsilons)
+        {
+            if(epsilons.size() != static_cast<size_t>(mNbModels)) {
+                throw std::runtime_error("ModelBatch::setLearningRates - One learning rate per model is needed");
+            }
+            mQueue.enqueueWriteBuffer(mEpsilonsBuf, CL_TRUE, 0, sizeof(float) * epsilons.size(), epsilons.data());
+        }
+
+        /**
+         * @brief Values of the input layer (bias excluded): one input for all
+         * the models, or K inputs one after the other
+         */
+        void setInputValues(const std::vector<T>& values)
+        {
+            const size_t size = mLayers.front().size;
+            stage(values, size-1, mInputs, size, mInputUploaded, "setInputValues");
+            mQueue.enqueueWriteBuffer(mLayers.front().buf_values, CL_FALSE, 0, sizeof(T) * mInputs.size(), mInputs.data(), nullptr, &mInputUploaded);
+        }
+
+        void run()
+        {
+            enqueueForward();
+            finish();
+        }
+
+        /**
+         * @brief Values of the output layer (bias excluded) of the K models,
+         * one after the other
+         */
+        const std::vector<T>& readOutputValues()
+        {
+            const Layer& output = mLayers.back();
+            std::vector<T> values(static_cast<size_t>(output.size) * mNbModels);
+            mQueue.enqueueReadBuffer(output.buf_values, CL_TRUE, 0, sizeof(T) * values.size(), values.data());
+            mOutputValues.resize((output.size-1) * mNbModels);
+            for(int k=0; k < mNbModels; k++) {
+                std::copy(values.begin() + k * output.size, values.begin() + (k+1) * output.size - 1, mOutputValues.begin() + k * (output.size-1));
+            }
+            return mOutputValues;
+        }
+
+        /**
+         * @brief Enqueues one training step of all the models, without
+         * waiting: training_in and training_out hold one sample for all the
+         * models, or K samples one after the other.
+         * 2 + 2 (number of layers - 1) launches, whatever the number of models.
+         */
+        void trainStep(const std::vector<T>& training_in, const std::vector<T>& training_out)
+        {
+            const size_t out_size = mLayers.back().size-1;
+            setInputValues(training_in);
+            stage(training_out, out_size, mExpected, out_size, mExpectedUploaded, "trainStep");
+            mQueue.enqueueWriteBuffer(mExpectedOutBuf, CL_FALSE, 0, sizeof(T) * mExpected.size(), mExpected.data(), nullptr, &mExpectedUploaded);
+
+            enqueueForward();
+            check(mQueue.enqueueNDRangeKernel(mOutputDeltaKernel, cl::NullRange, cl::NDRange(out_size, mNbModels), cl::NullRange), "trainStep");
+            for(int l=mLayers.size()-2; l >= 0; l--) {
+                check(mQueue.enqueueNDRangeKernel(mLayers[l].backward, cl::NullRange, cl::NDRange(mLayers[l].size, mNbModels), cl::NullRange), "trainStep");
+            }
+        }
+
+        void finish()
+        {
+            if(mQueue.finish() != CL_SUCCESS) {
+                throw std::runtime_error("ModelBatch::finish - command queue failed to execute");
+            }
+        }
+
+        /**
+         * @brief Largest error of each model on the outputs of the training
+         * set. A model has converged (see Perceptron::train) when it is below
+         * 1 - confidence.
+         */
+        std::vector<float> maxErrors(const std::vector<std::vector<T>>& training_in_values, const std::vector<std::vector<T>>& training_out_values)
+        {
+            const size_t out_size = mLayers.back().size-1;
+            std::vector<float> errors(mNbModels, 0.f);
+            for(size_t i=0; i < training_in_values.size(); i++) {
+                setInputValues(training_in_values[i]);
+                enqueueForward();
+                const std::vector<T>& outputs = readOutputValues();
+                for(int k=0; k < mNbModels; k++) {
+                    for(size_t j=0; j < out_size; j++) {
+                        errors[k] = std::fmax(errors[k], std::fabs(outputs[k * out_size + j] - training_out_values[i][j]));
+                    }
+                }
+            }
+            return errors;
+        }
+
+        /**
+         * @brief Copies the weights of model k into perceptron, which must
+         * have the topology of the batch
+         */
+        void getModel(int k, Perceptron<T>& perceptron)
+        {
+            std::vector<NeuronLayer<T>*> layers = checkTopology(perceptron, "getModel");
+            for(size_t l=0; l+1 < layers.size(); l++) {
+                std::vector<T> weights(getNbWeights(l));
+                mQueue.enqueueReadBuffer(mLayers[l].buf_weights, CL_TRUE, sizeof(T) * k * weights.size(), sizeof(T) * weights.size(), weights.data());
+                layers[l]->setWeights(weights.data());
+            }
+        }
+
+        /**
+         * @brief Replaces the weights of model k by those of perceptron
+         */
+        void setModel(int k, Perceptron<T>& perceptron)
+        {
+            std::vector<NeuronLayer<T>*> layers = checkTopology(perceptron, "setModel");
+            for(size_t l=0; l+1 < layers.size(); l++) {
+                mQueue.enqueueWriteBuffer(mLayers[l].buf_weights, CL_TRUE, sizeof(T) * k * getNbWeights(l), sizeof(T) * getNbWeights(l), layers[l]->getWeights());
+            }
+        }
+};
+
+#endif
@@ -1,4 +1,9 @@
 #include "openCLUtilities.hpp"
+#include <cstdlib>
+#include <new>
+#if defined(_WIN32)
+    #include <malloc.h>
+#endif
 
 cl::Platform getPlatform(cl_device_type type, cl_vendor vendor) {
     // Get available platforms
@@ -133,6 +138,41 @@ cl::Program buildProgramFromSource(cl::Context context, std::string filename) {
 
 }
 
+cl::Kernel cloneKernel(const cl::Kernel& kernel) {
+    return cloneKernel(kernel, kernel.getInfo<CL_KERNEL_FUNCTION_NAME>());
+}
+
+cl::Kernel cloneKernel(const cl::Kernel& kernel, const std::string& name) {
+    cl::Program program = kernel.getInfo<CL_KERNEL_PROGRAM>();
+    return cl::Kernel(program, name.c_str());
+}
+
+// Page size: satisfies CL_DEVICE_MEM_BASE_ADDR_ALIGN of the known devices, and
+// lets drivers map the memory without copy
+static const size_t HOST_PTR_ALIGNMENT = 4096;
+static const size_t HOST_PTR_SIZE_MULTIPLE = 64;
+
+void* alignedAlloc(size_t size) {
+    size = ((size + HOST_PTR_SIZE_MULTIPLE - 1) / HOST_PTR_SIZE_MULTIPLE) * HOST_PTR_SIZE_MULTIPLE;
+    if(size == 0) size = HOST_PTR_SIZE_MULTIPLE;
+#if defined(_WIN32)
+    void* ptr = _aligned_malloc(size, HOST_PTR_ALIGNMENT);
+    if(ptr == nullptr) throw std::bad_alloc();
+#else
+    void* ptr = nullptr;
+    if(posix_memalign(&ptr, HOST_PTR_ALIGNMENT, size) != 0) throw std::bad_alloc();
+#endif
+    return ptr;
+}
+
+void alignedFree(void* ptr) {
+#if defined(_WIN32)
+    _aligned_free(ptr);
+#else
+    free(ptr);
+#endif
+}
+
 char *getCLErrorString(cl_int err) {
     switch (err) {
         case CL_SUCCESS:                          return (char *) "Success!";
@@ -32,6 +32,26 @@ cl::Platform getPlatform(cl_device_type = CL_DEVICE_TYPE_ALL, cl_vendor vendor =
 
 cl::Program buildProgramFromSource(cl::Context context, std::string filename);
 
+/**
+ * @brief Creates a new instance of kernel (same program and function), with
+ * its own arguments.
+ */
+cl::Kernel cloneKernel(const cl::Kernel& kernel);
+
+/**
+ * @brief Creates the kernel named name, from the program of kernel.
+ */
+cl::Kernel cloneKernel(const cl::Kernel& kernel, const std::string& name);
+
+/**
+ * @brief Allocates host memory suitable for zero-copy buffers
+ * (CL_MEM_USE_HOST_PTR): aligned on a page, and a multiple of the cache line
+ * size. Must be released with alignedFree.
+ */
+void* alignedAlloc(size_t size);
+
+void alignedFree(void* ptr);
+
 char *getCLErrorString(cl_int err);
 
 #endif
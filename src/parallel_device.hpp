@@ -0,0 +1,20 @@
+#ifndef __PARALLEL_DEVICE_HPP__
+#define __PARALLEL_DEVICE_HPP__
+
+#include "openCLUtilities.hpp"
+
+/**
+ * @brief A device of a perceptron spread over several devices (see
+ * PipelinePerceptron and TensorParallelPerceptron): its context, its queue,
+ * and the program built from perceptron_layer.cl for the context.
+ * Sub-devices (cl::Device::createSubDevices) split a CPU into several
+ * devices.
+ */
+struct ParallelDevice
+{
+    cl::Context context;
+    cl::CommandQueue queue;
+    cl::Program program;
+};
+
+#endif
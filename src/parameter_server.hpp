@@ -0,0 +1,486 @@
+#ifndef __PARAMETER_SERVER_HPP__
+#define __PARAMETER_SERVER_HPP__
+
+#include "perceptron.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * ParameterServer
+ * ===============
+ *
+ * Master weights of a perceptron, shared by the training processes of a host
+ * through a POSIX shared memory segment (no network involved).
+ *
+ * One process creates the segment (the server), the workers attach to it by
+ * name. Each worker trains its own Perceptron, and periodically:
+ * - pulls: copies the master weights into its perceptron
+ * - pushes: adds to the master weights what its training changed since the
+ *   last pull
+ * Pushes are applied under a process-shared lock, without waiting for the
+ * other workers (asynchronous training).
+ *
+ * Pushes are dense, or sparse: with a threshold, only the changes larger than
+ * the threshold (in absolute value) are applied. The others are kept by the
+ * worker, and added to its next push (no update is lost).
+ *
+ * Staleness is bounded (stale synchronous parallel): each worker counts its
+ * pushes (its clock), and a pull waits until the slowest worker is at most
+ * max_staleness pushes behind. With max_staleness = 0, the workers proceed in
+ * lockstep; with a negative value, they never wait. A worker leaves when it
+ * is destroyed; the workers waiting for a worker process that died (without
+ * destroying its ParameterServer) stop waiting for it within a second.
+ *
+ * The weights of the segment are laid out like the NeuronLayer weight arrays:
+ * for each layer but the last, a row-major matrix of (next layer size) x
+ * (layer size) weights, bias included, one matrix after the other.
+ *
+ * How to use
+ * ----------
+ * Server process:
+ * ParameterServer<float> server("/xor", {2, 2, 1}, nb_workers, 4);
+ * server.initWeights(WeightInit::Uniform, seed);
+ * ... start the workers, wait for them ...
+ * server.pull(perceptron); // Final weights
+ *
+ * Worker process (worker in [0, nb_workers)):
+ * ParameterServer<float> server("/xor", worker);
+ * server.pull(perceptron);
+ * for(...) {
+ *     ... train perceptron on a few samples ...
+ *     server.push(perceptron, threshold);
+ *     server.pull(perceptron);
+ * }
+ **/
+template<typename T>
+class ParameterServer
+{
+    public:
+        struct Stats {
+            size_t pulls = 0;
+            size_t pushes = 0;
+            // Weights changed by the pushes
+            size_t values_pushed = 0;
+            // Changes below the threshold, kept for the next push
+            size_t values_deferred = 0;
+            // Time spent waiting for the slower workers, in seconds
+            double staleness_wait = 0.;
+        };
+
+        // Handle of the server process, which is not a worker
+        static const int SERVER = -1;
+
+    private:
+        static const uint32_t MAGIC = 0x50535256;
+        // Clock of the workers that left
+        static const uint64_t DONE = std::numeric_limits<uint64_t>::max();
+        // Interval of the checks for dead workers, while waiting
+        static const int DEAD_WORKER_CHECK_SECONDS = 1;
+
+        /**
+         * Start of the segment. It is followed by the layer sizes (int32_t,
+         * bias included), the worker clocks (uint64_t), the worker process
+         * ids (int32_t, 0 until the worker attaches), and the weights.
+         */
+        struct Header {
+            uint32_t magic;
+            uint32_t value_size;
+            uint32_t nb_layers;
+            uint32_t nb_workers;
+            int32_t max_staleness;
+            uint64_t weights_offset;
+            uint64_t nb_weights;
+            // Number of pushes applied
+            uint64_t version;
+            pthread_mutex_t mutex;
+            pthread_cond_t clock_changed;
+        };
+
+        std::string mName;
+        int mWorker;
+        void* mSegment = MAP_FAILED;
+        size_t mSegmentSize = 0;
+        Header* mHeader = nullptr;
+        int32_t* mSizes = nullptr;
+        uint64_t* mClocks = nullptr;
+        int32_t* mPids = nullptr;
+        T* mWeights = nullptr;
+
+        // Master weights at the last pull, and changes not pushed yet
+        std::vector<T> mSnapshot;
+        std::vector<T> mResidual;
+        Stats mStats;
+
+        static size_t align(size_t offset) {
+            return (offset + 63) / 64 * 64;
+        }
+
+        /**
+         * @brief Locks the segment. A worker that died holding the lock leaves
+         * it to the next one.
+         */
+        class Lock
+        {
+            private:
+                pthread_mutex_t* mMutex;
+
+            public:
+                explicit Lock(pthread_mutex_t* mutex) : mMutex(mutex) {
+                    recover(pthread_mutex_lock(mMutex));
+                }
+
+                ~Lock() {
+                    pthread_mutex_unlock(mMutex);
+                }
+
+                void wait(pthread_cond_t* cond) {
+                    recover(pthread_cond_wait(cond, mMutex));
+                }
+
+                /**
+                 * @brief Same as wait, returns after seconds at most
+                 */
+                void waitFor(pthread_cond_t* cond, int seconds) {
+                    timespec deadline;
+                    clock_gettime(CLOCK_REALTIME, &deadline);
+                    deadline.tv_sec += seconds;
+                    const int status = pthread_cond_timedwait(cond, mMutex, &deadline);
+                    if(status != ETIMEDOUT) recover(status);
+                }
+
+                void recover(int status) {
+                    if(status == EOWNERDEAD) {
+                        pthread_mutex_consistent(mMutex);
+                    } else if(status != 0) {
+                        throw std::runtime_error("ParameterServer - Cannot lock the shared memory segment");
+                    }
+                }
+        };
+
+        void map(int file, size_t size)
+        {
+            mSegment = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, file, 0);
+            close(file);
+            if(mSegment == MAP_FAILED) throw std::runtime_error("ParameterServer - Cannot map the shared memory segment " + mName);
+            mSegmentSize = size;
+            mHeader = static_cast<Header*>(mSegment);
+        }
+
+        void unmap()
+        {
+            munmap(mSegment, mSegmentSize);
+            mSegment = MAP_FAILED;
+        }
+
+        static size_t clocksOffset(size_t nb_layers) {
+            return align(align(sizeof(Header)) + sizeof(int32_t) * nb_layers);
+        }
+
+        static size_t pidsOffset(size_t nb_layers, size_t nb_workers) {
+            return align(clocksOffset(nb_layers) + sizeof(uint64_t) * nb_workers);
+        }
+
+        void locate()
+        {
+            char* base = static_cast<char*>(mSegment);
+            mSizes = reinterpret_cast<int32_t*>(base + align(sizeof(Header)));
+            mClocks = reinterpret_cast<uint64_t*>(base + clocksOffset(mHeader->nb_layers));
+            mPids = reinterpret_cast<int32_t*>(base + pidsOffset(mHeader->nb_layers, mHeader->nb_workers));
+            mWeights = reinterpret_cast<T*>(base + mHeader->weights_offset);
+            mSnapshot.assign(mHeader->nb_weights, 0);
+            mResidual.assign(mHeader->nb_weights, 0);
+        }
+
+        std::vector<NeuronLayer<T>*> checkTopology(Perceptron<T>& perceptron) const
+        {
+            std::vector<NeuronLayer<T>*> layers;
+            for(NeuronLayer<T>* layer = perceptron.getFirstLayer(); layer != nullptr; layer = layer->getNextLayer()) {
+                if(layers.size() >= mHeader->nb_layers || layer->getSize() != mSizes[layers.size()]) {
+                    throw std::runtime_error("ParameterServer - The topology of the perceptron does not match the server");
+                }
+                layers.push_back(layer);
+            }
+            if(layers.size() != mHeader->nb_layers) {
+                throw std::runtime_error("ParameterServer - The topology of the perceptron does not match the server");
+            }
+            return layers;
+        }
+
+        /**
+         * @brief True if the worker is more than max_staleness pushes ahead
+         * of the slowest worker still training. Called under the lock.
+         */
+        bool tooFarAhead() const
+        {
+            if(mWorker == SERVER || mHeader->max_staleness < 0) return false;
+            uint64_t slowest = DONE;
+            for(uint32_t w=0; w < mHeader->nb_workers; w++) {
+                slowest = std::min(slowest, mClocks[w]);
+            }
+            return slowest != DONE && mClocks[mWorker] > slowest + mHeader->max_staleness;
+        }
+
+        /**
+         * @brief Marks as done the workers whose process died without
+         * leaving. Called under the lock.
+         */
+        void releaseDeadWorkers()
+        {
+            for(uint32_t w=0; w < mHeader->nb_workers; w++) {
+                if(mClocks[w] != DONE && mPids[w] != 0 && kill(mPids[w], 0) != 0 && errno == ESRCH) {
+                    mClocks[w] = DONE;
+                }
+            }
+        }
+
+    public:
+        /**
+         * @brief Creates the segment name (which starts with '/'), replacing
+         * any segment left by a previous run, for perceptrons with layers of
+         * sizes neurons (bias excluded, as in Perceptron::createLayer).
+         * The segment is removed when the server is destroyed.
+         */
+        ParameterServer(const std::string& name, const std::vector<int>& sizes, int nb_workers, int max_staleness) : mName(name), mWorker(SERVER)
+        {
+            if(sizes.size() < 2 || nb_workers < 1) {
+                throw std::runtime_error("ParameterServer - You need more than one layer and at least one worker");
+            }
+            uint64_t nb_weights = 0;
+            for(size_t l=0; l+1 < sizes.size(); l++) {
+                nb_weights += static_cast<uint64_t>(sizes[l] + 1) * (sizes[l+1] + 1);
+            }
+            const size_t weights_offset = align(pidsOffset(sizes.size(), nb_workers) + sizeof(int32_t) * nb_workers);
+            const size_t size = weights_offset + sizeof(T) * nb_weights;
+
+            shm_unlink(mName.c_str());
+            const int file = shm_open(mName.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+            if(file < 0) throw std::runtime_error("ParameterServer - Cannot create the shared memory segment " + mName);
+            if(ftruncate(file, size) != 0) {
+                close(file);
+                shm_unlink(mName.c_str());
+                throw std::runtime_error("ParameterServer - Cannot resize the shared memory segment " + mName);
+            }
+            map(file, size);
+
+            mHeader->value_size = sizeof(T);
+            mHeader->nb_layers = sizes.size();
+            mHeader->nb_workers = nb_workers;
+            mHeader->max_staleness = max_staleness;
+            mHeader->weights_offset = weights_offset;
+            mHeader->nb_weights = nb_weights;
+            mHeader->version = 0;
+
+            pthread_mutexattr_t mutex_attr;
+            pthread_mutexattr_init(&mutex_attr);
+            pthread_mutexattr_setpshared(&mutex_attr, PTHREAD_PROCESS_SHARED);
+            pthread_mutexattr_setrobust(&mutex_attr, PTHREAD_MUTEX_ROBUST);
+            pthread_mutex_init(&mHeader->mutex, &mutex_attr);
+            pthread_mutexattr_destroy(&mutex_attr);
+            pthread_condattr_t cond_attr;
+            pthread_condattr_init(&cond_attr);
+            pthread_condattr_setpshared(&cond_attr, PTHREAD_PROCESS_SHARED);
+            pthread_cond_init(&mHeader->clock_changed, &cond_attr);
+            pthread_condattr_destroy(&cond_attr);
+
+            locate();
+            for(size_t l=0; l < sizes.size(); l++) mSizes[l] = sizes[l] + 1;
+            for(int w=0; w < nb_workers; w++) {
+                mClocks[w] = 0;
+                mPids[w] = 0;
+            }
+            // The segment is ready
+            __sync_synchronize();
+            mHeader->magic = MAGIC;
+        }
+
+        /**
+         * @brief Attaches worker (in [0, nb_workers)) to the segment name,
+         * created beforehand by the server
+         */
+        ParameterServer(const std::string& name, int worker) : mName(name), mWorker(worker)
+        {
+            const int file = shm_open(mName.c_str(), O_RDWR, 0600);
+            if(file < 0) throw std::runtime_error("ParameterServer - No shared memory segment " + mName);
+            struct stat file_stat;
+            if(fstat(file, &file_stat) != 0 || static_cast<size_t>(file_stat.st_size) < sizeof(Header)) {
+                close(file);
+                throw std::runtime_error("ParameterServer - Invalid shared memory segment " + mName);
+            }
+            map(file, file_stat.st_size);
+            if(mHeader->magic != MAGIC || mHeader->value_size != sizeof(T)) {
+                unmap();
+                throw std::runtime_error("ParameterServer - Invalid shared memory segment " + mName);
+            }
+            if(worker < 0 || static_cast<uint32_t>(worker) >= mHeader->nb_workers) {
+                unmap();
+                throw std::runtime_error("ParameterServer - Invalid worker number");
+            }
+            try {
+                locate();
+                Lock lock(&mHeader->mutex);
+                mPids[mWorker] = getpid();
+            } catch(...) {
+                unmap();
+                throw;
+            }
+        }
+
+        ParameterServer(const ParameterServer&) = delete;
+        ParameterServer& operator=(const ParameterServer&) = delete;
+
+        ~ParameterServer()
+        {
+            if(mSegment == MAP_FAILED) return;
+            if(mWorker != SERVER) {
+                // The other workers stop waiting for this one
+                try {
+                    Lock lock(&mHeader->mutex);
+                    mClocks[mWorker] = DONE;
+                    pthread_cond_broadcast(&mHeader->clock_changed);
+                } catch(const std::runtime_error&) {
+                }
+            }
+            unmap();
+            if(mWorker == SERVER) shm_unlink(mName.c_str());
+        }
+
+        /**
+         * @brief Initializes the master weights, as NeuronLayer::initWeights
+         * does for layer l with stream l
+         */
+        void initWeights(WeightInit init, uint64_t seed, float min = -0.5f, float max = 0.5f)
+        {
+            Lock lock(&mHeader->mutex);
+            T* weights = mWeights;
+            for(uint32_t l=0; l+1 < mHeader->nb_layers; l++) {
+                float layer_min = min, layer_max = max;
+                weightInitRange(init, mSizes[l], mSizes[l+1]-1, layer_min, layer_max);
+                const size_t nb_weights = static_cast<size_t>(mSizes[l]) * mSizes[l+1];
+                philox::fillUniform(weights, nb_weights, seed, l, layer_min, layer_max);
+                weights += nb_weights;
+            }
+        }
+
+        /**
+         * @brief Replaces the master weights by those of perceptron
+         */
+        void setWeights(Perceptron<T>& perceptron)
+        {
+            std::vector<NeuronLayer<T>*> layers = checkTopology(perceptron);
+            Lock lock(&mHeader->mutex);
+            T* weights = mWeights;
+            for(size_t l=0; l+1 < layers.size(); l++) {
+                std::copy(layers[l]->getWeights(), layers[l]->getWeights() + layers[l]->getNbWeights(), weights);
+                weights += layers[l]->getNbWeights();
+            }
+        }
+
+        /**
+         * @brief Copies the master weights into perceptron. A worker first
+         * waits until it is at most max_staleness pushes ahead of the slowest
+         * worker.
+         */
+        void pull(Perceptron<T>& perceptron)
+        {
+            std::vector<NeuronLayer<T>*> layers = checkTopology(perceptron);
+            {
+                Lock lock(&mHeader->mutex);
+                if(tooFarAhead()) {
+                    const auto start = std::chrono::steady_clock::now();
+                    while(tooFarAhead()) {
+                        lock.waitFor(&mHeader->clock_changed, DEAD_WORKER_CHECK_SECONDS);
+                        releaseDeadWorkers();
+                    }
+                    mStats.staleness_wait += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+                }
+                std::copy(mWeights, mWeights + mHeader->nb_weights, mSnapshot.begin());
+            }
+            const T* weights = mSnapshot.data();
+            for(size_t l=0; l+1 < layers.size(); l++) {
+                layers[l]->setWeights(weights);
+                weights += layers[l]->getNbWeights();
+            }
+            mStats.pulls++;
+        }
+
+        /**
+         * @brief Adds to the master weights the changes of the weights of
+         * perceptron since the last pull (or push).
+         *
+         * @param threshold
+         *      Changes whose absolute value is not above threshold are
+         *      deferred to the next push (sparse update). 0 pushes all the
+         *      changes (dense update).
+         */
+        void push(Perceptron<T>& perceptron, float threshold = 0.f)
+        {
+            if(mWorker == SERVER) throw std::runtime_error("ParameterServer::push - Only workers push updates");
+            std::vector<NeuronLayer<T>*> layers = checkTopology(perceptron);
+
+            // Changes since the last synchronization, and what was deferred
+            size_t i = 0;
+            for(size_t l=0; l+1 < layers.size(); l++) {
+                const T* local = layers[l]->getWeights();
+                for(size_t j=0; j < layers[l]->getNbWeights(); j++, i++) {
+                    mResidual[i] += local[j] - mSnapshot[i];
+                    mSnapshot[i] = local[j];
+                }
+            }
+
+            size_t pushed = 0, deferred = 0;
+            {
+                Lock lock(&mHeader->mutex);
+                for(size_t j=0; j < mResidual.size(); j++) {
+                    if(std::fabs(mResidual[j]) > threshold) {
+                        mWeights[j] += mResidual[j];
+                        mResidual[j] = 0;
+                        pushed++;
+                    } else if(mResidual[j] != 0) {
+                        deferred++;
+                    }
+                }
+                mHeader->version++;
+                mClocks[mWorker]++;
+                pthread_cond_broadcast(&mHeader->clock_changed);
+            }
+            mStats.pushes++;
+            mStats.values_pushed += pushed;
+            mStats.values_deferred += deferred;
+        }
+
+        /**
+         * @brief Number of pushes applied, by all workers
+         */
+        uint64_t getVersion() const {
+            return mHeader->version;
+        }
+
+        /**
+         * @brief Number of pushes of worker
+         */
+        uint64_t getClock(int worker) const {
+            return mClocks[worker];
+        }
+
+        const Stats& getStats() const {
+            return mStats;
+        }
+};
+
+#endif
@@ -2,9 +2,18 @@
 #define __PERCEPTRON_HPP__
 
 #include "perceptron_layer.hpp"
+#include "step_plan.hpp"
+#include "async_validator.hpp"
+#include "epoch_sampler.hpp"
+#include "loss_tracker.hpp"
+#include "permutation.hpp"
 #include "debug/prettyprint.hpp"
 
+#include <atomic>
+#include <chrono>
+#include <functional>
 #include <list>
+#include <memory>
 #include <vector>
 #include <random>
 #include <stack>
@@ -56,10 +65,43 @@
  * That's it, now you can run it by setting the input values:
  * p.setInputValues(...)
  * p.run();
+ *
+ * Repeated inference should use the plan of the network, which binds the
+ * kernel arguments once:
+ * StepPlan<float>& plan = p.getStepPlan(...);
+ * plan.enqueueRun();
+ *
+ * Or, to only transfer the input and the output:
+ * std::vector<float> output;
+ * p.predict(kernel, input, output).wait();
+ *
+ * Convergence can be checked in the background of train(), on a validation
+ * set (see AsyncValidator):
+ * AsyncValidator<float> validator(context, queue, kernel, p.getFirstLayer(), validation_in, validation_out, confidence);
+ * p.setValidator(&validator);
+ *
+ * Or, more cheaply, from the loss accumulated by the training steps (see
+ * LossTracker):
+ * LossTracker<float> tracker(context, queue, kernel);
+ * p.setLossTracker(&tracker);
+ *
+ * Optionally, kernel launches can be tuned for the device (see WorkGroupTuner):
+ * WorkGroupTuner tuner;
+ * p.setTuner(&tuner);
  **/
 template<typename T>
 class Perceptron
 {
+    public:
+        // Throughput of the last call to train()
+        struct EpochStats {
+            // Complete passes over the training set
+            size_t epochs = 0;
+            size_t samples = 0;
+            double seconds = 0.;
+            double samples_per_second = 0.;
+        };
+
     private:
         cl::Context mContext;
         cl::CommandQueue mQueue;
@@ -68,8 +110,194 @@ class Perceptron
         NLayer *mFirstLayer;
         NLayer *mCurrentLayer;
 
-        static int layerCount;
+        // Numbers the layers of all the perceptrons, for display
+        static std::atomic<int> layerCount;
         int mCurrentLayerNumber = 0;
+        int mNbLayers = 0;
+
+        WorkGroupTuner* mTuner = nullptr;
+        WeightLayout mLayout = WeightLayout::RowMajor;
+        HostMemory mHostMemory = HostMemory::Copy;
+
+        // Concurrent scheduling of train() (see setConcurrentQueues)
+        bool mConcurrent = false;
+        cl::CommandQueue mComputeQueue;
+        cl::CommandQueue mUpdateQueue;
+        cl::CommandQueue mTransferQueue;
+
+        /**
+         * Completion events of the commands of the last concurrent training
+         * step, indexed by layer. The next step waits on them.
+         */
+        struct StepEvents {
+            bool started = false;
+            cl::Event upload_in;
+            cl::Event upload_out;
+            cl::Event out_delta;
+            std::vector<cl::Event> forward;
+            std::vector<cl::Event> backprop;
+            // update[l] updated the weights of layer l
+            std::vector<cl::Event> update;
+        };
+
+        // Bound kernels of the training step (see getStepPlan)
+        std::unique_ptr<StepPlan<T>> mPlan;
+
+        // Bound forward kernels of predict(), built from mPredictKernel
+        cl::Kernel mPredictKernel;
+        std::vector<BoundKernel> mPredictForward;
+
+        // Fused backpropagation and weight update (see useFusedTrainingKernel)
+        bool mFused = false;
+        cl::Kernel mFusedKernel;
+
+        EpochStats mEpochStats;
+
+        // Background convergence checks of train() (see setValidator)
+        AsyncValidator<T>* mValidator = nullptr;
+        int mValidationInterval = 100;
+
+        // Convergence checks of train() from the training loss (see setLossTracker)
+        LossTracker<T>* mLossTracker = nullptr;
+        int mLossInterval = 100;
+
+        bool hasConvergedForAllInputs(const std::function<void()>& run_network, const std::vector<std::vector<T>>& training_in_values, const std::vector<std::vector<T>>& training_out_values, const float& confidence)
+        {
+            for(int i=0; i<training_in_values.size(); i++) {
+                const auto& in_values = training_in_values[i];
+                const auto& out_values = training_out_values[i];
+                mFirstLayer->setValues(in_values);
+                mFirstLayer->uploadInputValues();
+
+                run_network();
+
+                float max_error = maxError(out_values, confidence);
+                if(max_error > 1.f-confidence) {
+                    cout << "max error: " << max_error << endl;
+                    return false;
+                } 
+            }
+            return true;
+        }
+
+        std::vector<NLayer*> getLayers()
+        {
+            std::vector<NLayer*> layers;
+            NLayer* layer = mFirstLayer;
+            while(layer != nullptr) {
+                layers.push_back(layer);
+                layer = layer->getNextLayer();
+            }
+            return layers;
+        }
+
+        /**
+         * @brief Drops the bound kernels, after a change of the topology, the
+         * buffers or the tuner
+         */
+        void invalidatePlans()
+        {
+            mPlan.reset();
+            mPredictForward.clear();
+        }
+
+        void finishConcurrentQueues()
+        {
+            mTransferQueue.finish();
+            mComputeQueue.finish();
+            mUpdateQueue.finish();
+        }
+
+        /**
+         * @brief Enqueues one training step without blocking.
+         *
+         * Each command only waits for the commands producing its inputs, or
+         * still reading the buffers it overwrites:
+         * - the expected output is uploaded during the forward pass
+         * - the update of the weights of layer l runs alongside the
+         *   backpropagation into layer l-1 (it must wait for the
+         *   backpropagation into layer l, which reads the weights before update)
+         * - the next input is uploaded as soon as the weights of the first
+         *   layer have been updated, while deeper layers are still updated
+         *   (with ZeroCopy or SharedVirtualMemory, the host waits for the
+         *   update of the first layer before writing the next input)
+         **/
+        void enqueueConcurrentTrainStep(StepPlan<T>& plan, const std::vector<T>& training_in, const std::vector<T>& training_out, StepEvents& ev)
+        {
+            const int n = plan.getNbLayers();
+            const bool started = ev.started;
+            StepEvents prev = ev;
+            ev.forward.assign(n, cl::Event());
+            ev.backprop.assign(n, cl::Event());
+            ev.update.assign(n, cl::Event());
+            ev.started = true;
+
+            // The host array is being uploaded by the previous step
+            if(started) prev.upload_in.wait();
+            // When the buffer shares the host array, writing it also changes
+            // the input still read by the previous forward pass and update
+            if(started && (mFirstLayer->isZeroCopy() || mFirstLayer->isSharedVirtualMemory())) {
+                prev.forward[0].wait();
+                prev.update[0].wait();
+            }
+            mFirstLayer->setValues(training_in);
+            EventList deps;
+            if(started) deps.push_back(prev.update[0]);
+            mFirstLayer->uploadInputValues(LaunchOrder(&ev.upload_in, &deps, &mTransferQueue));
+
+            deps.clear();
+            if(started) deps.push_back(prev.out_delta);
+            mTransferQueue.enqueueWriteBuffer(plan.getExpectedOutputBuf(), CL_FALSE, 0, sizeof(T)*training_out.size(), training_out.data(), &deps, &ev.upload_out);
+
+            // Forward pass
+            for(int l=0; l+1 < n; l++) {
+                deps.clear();
+                deps.push_back(l == 0 ? ev.upload_in : ev.forward[l-1]);
+                if(started) {
+                    deps.push_back(prev.update[l]);
+                    // The values computed by this layer are read by the update of the next one
+                    if(l+2 < n) deps.push_back(prev.update[l+1]);
+                }
+                plan.enqueueForward(l, LaunchOrder(&ev.forward[l], &deps, &mComputeQueue));
+            }
+
+            deps.clear();
+            deps.push_back(ev.forward[n-2]);
+            deps.push_back(ev.upload_out);
+            plan.enqueueOutputDelta(LaunchOrder(&ev.out_delta, &deps, &mComputeQueue));
+
+            if(plan.isFused()) {
+                // Each launch depends on the delta computed by the previous one
+                for(int l=n-2; l >= 0; l--) {
+                    deps.clear();
+                    deps.push_back(l+1 == n-1 ? ev.out_delta : ev.update[l+1]);
+                    plan.enqueueBackpropagateUpdateWeights(l, LaunchOrder(&ev.update[l], &deps, &mComputeQueue));
+                    ev.backprop[l] = ev.update[l];
+                }
+                mTransferQueue.flush();
+                mComputeQueue.flush();
+                return;
+            }
+
+            // Backpropagation (the delta of the input layer is never used)
+            for(int l=n-2; l >= 1; l--) {
+                deps.clear();
+                deps.push_back(l+1 == n-1 ? ev.out_delta : ev.backprop[l+1]);
+                plan.enqueueBackpropagate(l, LaunchOrder(&ev.backprop[l], &deps, &mComputeQueue));
+            }
+
+            // Weight updates
+            for(int l=n-2; l >= 0; l--) {
+                deps.clear();
+                deps.push_back(l+1 == n-1 ? ev.out_delta : ev.backprop[l+1]);
+                if(l >= 1) deps.push_back(ev.backprop[l]);
+                plan.enqueueUpdateWeights(l, LaunchOrder(&ev.update[l], &deps, &mUpdateQueue));
+            }
+
+            mTransferQueue.flush();
+            mComputeQueue.flush();
+            mUpdateQueue.flush();
+        }
 
     public:
         Perceptron(cl::Context& context, cl::CommandQueue& queue) : mContext(context), mQueue(queue), mFirstLayer(nullptr), mCurrentLayer(nullptr) {
@@ -88,8 +316,38 @@ class Perceptron
             }
         }
 
+        /**
+         * @brief Initializes the weights of all layers on the host,
+         * reproducibly from seed (see NeuronLayer::initWeights)
+         */
+        void initWeights(WeightInit init, uint64_t seed) {
+            NLayer *layer = mFirstLayer;
+            while(layer != nullptr && layer->getNextLayer() != nullptr) {
+                layer->initWeights(init, seed);
+                layer = layer->getNextLayer();
+            }
+        }
+
+        /**
+         * @brief Initializes the weights of all layers on the device, with
+         * kernel perceptron_init_weights. Gives the same weights as
+         * initWeights(init, seed). To be called after upload().
+         */
+        void enqueueInitWeights(cl::Kernel& kernel, WeightInit init, uint64_t seed) {
+            NLayer *layer = mFirstLayer;
+            while(layer != nullptr && layer->getNextLayer() != nullptr) {
+                layer->enqueueInitWeights(kernel, init, seed, -0.5f, 0.5f, LaunchOrder::inOrder(&mQueue));
+                layer = layer->getNextLayer();
+            }
+            mQueue.finish();
+        }
+
         void createLayer(const int& size) {
             NLayer *neuronLayer = new NLayer(size, mQueue);
+            neuronLayer->setTuner(mTuner);
+            if(mLayout != WeightLayout::RowMajor) neuronLayer->setWeightLayout(mLayout);
+            if(mHostMemory != HostMemory::Copy) neuronLayer->setHostMemory(mHostMemory);
+            invalidatePlans();
             if(mFirstLayer == nullptr) {
                 mFirstLayer = neuronLayer;
                 mCurrentLayer = mFirstLayer;
@@ -103,6 +361,128 @@ class Perceptron
             }
             neuronLayer->setNumber(mCurrentLayerNumber);
             mCurrentLayerNumber++;
+            neuronLayer->setIndex(mNbLayers++);
+        }
+
+        /**
+         * @brief Uses tuner to choose the work-group size and kernel variant
+         * of every kernel launch. nullptr restores the driver's choice.
+         */
+        void setTuner(WorkGroupTuner* tuner)
+        {
+            mTuner = tuner;
+            invalidatePlans();
+            NLayer *layer = mFirstLayer;
+            while(layer != nullptr) {
+                layer->setTuner(tuner);
+                layer = layer->getNextLayer();
+            }
+        }
+
+        /**
+         * @brief Layout of the weights on the device, for all layers
+         * (see WeightLayout). Should be set before upload().
+         */
+        void setWeightLayout(WeightLayout layout)
+        {
+            mLayout = layout;
+            invalidatePlans();
+            NLayer *layer = mFirstLayer;
+            while(layer != nullptr) {
+                layer->setWeightLayout(layout);
+                layer = layer->getNextLayer();
+            }
+        }
+
+        /**
+         * @brief Whether the buffers of all layers use their host arrays as
+         * storage (see HostMemory). Should be set before createLayer(), to
+         * avoid creating the buffers twice.
+         */
+        void setHostMemory(HostMemory host_memory)
+        {
+            mHostMemory = host_memory;
+            invalidatePlans();
+            NLayer *layer = mFirstLayer;
+            while(layer != nullptr) {
+                layer->setHostMemory(host_memory);
+                layer = layer->getNextLayer();
+            }
+        }
+
+        /**
+         * @brief Lets train() overlap independent commands instead of
+         * blocking after each of them.
+         *
+         * Kernels of the forward and backward passes go to compute_queue,
+         * weight updates to update_queue and host to device transfers to
+         * transfer_queue. Dependencies between them are explicit events, so
+         * the queues may all be the same out-of-order queue
+         * (CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE), or different in-order
+         * queues of the perceptron's context.
+         */
+        void setConcurrentQueues(const cl::CommandQueue& compute_queue, const cl::CommandQueue& update_queue, const cl::CommandQueue& transfer_queue)
+        {
+            mComputeQueue = compute_queue;
+            mUpdateQueue = update_queue;
+            mTransferQueue = transfer_queue;
+            mConcurrent = true;
+        }
+
+        void setConcurrentQueues(const cl::CommandQueue& out_of_order_queue)
+        {
+            setConcurrentQueues(out_of_order_queue, out_of_order_queue, out_of_order_queue);
+        }
+
+        /**
+         * @brief Trains with the fused kernel
+         * perceptron_train_backpropagate_update_weights instead of separate
+         * backpropagation and weight update launches.
+         */
+        void useFusedTrainingKernel(const cl::Kernel& fused_kernel)
+        {
+            mFusedKernel = fused_kernel;
+            mFused = true;
+        }
+
+        void disableFusedTrainingKernel()
+        {
+            mFused = false;
+        }
+
+        /**
+         * @brief Replaces the convergence checks of train(), which block it
+         * every 100 iterations, by validator: every interval iterations, a
+         * snapshot of the weights is validated in the background, and train()
+         * stops once one has converged. nullptr restores the checks.
+         */
+        void setValidator(AsyncValidator<T>* validator, int interval = 100)
+        {
+            if(interval < 1) throw std::runtime_error("Perceptron::setValidator - The interval must be positive");
+            mValidator = validator;
+            mValidationInterval = interval;
+        }
+
+        /**
+         * @brief Lets train() check convergence from the loss accumulated on
+         * the device by its training steps (see LossTracker): every interval
+         * iterations, the max error of the last epoch is read back, instead
+         * of running the training set through the network. A validator (see
+         * setValidator) still takes precedence. nullptr restores the checks.
+         */
+        void setLossTracker(LossTracker<T>* tracker, int interval = 100)
+        {
+            if(interval < 1) throw std::runtime_error("Perceptron::setLossTracker - The interval must be positive");
+            mLossTracker = tracker;
+            mLossInterval = interval;
+        }
+
+        /**
+         * @brief Back to the default, blocking, scheduling on the perceptron's queue
+         */
+        void disableConcurrentQueues()
+        {
+            mConcurrent = false;
         }
 
         void setWeights(const std::list<std::list<T>>& weights)
@@ -129,6 +509,7 @@ class Perceptron
         void upload() {
             // Create the buffers for the last layer
             mCurrentLayer->createBuffers(mContext);
+            invalidatePlans();
 
             NLayer *layer = mFirstLayer;
             while(layer != nullptr) {
@@ -147,6 +528,11 @@ class Perceptron
             }
         }
 
+        /**
+         * @brief Reads back what kernels modified in all layers. Only needed
+         * to control when the transfers happen: host accesses (getValues,
+         * getWeights, displayAll) read back on demand.
+         */
         void enqueueReadAllBuffers()
         {
             if(mFirstLayer == nullptr) return; 
@@ -161,6 +547,7 @@ class Perceptron
         void displayAll() {
             NLayer* layer = mFirstLayer; 
             while(layer != nullptr) {
+                layer->enqueueReadBuffers();
                 cout << *layer << endl;
                 layer = layer->getNextLayer();
             }
@@ -187,125 +574,228 @@ class Perceptron
 
         bool hasConvergedForAllInputs(cl::Kernel& kernel, const std::vector<std::vector<T>>& training_in_values, const std::vector<std::vector<T>>& training_out_values, const float& confidence)
         {
-            for(int i=0; i<training_in_values.size(); i++) {
-                const auto& in_values = training_in_values[i];
-                const auto& out_values = training_out_values[i];
-                mFirstLayer->setValues(in_values);
-                mFirstLayer->uploadInputValues();
+            return hasConvergedForAllInputs([&]() { this->run(kernel); }, training_in_values, training_out_values, confidence);
+        }
 
-                this->run(kernel);
+        bool hasConvergedForAllInputs(StepPlan<T>& plan, const std::vector<std::vector<T>>& training_in_values, const std::vector<std::vector<T>>& training_out_values, const float& confidence)
+        {
+            return hasConvergedForAllInputs([&]() { plan.enqueueRun(); }, training_in_values, training_out_values, confidence);
+        }
 
-                float max_error = maxError(out_values, confidence);
-                if(max_error > 1.f-confidence) {
-                    cout << "max error: " << max_error << endl;
-                    //mFirstLayer->setValues(training_in);
-                    //mFirstLayer->uploadInputValues();
-                    return false;
-                } 
+        /**
+         * @brief Returns the plan of the training step and inference for
+         * these kernels.
+         * The plan is built on the first call (after upload()), and kept as
+         * long as the topology, the tuner and the kernels do not change.
+         */
+        StepPlan<T>& getStepPlan(cl::Kernel& kernel, cl::Kernel& train_output_layer_kernel, cl::Kernel& train_backpropagate_kernel, cl::Kernel& train_update_weights_kernel, const float& epsilon)
+        {
+            if(mPlan == nullptr || !mPlan->uses(kernel, train_output_layer_kernel, train_backpropagate_kernel, train_update_weights_kernel)) {
+                mPlan.reset(new StepPlan<T>(mContext, mQueue, mFirstLayer, kernel, train_output_layer_kernel, train_backpropagate_kernel, train_update_weights_kernel, epsilon));
             }
-            return true;
+            mPlan->setEpsilon(epsilon);
+            if(mConcurrent) {
+                mPlan->addQueue(mComputeQueue);
+                mPlan->addQueue(mUpdateQueue);
+                mPlan->addQueue(mTransferQueue);
+            }
+            if(mFused) {
+                mPlan->useFusedKernel(mFusedKernel);
+            } else {
+                mPlan->disableFusedKernel();
+            }
+            return *mPlan;
+        }
+
+        /**
+         * @brief Runs the network on input, and reads the values of the output
+         * layer (bias excluded) into output, of size output_size.
+         *
+         * Unlike setInputValues, run and enqueueReadAllBuffers, nothing waits
+         * in between: the input upload, the forward pass (with kernel
+         * arguments bound once) and a single read of the output
+         * layer are enqueued on the perceptron's queue, and the returned event
+         * signals the completion of the read.
+         * input and output must stay valid until then. The host copies of
+         * the layers are not updated.
+         */
+        cl::Event predict(cl::Kernel& kernel, const std::vector<T>& input, T* output, size_t output_size)
+        {
+            if(mFirstLayer == nullptr || mFirstLayer->getNextLayer() == nullptr)
+                throw std::runtime_error("Perceptron::predict - You must have more than one layer to predict !");
+            if(input.size() != static_cast<size_t>(mFirstLayer->getSize()-1))
+                throw std::runtime_error("Perceptron::predict - Input size does not match the input layer");
+            if(output_size != static_cast<size_t>(mCurrentLayer->getSize()-1))
+                throw std::runtime_error("Perceptron::predict - Output size does not match the output layer");
+
+            if(mPredictForward.empty() || mPredictKernel() != kernel()) {
+                mPredictKernel = kernel;
+                mPredictForward.clear();
+                for(NLayer* layer = mFirstLayer; layer->getNextLayer() != nullptr; layer = layer->getNextLayer()) {
+                    mPredictForward.push_back(layer->prepareRun(kernel));
+                }
+            }
+
+            mFirstLayer->enqueueWriteValues(input.data(), LaunchOrder::inOrder(&mQueue));
+            NLayer* layer = mFirstLayer;
+            for(const BoundKernel& forward : mPredictForward) {
+                if(layer->enqueueBound(forward, LaunchOrder::inOrder(&mQueue)) != CL_SUCCESS)
+                    throw std::runtime_error("Perceptron::predict - Error running kernel");
+                layer = layer->getNextLayer();
+            }
+            cl::Event done;
+            mCurrentLayer->enqueueReadValues(output, LaunchOrder(&done, nullptr, &mQueue));
+            return done;
+        }
+
+        cl::Event predict(cl::Kernel& kernel, const std::vector<T>& input, std::vector<T>& output)
+        {
+            output.resize(mCurrentLayer->getSize()-1);
+            return predict(kernel, input, output.data(), output.size());
         }
 
-        bool train(cl::Kernel& kernel, cl::Kernel& train_output_layer_kernel, cl::Kernel& train_backpropagate_kernel, cl::Kernel& train_update_weights_kernel, const std::vector<std::vector<T>>& training_in_values, const std::vector<std::vector<T>>& training_out_values, const float& epsilon, const float& confidence=0.8, const int& max_iterations=100000) {
+        /**
+         * @brief Trains the network until it has converged under confidence
+         * on all of the training set, or max_iterations.
+         * Training goes by epochs: each one visits all of the training set,
+         * in a new random order, shuffled and gathered on the device (see
+         * EpochSampler). The throughput is kept in getEpochStats().
+         * When stop is given, training is abandoned (and false returned) as
+         * soon as it is set, e.g. by another thread (see RandomRestartTrainer).
+         */
+        bool train(cl::Kernel& kernel, cl::Kernel& train_output_layer_kernel, cl::Kernel& train_backpropagate_kernel, cl::Kernel& train_update_weights_kernel, const std::vector<std::vector<T>>& training_in_values, const std::vector<std::vector<T>>& training_out_values, const float& epsilon, const float& confidence=0.8, const int& max_iterations=100000, const std::atomic<bool>* stop=nullptr) {
             // XXX: nothing to ensure weights have been initialized to [-0.5, 0.5]
             if(training_in_values.size() != training_out_values.size()) {
                 throw std::runtime_error("Perceptron::Train - Training input and output size must match!");
             } else if(mFirstLayer == nullptr) {
                 throw std::runtime_error("Perceptron::Train - You must have more than one layer to train a perceptron !");
+            } else if(training_in_values.empty()) {
+                throw std::runtime_error("Perceptron::Train - The training set is empty!");
+            } else if(training_out_values[0].size() != static_cast<size_t>(mCurrentLayer->getSize()-1)) {
+                throw std::runtime_error("Perceptron::Train - Expected output size must match the output layer size!");
             }
             std::random_device rd; // obtain a random number from hardware
-            std::mt19937 eng(rd()); // seed the generator
-            std::uniform_int_distribution<int> distr(0, training_in_values.size()-1);
+            const uint64_t seed = (static_cast<uint64_t>(rd()) << 32) | rd();
 
             /**
-             * Prepare buffers
+             * Prepare buffers and bound kernels
              **/
-            std::vector<cl::Buffer> delta_bufs;
-            NLayer *layer = mFirstLayer;
-            while(layer != nullptr) {
-                delta_bufs.push_back(cl::Buffer(mContext, CL_MEM_READ_ONLY, sizeof(T) * layer->getSize()));
-                layer = layer->getNextLayer();
+            StepPlan<T>& plan = getStepPlan(kernel, train_output_layer_kernel, train_backpropagate_kernel, train_update_weights_kernel, epsilon);
+            if(mLossTracker != nullptr) {
+                if(mConcurrent) throw std::runtime_error("Perceptron::train - The loss tracker does not support concurrent queues");
+                mLossTracker->reset();
+                plan.setOutputDelta(mLossTracker->prepareOutputDelta(plan));
+            } else {
+                plan.resetOutputDelta();
             }
-            cl::Buffer& delta_out_buf = *(--end(delta_bufs)); 
-            cl::Buffer training_out_buf(mContext, CL_MEM_READ_ONLY, sizeof(T) * training_out_values.size());
-
-
+            StepEvents step_events;
+            // The concurrent steps upload their sample: only its order is needed
+            std::unique_ptr<EpochSampler<T>> sampler;
+            if(!mConcurrent) {
+                sampler.reset(new EpochSampler<T>(mContext, mQueue, kernel, mFirstLayer, plan.getExpectedOutputBuf(), training_in_values, training_out_values, seed));
+            }
+            const LaunchOrder order = LaunchOrder::inOrder(&mQueue);
+            const cl_uint nb_samples = training_in_values.size();
+
+            mEpochStats = EpochStats();
+            if(mValidator != nullptr) mValidator->reset();
+            const auto start = std::chrono::steady_clock::now();
+            auto finish = [&]() {
+                if(mConcurrent) {
+                    finishConcurrentQueues();
+                } else if(mQueue.finish() != CL_SUCCESS) {
+                    throw std::runtime_error("Perceptron::train - command queue failed to execute");
+                }
+                if(mValidator != nullptr) mValidator->wait();
+                mEpochStats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+                if(mEpochStats.seconds > 0.) {
+                    mEpochStats.samples_per_second = mEpochStats.samples / mEpochStats.seconds;
+                }
+            };
+
+            // Copies back the snapshot that converged: training went on since
+            auto validated = [&](int train) {
+                finish();
+                mValidator->enqueueRestore(mFirstLayer, mQueue);
+                cout << "Trained in " << train << " iterations (" << mEpochStats.epochs << " epochs, " << mEpochStats.samples_per_second << " samples/s), validated at iteration " << mValidator->getStats().converged_iteration << " under confidence: " << confidence << endl;
+                return true;
+            };
+            // End of the steps enqueued before the last snapshot
+            cl::Event interval_done;
 
             int train = 0;
-            bool hasConverged=false;
-            while(train++ < max_iterations && !hasConverged) {
-                // Pick random values in training set
-                int rand_training_set = distr(eng);
-                //const std::vector<T>& training_in = training_in_values[rand_training_set];
-                //const std::vector<T>& training_out = training_out_values[rand_training_set];
-                const std::vector<T>& training_in = training_in_values[(train-1)%4];
-                const std::vector<T>& training_out = training_out_values[(train-1)%4];
-
-                /**
-                 * Step 1.1: Compute output o
-                 **/
-                // Write input data to GPU. Leave all other parameters unchanged
-                mFirstLayer->setValues(training_in);
-                mFirstLayer->uploadInputValues();
+            for(cl_uint epoch = 0; train < max_iterations; epoch++) {
+                if(sampler) sampler->enqueueShuffle(epoch);
 
-                // Running perceptron kernel to compute the output layer o
-                run(kernel);
+                for(cl_uint step = 0; step < nb_samples && train++ < max_iterations; step++) {
+                    if(stop != nullptr && stop->load(std::memory_order_relaxed)) {
+                        finish();
+                        return false;
+                    }
 
+                    /**
+                     * Checks every 100 iteration if 
+                     * algorithm has converged with confidence greater than minimum required
+                     **/
+                    if(mValidator != nullptr) {
+                        if(mValidator->hasConverged()) return validated(train);
+                        if(train % mValidationInterval == 0) {
+                            // At most two intervals of steps in flight: the
+                            // host may not run ahead of the device (and of
+                            // the validation) until max_iterations
+                            if(interval_done() != nullptr) interval_done.wait();
+                            // The concurrent queues may reorder the next updates before the copy
+                            if(mConcurrent) finishConcurrentQueues();
+                            mValidator->submit(mFirstLayer, mQueue, train);
+                            mQueue.enqueueMarkerWithWaitList(nullptr, &interval_done);
+                            mQueue.flush();
+                        }
+                    } else if(mLossTracker != nullptr) {
+                        if(train % mLossInterval == 0 && mLossTracker->pollConverged(1.f-confidence)) {
+                            finish();
+                            cout << "Trained in " << train << " iterations (" << mEpochStats.epochs << " epochs, " << mEpochStats.samples_per_second << " samples/s), training loss under confidence: " << confidence << endl;
+                            return true;
+                        }
+                    } else if(train%100 == 0) {
+                        finish();
+                        if(hasConvergedForAllInputs(plan, training_in_values, training_out_values, confidence)) {
+                            cout << "Trained in " << train << " iterations (" << mEpochStats.epochs << " epochs, " << mEpochStats.samples_per_second << " samples/s), under confidence: " << confidence << endl;
+                            return true;
+                        }
+                    }
 
-                /**
-                 * Checks every 100 iteration if 
-                 * algorithm has converged with confidence greater than minimum required
-                 **/
-                if(train%100 == 0) {
-                    bool hasConverged = hasConvergedForAllInputs(kernel, training_in_values, training_out_values, confidence);
-                    if(hasConverged) {
-                        cout << "Trained in " << train << " iterations, under confidence: " << confidence << endl;
-                        return true;
+                    /**
+                     * Forward pass, delta of the output layer, back propagation
+                     * and update of the weights
+                     **/
+                    if(mConcurrent) {
+                        const cl_uint sample = permutation::index(step, nb_samples, seed, epoch);
+                        enqueueConcurrentTrainStep(plan, training_in_values[sample], training_out_values[sample], step_events);
                     } else {
-                        mFirstLayer->setValues(training_in);
-                        mFirstLayer->uploadInputValues();
+                        sampler->enqueueGather(step, order);
+                        plan.enqueueTrainStages(order);
                     }
+                    mEpochStats.samples++;
                 }
-
-                /**
-                 * Step 1.2: Compute delta_i for the output layer
-                 **/
-                // Upload expected output to GPU
-                mQueue.enqueueWriteBuffer(training_out_buf, CL_TRUE, 0, sizeof(T)*training_out.size(), training_out.data());
-                // expected out, delta
-                mCurrentLayer->enqueueTrainOutputLayer(train_output_layer_kernel, training_out_buf, delta_out_buf);
-                /**
-                 * ----------------
-                 * Back propagation
-                 * ----------------
-                 **/
-                // second to last buffer first
-                int current_buf_num = delta_bufs.size()-1;
-                // Start from second to last layer and move up the layers to the first one
-                NLayer* layer = mCurrentLayer->getPreviousLayer();
-                while(layer != nullptr) {
-                    cl::Buffer& succDeltaBuffer = delta_bufs[current_buf_num];
-                    cl::Buffer& currentDeltaBuffer = delta_bufs[--current_buf_num]; 
-                    layer->enqueueTrainBackpropagate(train_backpropagate_kernel, currentDeltaBuffer, succDeltaBuffer);
-                    layer = layer->getPreviousLayer();
+                if(mEpochStats.samples == (mEpochStats.epochs + 1) * nb_samples) {
+                    mEpochStats.epochs++;
+                    if(mLossTracker != nullptr) mLossTracker->enqueueEndEpoch(nb_samples);
                 }
-
-                /**
-                 * Update the weights
-                 **/
-                current_buf_num = 0; 
-                layer = mFirstLayer->getNextLayer();
-                while(layer != nullptr) {
-                    cl::Buffer & buf = delta_bufs[++current_buf_num];
-                    layer->enqueueTrainUpdateWeights(train_update_weights_kernel, buf, epsilon);
-                    layer = layer->getNextLayer();
-                }
-                
             }
+            finish();
+            // The last snapshot may have converged
+            if(mValidator != nullptr && mValidator->hasConverged()) return validated(std::min(train, max_iterations));
             return false; 
         }
+
+        /**
+         * @brief Throughput of the last call to train()
+         */
+        const EpochStats& getEpochStats() const {
+            return mEpochStats;
+        }
 };
 
-template<typename T> int Perceptron<T>::layerCount = 0;
+template<typename T> std::atomic<int> Perceptron<T>::layerCount(0);
 
 #endif
@@ -70,8 +70,9 @@ void kernel perceptron_train_backpropagate(
     private const int succ_size = succ_layer_size;
 
     private float sum = 0.f;
-    for(int k=0; k < succ_size; k++) {
-        sum += succ_layer_delta_i[k] * weights[i + curr_size * k];
+    // The bias of the next layer has no delta
+    for(int k=0; k < succ_size-1; k++) {
+        sum += succ_layer_delta_i[k] * weights[i + (size_t)curr_size * k];
     }
     current_delta_out[i] = oi*(1-oi) * sum;
 }
@@ -95,8 +96,9 @@ void kernel perceptron_train_update_weights(
         global const float *delta,
         global float* weights)
 {
-    private const int global_id = get_global_id(0);
-    private const int out_layer_s = out_layer_size;
+    // 64 bits: the weight matrix may have more than 2^31 elements
+    private const size_t global_id = get_global_id(0);
+    private const size_t out_layer_s = out_layer_size;
     private const float val = pred_values[global_id % out_layer_s];
 
     // XXX to change
@@ -105,6 +107,61 @@ void kernel perceptron_train_update_weights(
     weights[global_id] += epsilon * delta[global_id /out_layer_s] * val; 
 }
 
+/**
+ * @brief Backpropagation and weight update of one layer in a single pass
+ * (equivalent to perceptron_train_backpropagate followed by
+ * perceptron_train_update_weights on the same weights).
+ *
+ * Work-item i owns the column i of the weight matrix (weights from neuron i
+ * of the current layer), so each weight is read once: its value before
+ * update contributes to the delta of neuron i, then the updated value is
+ * written back. No other work-item accesses it.
+ * The kernel should be run with a NDRange of curr_size (bias included, its
+ * weights are updated but it has no delta).
+ *
+ * @param curr_size
+ *      Size of current layer
+ * @param succ_layer_size
+ *      Size of the output layer of current layer (the bias neuron of the
+ *      output layer has no delta)
+ * @param epsilon_value
+ *      Learning rate
+ * @param current_layer_values
+ * @param weights
+ *      Weights between current layer and its output layer, updated in place
+ * @param succ_layer_delta_i
+ *      Values of delta for the next layer
+ * @param current_delta_out
+ *      Output: delta of the current layer
+ **/
+void kernel perceptron_train_backpropagate_update_weights(
+        const int curr_size,
+        const int succ_layer_size,
+        const float epsilon_value,
+        global const float* current_layer_values,
+        global float* weights,
+        global const float* succ_layer_delta_i,
+        // output
+        global float* current_delta_out
+        )
+{
+    private const int i = get_global_id(0);
+    private const float oi = current_layer_values[i];
+    private const float step = epsilon_value * oi;
+
+    private float sum = 0.f;
+    for(int k=0; k < succ_layer_size-1; k++) {
+        private const float delta_k = succ_layer_delta_i[k];
+        private const size_t index = i + (size_t)curr_size * k;
+        private const float w = weights[index];
+        sum += delta_k * w;
+        weights[index] = w + step * delta_k;
+    }
+    if(i < curr_size-1) {
+        current_delta_out[i] = oi*(1-oi) * sum;
+    }
+}
+
 /**
 * @brief Computes one layer of the perceptron given the previous one and the
 * weights
@@ -145,9 +202,1060 @@ void kernel perceptron(
     private const int out_layer_s = out_layer_size;
     private const int in_layer_s = in_layer_size;
 
+    // Weights of the output neuron global_id
+    global const float* row = in_weights + (size_t)in_layer_s*global_id;
+
     private float sum = 0.;
     for(int i=0; i < in_layer_s; i++) {
-        sum += in_weights[i+in_layer_s*global_id] * in_value[i];
+        sum += row[i] * in_value[i];
+    }
+    out_values[global_id] = sigmoid(sum);
+}
+
+
+#define PERCEPTRON_TILE 64
+
+/**
+* @brief Same as perceptron, but the work-group first caches a tile of the
+* input values in local memory.
+* Variant of the perceptron kernel, selected by the WorkGroupTuner when it
+* is faster on the device. It takes the same arguments.
+*/
+void kernel perceptron_tiled(
+        const int in_layer_size,
+        const int out_layer_size,
+        global const float *in_value,
+        global const float* in_weights,
+      global float* out_values)
+{
+    local float tile[PERCEPTRON_TILE];
+    private const int global_id = get_global_id(0);
+    private const int local_id = get_local_id(0);
+    private const int local_size = get_local_size(0);
+    private const int in_layer_s = in_layer_size;
+    global const float* row = in_weights + (size_t)in_layer_s*global_id;
+
+    private float sum = 0.;
+    for(int base=0; base < in_layer_s; base += PERCEPTRON_TILE) {
+        private const int tile_size = min(PERCEPTRON_TILE, in_layer_s - base);
+        for(int i=local_id; i < tile_size; i += local_size) {
+            tile[i] = in_value[base + i];
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+        for(int i=0; i < tile_size; i++) {
+            sum += row[base+i] * tile[i];
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+    out_values[global_id] = sigmoid(sum);
+}
+
+
+/**
+ * Kernels for the mirrored weight layout
+ * ======================================
+ *
+ * In the mirrored layout, each layer also keeps a transposed copy of its
+ * weights: weights_t[i * succ_size + k] == weights[k * curr_size + i].
+ * Each kernel reads the copy for which its accesses are contiguous: within a
+ * work-item on CPU devices, across neighbouring work-items on GPUs.
+ * The weight update kernels write both copies.
+ */
+
+/**
+ * @brief Same as perceptron, reading the transposed weights.
+ * Neighbouring work-items read neighbouring weights (coalesced on GPUs).
+ */
+void kernel perceptron_transposed(
+        const int in_layer_size,
+        const int out_layer_size,
+        global const float *in_value,
+        global const float* in_weights_t,
+      global float* out_values)
+{
+    private const int global_id = get_global_id(0);
+    private const int in_layer_s = in_layer_size;
+    // Row length of the transposed matrix (bias neuron of the output included)
+    private const int out_layer_s = out_layer_size+1;
+
+    private float sum = 0.;
+    for(int i=0; i < in_layer_s; i++) {
+        sum += in_weights_t[global_id + (size_t)out_layer_s*i] * in_value[i];
+    }
+    out_values[global_id] = sigmoid(sum);
+}
+
+/**
+ * @brief Same as perceptron_train_backpropagate, reading the transposed
+ * weights: each work-item reads a contiguous row.
+ * The bias neuron of the output layer has no delta, and is skipped.
+ */
+void kernel perceptron_train_backpropagate_transposed(
+        const int curr_size,
+        const int succ_layer_size,
+        global const float* current_layer_values,
+        global const float* weights_t,
+        global const float* succ_layer_delta_i,
+        // output
+        global float* current_delta_out
+        )
+{
+    private const int i = get_global_id(0);
+    private const float oi = current_layer_values[i];
+    private const int succ_size = succ_layer_size;
+
+    private float sum = 0.f;
+    global const float* row = weights_t + (size_t)succ_size * i;
+    for(int k=0; k < succ_size-1; k++) {
+        sum += succ_layer_delta_i[k] * row[k];
+    }
+    current_delta_out[i] = oi*(1-oi) * sum;
+}
+
+/**
+ * @brief Same as perceptron_train_update_weights, keeping the transposed
+ * copy of the weights up to date.
+ *
+ * @param succ_layer_size
+ *      Size of the layer the updated weights lead to (bias included)
+ */
+void kernel perceptron_train_update_weights_mirrored(
+        const int out_layer_size,
+        const int succ_layer_size,
+        const float epsilon_value,
+        global const float *pred_values,
+        global const float *delta,
+        global float* weights,
+        global float* weights_t)
+{
+    private const size_t global_id = get_global_id(0);
+    private const size_t out_layer_s = out_layer_size;
+    private const size_t row = global_id / out_layer_s;
+    private const size_t column = global_id % out_layer_s;
+
+    private const float w = weights[global_id] + epsilon_value * delta[row] * pred_values[column];
+    weights[global_id] = w;
+    weights_t[row + succ_layer_size * column] = w;
+}
+
+/**
+ * @brief Same as perceptron_train_backpropagate_update_weights, reading the
+ * transposed weights (work-item i reads a contiguous row) and updating both
+ * copies.
+ */
+void kernel perceptron_train_backpropagate_update_weights_mirrored(
+        const int curr_size,
+        const int succ_layer_size,
+        const float epsilon_value,
+        global const float* current_layer_values,
+        global float* weights,
+        global float* weights_t,
+        global const float* succ_layer_delta_i,
+        // output
+        global float* current_delta_out
+        )
+{
+    private const int i = get_global_id(0);
+    private const float oi = current_layer_values[i];
+    private const float step = epsilon_value * oi;
+
+    private float sum = 0.f;
+    for(int k=0; k < succ_layer_size-1; k++) {
+        private const float delta_k = succ_layer_delta_i[k];
+        private const size_t index_t = k + (size_t)succ_layer_size * i;
+        private const float w = weights_t[index_t];
+        sum += delta_k * w;
+        weights_t[index_t] = w + step * delta_k;
+        weights[i + (size_t)curr_size * k] = w + step * delta_k;
+    }
+    if(i < curr_size-1) {
+        current_delta_out[i] = oi*(1-oi) * sum;
+    }
+}
+
+
+/**
+ * Kernels of the gradient compression
+ * ===================================
+ *
+ * Compress what a training step changed in the weights of a layer before it
+ * is exchanged between processes (see DataParallelTrainer), and apply what
+ * the other processes sent.
+ *
+ * The change of weight i is weights[i] - shared[i], where shared holds the
+ * weights all the processes agreed on after the previous exchange. What the
+ * compression loses is kept in residual, and added to the next change (error
+ * feedback), so that no update is lost, only delayed.
+ *
+ * The quantized formats work on blocks of COMPRESSION_BLOCK weights, with
+ * one scale per block. Their kernels are run with one work-item per block.
+ */
+
+#define COMPRESSION_BLOCK 256
+
+/**
+ * @brief Top-k sparsification: selects the changes larger than threshold (in
+ * absolute value), up to capacity of them.
+ * The selected changes are appended to (indices, values), in any order, and
+ * count is incremented for each change above the threshold, even those that
+ * did not fit: it is used to adapt the threshold.
+ * Should be run with a NDRange of the number of weights.
+ */
+void kernel perceptron_compress_topk(
+        const float threshold,
+        const int capacity,
+        global const float* weights,
+        global const float* shared,
+        global float* residual,
+        // output
+        global uint* indices,
+        global float* values,
+        volatile global int* count)
+{
+    private const size_t i = get_global_id(0);
+    private const float change = residual[i] + weights[i] - shared[i];
+    if(fabs(change) >= threshold) {
+        private const int slot = atomic_inc(count);
+        if(slot < capacity) {
+            indices[slot] = i;
+            values[slot] = change;
+            residual[i] = 0.f;
+            return;
+        }
+    }
+    residual[i] = change;
+}
+
+/**
+ * @brief Adds scale times the changes (indices, values)[first + j] to the
+ * shared weights. The indices must be distinct: the changes of each process
+ * are applied by a separate launch.
+ * Should be run with a NDRange of the number of changes of the process.
+ */
+void kernel perceptron_decompress_topk(
+        const int first,
+        const float scale,
+        global const uint* indices,
+        global const float* values,
+        global float* shared)
+{
+    private const size_t j = first + get_global_id(0);
+    shared[indices[j]] += scale * values[j];
+}
+
+/**
+ * @brief Replaces the weights by the shared weights.
+ * Should be run with a NDRange of the number of weights.
+ */
+void kernel perceptron_compress_apply(
+        global const float* shared,
+        global float* weights)
+{
+    private const size_t i = get_global_id(0);
+    weights[i] = shared[i];
+}
+
+/**
+ * @brief 8-bit quantization: change = scale * q, with scale the largest
+ * change of the block divided by 127.
+ */
+void kernel perceptron_compress_int8(
+        const ulong nb_weights,
+        global const float* weights,
+        global const float* shared,
+        global float* residual,
+        // output
+        global float* scales,
+        global char* q)
+{
+    private const size_t block = get_global_id(0);
+    private const size_t begin = block * COMPRESSION_BLOCK;
+    private const size_t end = min(begin + COMPRESSION_BLOCK, (size_t)nb_weights);
+
+    private float max_change = 0.f;
+    for(size_t i = begin; i < end; i++) {
+        residual[i] += weights[i] - shared[i];
+        max_change = fmax(max_change, fabs(residual[i]));
+    }
+    private const float scale = max_change / 127.f;
+    scales[block] = scale;
+    for(size_t i = begin; i < end; i++) {
+        private const char qi = (scale > 0.f) ? convert_char_sat_rte(residual[i] / scale) : 0;
+        q[i] = qi;
+        residual[i] -= scale * qi;
+    }
+}
+
+/**
+ * @brief Adds scale times the dequantized changes of the nb_payloads
+ * processes to the shared weights (in the order of the processes, so that
+ * all of them compute the same sums), and copies the result to the weights.
+ * Should be run with a NDRange of the number of weights.
+ */
+void kernel perceptron_decompress_int8(
+        const ulong nb_weights,
+        const int nb_payloads,
+        const float scale,
+        global const float* scales,
+        global const char* q,
+        global float* shared,
+        global float* weights)
+{
+    private const size_t i = get_global_id(0);
+    private const size_t nb_blocks = (nb_weights + COMPRESSION_BLOCK - 1) / COMPRESSION_BLOCK;
+    private float w = shared[i];
+    for(int p = 0; p < nb_payloads; p++) {
+        w += scale * scales[p * nb_blocks + i / COMPRESSION_BLOCK] * q[p * nb_weights + i];
+    }
+    shared[i] = w;
+    weights[i] = w;
+}
+
+/**
+ * @brief 1-bit quantization: change = +/- scale, with scale the mean absolute
+ * change of the block. The signs are packed in 32-bit words, COMPRESSION_BLOCK
+ * / 32 per block (bit set for a positive change).
+ */
+void kernel perceptron_compress_sign(
+        const ulong nb_weights,
+        global const float* weights,
+        global const float* shared,
+        global float* residual,
+        // output
+        global float* scales,
+        global uint* signs)
+{
+    private const size_t block = get_global_id(0);
+    private const size_t begin = block * COMPRESSION_BLOCK;
+    private const size_t end = min(begin + COMPRESSION_BLOCK, (size_t)nb_weights);
+
+    private float sum = 0.f;
+    for(size_t i = begin; i < end; i++) {
+        residual[i] += weights[i] - shared[i];
+        sum += fabs(residual[i]);
+    }
+    private const float scale = sum / (end - begin);
+    scales[block] = scale;
+    for(size_t word = 0; word < COMPRESSION_BLOCK / 32; word++) {
+        private uint bits = 0;
+        for(size_t b = 0; b < 32; b++) {
+            private const size_t i = begin + 32 * word + b;
+            if(i >= end) break;
+            private const bool positive = residual[i] >= 0.f;
+            bits |= (uint)positive << b;
+            residual[i] -= positive ? scale : -scale;
+        }
+        signs[block * (COMPRESSION_BLOCK / 32) + word] = bits;
+    }
+}
+
+/**
+ * @brief Same as perceptron_decompress_int8, for perceptron_compress_sign
+ */
+void kernel perceptron_decompress_sign(
+        const ulong nb_weights,
+        const int nb_payloads,
+        const float scale,
+        global const float* scales,
+        global const uint* signs,
+        global float* shared,
+        global float* weights)
+{
+    private const size_t i = get_global_id(0);
+    private const size_t nb_blocks = (nb_weights + COMPRESSION_BLOCK - 1) / COMPRESSION_BLOCK;
+    private const size_t nb_words = nb_blocks * (COMPRESSION_BLOCK / 32);
+    private float w = shared[i];
+    for(int p = 0; p < nb_payloads; p++) {
+        private const float block_scale = scales[p * nb_blocks + i / COMPRESSION_BLOCK];
+        private const bool positive = (signs[p * nb_words + i / 32] >> (i % 32)) & 1;
+        w += scale * (positive ? block_scale : -block_scale);
+    }
+    shared[i] = w;
+    weights[i] = w;
+}
+
+
+/**
+ * Kernels of the sparse perceptron
+ * ================================
+ *
+ * The weights between two layers are stored in CSR form: the non-zero
+ * weights of the output neuron k are weights[row_ptr[k] .. row_ptr[k+1]-1],
+ * and col_idx gives the input neuron of each of them.
+ * For the backpropagation, a CSC view of the same matrix gives, for each
+ * input neuron i, the output neurons csc_row[j] and the position csc_pos[j]
+ * of the weight in the CSR array, for j in col_ptr[i] .. col_ptr[i+1]-1.
+ * Pruned weights are neither stored nor computed.
+ */
+
+/**
+ * @brief Same as perceptron, for a sparse weight matrix.
+ * Should be run with a NDRange of the number of output neurons (bias excluded)
+ */
+void kernel perceptron_sparse(
+        global const int* row_ptr,
+        global const int* col_idx,
+        global const float* weights,
+        global const float* in_value,
+        global float* out_values)
+{
+    private const int global_id = get_global_id(0);
+    private const int end = row_ptr[global_id+1];
+
+    private float sum = 0.f;
+    for(int j=row_ptr[global_id]; j < end; j++) {
+        sum += weights[j] * in_value[col_idx[j]];
     }
     out_values[global_id] = sigmoid(sum);
 }
+
+/**
+ * @brief Same as perceptron_train_backpropagate, for a sparse weight matrix
+ * (read through its CSC view).
+ * Should be run with a NDRange of the size of the current layer (bias excluded)
+ */
+void kernel perceptron_sparse_train_backpropagate(
+        global const int* col_ptr,
+        global const int* csc_row,
+        global const int* csc_pos,
+        global const float* weights,
+        global const float* current_layer_values,
+        global const float* succ_layer_delta_i,
+        // output
+        global float* current_delta_out)
+{
+    private const int i = get_global_id(0);
+    private const float oi = current_layer_values[i];
+    private const int end = col_ptr[i+1];
+
+    private float sum = 0.f;
+    for(int j=col_ptr[i]; j < end; j++) {
+        sum += succ_layer_delta_i[csc_row[j]] * weights[csc_pos[j]];
+    }
+    current_delta_out[i] = oi*(1-oi) * sum;
+}
+
+/**
+ * @brief Same as perceptron_train_update_weights, for a sparse weight matrix.
+ * Pruned weights stay pruned.
+ * Should be run with a NDRange of the number of output neurons (bias excluded)
+ */
+void kernel perceptron_sparse_train_update_weights(
+        const float epsilon_value,
+        global const int* row_ptr,
+        global const int* col_idx,
+        global const float* pred_values,
+        global const float* delta,
+        global float* weights)
+{
+    private const int k = get_global_id(0);
+    private const float step = epsilon_value * delta[k];
+    private const int end = row_ptr[k+1];
+
+    for(int j=row_ptr[k]; j < end; j++) {
+        weights[j] += step * pred_values[col_idx[j]];
+    }
+}
+
+/**
+ * Weight initialization
+ * =====================
+ *
+ * Counter-based random numbers: Philox4x32-10 (Salmon et al., "Parallel
+ * random numbers: as easy as 1, 2, 3", SC11). The 4 words of block b only
+ * depend on the seed (key) and on (b, stream) (counter), so every work-item
+ * generates its own block, and the result is reproducible from the seed.
+ * philox.hpp implements the same generator on the host, with identical
+ * results.
+ */
+#define PHILOX_M0 0xD2511F53u
+#define PHILOX_M1 0xCD9E8D57u
+#define PHILOX_W0 0x9E3779B9u
+#define PHILOX_W1 0xBB67AE85u
+
+void philox4x32_10(uint* ctr, uint key0, uint key1)
+{
+    for(int round = 0; round < 10; round++) {
+        if(round > 0) {
+            key0 += PHILOX_W0;
+            key1 += PHILOX_W1;
+        }
+        private const uint hi0 = mul_hi(PHILOX_M0, ctr[0]);
+        private const uint lo0 = PHILOX_M0 * ctr[0];
+        private const uint hi1 = mul_hi(PHILOX_M1, ctr[2]);
+        private const uint lo1 = PHILOX_M1 * ctr[2];
+        ctr[0] = hi1 ^ ctr[1] ^ key0;
+        ctr[1] = lo1;
+        ctr[2] = hi0 ^ ctr[3] ^ key1;
+        ctr[3] = lo0;
+    }
+}
+
+/**
+ * @brief Fills the weights of a layer with uniform numbers in [min, max).
+ * Work-item b writes the weights 4*b to 4*b+3 (row-major index), and their
+ * transposed copy when weights_t is not null (Mirrored layout).
+ * Should be run with a NDRange of (nb_weights+3)/4.
+ *
+ * @param layer_size
+ *      Size of the layer (bias included), length of a row of weights
+ * @param out_layer_size
+ *      Size of the next layer (bias included), number of rows
+ * @param stream
+ *      Distinguishes the layers initialized with the same seed
+ **/
+void kernel perceptron_init_weights(
+        const ulong nb_weights,
+        const uint layer_size,
+        const uint out_layer_size,
+        const uint seed_lo,
+        const uint seed_hi,
+        const uint stream,
+        const float min_value,
+        const float max_value,
+        global float* weights,
+        global float* weights_t)
+{
+    private const ulong block = get_global_id(0);
+    private uint ctr[4] = {(uint)block, (uint)(block >> 32), stream, 0};
+    philox4x32_10(ctr, seed_lo, seed_hi);
+
+    for(int j=0; j < 4; j++) {
+        private const ulong i = 4*block + j;
+        if(i >= nb_weights) return;
+        private const float u = (float)(ctr[j] >> 8) * (1.0f / 16777216.0f);
+        private const float w = fma(max_value - min_value, u, min_value);
+        weights[i] = w;
+        if(weights_t != 0) {
+            // Row k, column c in the row-major weights
+            weights_t[(i / layer_size) + out_layer_size * (i % layer_size)] = w;
+        }
+    }
+}
+
+
+/**
+ * Kernels of the streamed perceptron
+ * ==================================
+ *
+ * Weight matrices larger than the device memory stay on the host, and are
+ * uploaded by tiles of consecutive rows (see StreamedPerceptron). Each kernel
+ * works on the tile of rows first_row .. first_row+tile_rows-1 of the weights
+ * between the current layer and the next one; weights_tile holds these rows
+ * only (row-major, curr_size weights per row).
+ * The TensorParallelPerceptron uses the same kernels on the block of rows
+ * stored by each device.
+ */
+
+/**
+ * @brief Same as perceptron, for the output neurons of one tile.
+ * Should be run with a NDRange of tile_rows
+ */
+void kernel perceptron_streamed(
+        const int in_layer_size,
+        const int first_row,
+        global const float *in_value,
+        global const float* weights_tile,
+        global float* out_values)
+{
+    private const int k = get_global_id(0);
+    private const int in_layer_s = in_layer_size;
+    global const float* row = weights_tile + (size_t)in_layer_s*k;
+
+    private float sum = 0.f;
+    for(int i=0; i < in_layer_s; i++) {
+        sum += row[i] * in_value[i];
+    }
+    out_values[first_row + k] = sigmoid(sum);
+}
+
+/**
+ * @brief Same as perceptron_train_backpropagate_update_weights, for the rows
+ * of one tile: updates the weights of the tile in place, and adds their
+ * contribution to the backpropagated sum of each neuron of the current layer.
+ * The sums are reset by the first tile (first_row == 0), and turned into
+ * delta by perceptron_streamed_train_delta once all tiles are done.
+ * Should be run with a NDRange of curr_size (bias included)
+ *
+ * @param sum
+ *      Sum over the rows k of the tiles already processed of
+ *      delta_k * weight(k, i), before update
+ **/
+void kernel perceptron_streamed_train_backpropagate_update_weights(
+        const int curr_size,
+        const int first_row,
+        const int tile_rows,
+        const float epsilon_value,
+        global const float* current_layer_values,
+        global float* weights_tile,
+        global const float* succ_layer_delta_i,
+        global float* sum)
+{
+    private const int i = get_global_id(0);
+    private const float step = epsilon_value * current_layer_values[i];
+
+    private float partial = (first_row == 0) ? 0.f : sum[i];
+    for(int k=0; k < tile_rows; k++) {
+        private const float delta_k = succ_layer_delta_i[first_row + k];
+        private const size_t index = i + (size_t)curr_size * k;
+        private const float w = weights_tile[index];
+        partial += delta_k * w;
+        weights_tile[index] = w + step * delta_k;
+    }
+    sum[i] = partial;
+}
+
+/**
+ * @brief Delta of the current layer from the sums of
+ * perceptron_streamed_train_backpropagate_update_weights.
+ * Should be run with a NDRange of curr_size-1
+ */
+void kernel perceptron_streamed_train_delta(
+        global const float* current_layer_values,
+        global const float* sum,
+        // output
+        global float* current_delta_out)
+{
+    private const int i = get_global_id(0);
+    private const float oi = current_layer_values[i];
+    current_delta_out[i] = oi*(1-oi) * sum[i];
+}
+
+
+/**
+ * Kernels of the model batch
+ * ==========================
+ *
+ * K networks of the same topology, trained side by side (see ModelBatch).
+ * The arrays of a layer are stacked: the values (resp. deltas, weights) of
+ * model k start at k times the size of the array of one model, and each of
+ * them has the layout of the single-network kernels.
+ * The kernels are run with a 2D NDRange: the first dimension indexes the
+ * neurons, as in the single-network kernels, and the second one the models,
+ * so that one launch computes a stage for all of them.
+ */
+
+/**
+ * @brief Same as perceptron, for each model.
+ * Should be run with a NDRange of (out_layer_size-1, K)
+ */
+void kernel perceptron_batch(
+        const int in_layer_size,
+        const int out_layer_size,
+        global const float* in_values,
+        global const float* weights,
+        global float* out_values)
+{
+    private const int j = get_global_id(0);
+    private const size_t k = get_global_id(1);
+
+    global const float* in_value = in_values + k * in_layer_size;
+    global const float* row = weights + k * in_layer_size * out_layer_size + (size_t)in_layer_size * j;
+    private float sum = 0.f;
+    for(int i=0; i < in_layer_size; i++) {
+        sum += row[i] * in_value[i];
+    }
+    out_values[k * out_layer_size + j] = sigmoid(sum);
+}
+
+/**
+ * @brief Same as perceptron_train_output_layer, for each model.
+ * Should be run with a NDRange of (out_layer_size-1, K)
+ */
+void kernel perceptron_batch_train_output_layer(
+        const int out_layer_size,
+        global const float* values,
+        global const float* expected_values,
+        global float* delta)
+{
+    private const int j = get_global_id(0);
+    private const size_t k = get_global_id(1);
+    private const float ci = expected_values[k * (out_layer_size-1) + j];
+    private const float oi = values[k * out_layer_size + j];
+    delta[k * out_layer_size + j] = oi * (1-oi) * (ci-oi);
+}
+
+/**
+ * @brief Same as perceptron_train_backpropagate_update_weights, for each
+ * model, with the learning rate of each model in epsilons.
+ * Should be run with a NDRange of (curr_size, K)
+ */
+void kernel perceptron_batch_train_backpropagate_update_weights(
+        const int curr_size,
+        const int succ_layer_size,
+        global const float* epsilons,
+        global const float* values,
+        global float* weights,
+        global const float* succ_delta,
+        // output
+        global float* delta)
+{
+    private const int i = get_global_id(0);
+    private const size_t k = get_global_id(1);
+    private const float oi = values[k * curr_size + i];
+    private const float step = epsilons[k] * oi;
+    global float* model_weights = weights + k * curr_size * succ_layer_size;
+    global const float* model_succ_delta = succ_delta + k * succ_layer_size;
+
+    private float sum = 0.f;
+    for(int j=0; j < succ_layer_size-1; j++) {
+        private const float delta_j = model_succ_delta[j];
+        private const size_t index = i + (size_t)curr_size * j;
+        private const float w = model_weights[index];
+        sum += delta_j * w;
+        model_weights[index] = w + step * delta_j;
+    }
+    if(i < curr_size-1) {
+        delta[k * curr_size + i] = oi*(1-oi) * sum;
+    }
+}
+
+
+/**
+ * Kernels of the epoch loop
+ * =========================
+ *
+ * The training set is uploaded once. At each epoch, perceptron_shuffle
+ * computes a new order of the samples in an index buffer, and each step
+ * gathers its sample through it with perceptron_gather_sample: shuffling
+ * needs neither a pass over the samples on the host nor a new upload.
+ *
+ * The order is a pseudo-random permutation of [0, n): a 4-round Feistel
+ * network on the smallest domain of 2^(2 half_bits) indices that contains n,
+ * keyed by the seed and the epoch, restricted to [0, n) by cycle walking
+ * (indices out of range are permuted again, which keeps a bijection).
+ * permutation.hpp computes the same permutation on the host.
+ */
+
+uint permutation_hash(uint x, uint key)
+{
+    x ^= key;
+    x *= 0x9E3779B1u;
+    x ^= x >> 15;
+    x *= 0x85EBCA77u;
+    x ^= x >> 13;
+    return x;
+}
+
+uint permutation_index(uint i, const uint half_bits, const uint seed_lo, const uint seed_hi, const uint epoch)
+{
+    private const uint mask = (1u << half_bits) - 1;
+    private uint left = i >> half_bits;
+    private uint right = i & mask;
+    for(uint round = 0; round < 4; round++) {
+        private const uint key = permutation_hash(seed_lo + round * 0x632BE59Bu, seed_hi ^ epoch);
+        private const uint next = left ^ ((permutation_hash(right, key) >> 16) & mask);
+        left = right;
+        right = next;
+    }
+    return (left << half_bits) | right;
+}
+
+/**
+ * @brief Order of the samples for epoch: permutation[i] is the index of the
+ * i-th sample of the epoch.
+ * Should be run with a NDRange of n
+ */
+void kernel perceptron_shuffle(
+        const uint n,
+        const uint half_bits,
+        const uint seed_lo,
+        const uint seed_hi,
+        const uint epoch,
+        // output
+        global uint* permutation)
+{
+    private const uint i = get_global_id(0);
+    private uint j = i;
+    do {
+        j = permutation_index(j, half_bits, seed_lo, seed_hi, epoch);
+    } while(j >= n);
+    permutation[i] = j;
+}
+
+/**
+ * @brief Copies the sample permutation[step] of the training set into the
+ * values of the input layer (bias excluded) and the expected output.
+ * Should be run with a NDRange of max(in_size, out_size)
+ */
+void kernel perceptron_gather_sample(
+        const uint step,
+        const int in_size,
+        const int out_size,
+        global const uint* permutation,
+        global const float* inputs,
+        global const float* outputs,
+        // output
+        global float* in_values,
+        global float* expected_values)
+{
+    private const int j = get_global_id(0);
+    private const size_t sample = permutation[step];
+    if(j < in_size) in_values[j] = inputs[sample * in_size + j];
+    if(j < out_size) expected_values[j] = outputs[sample * out_size + j];
+}
+
+
+/**
+ * Kernels of the loss tracker
+ * ===========================
+ *
+ * perceptron_train_output_layer_tracked computes the delta of the output
+ * layer, as perceptron_train_output_layer, and accumulates the loss of the
+ * sample in a small tracker buffer on the device: an exponential moving
+ * average of the loss and of the max error, and the sums of the current
+ * epoch. perceptron_loss_end_epoch closes an epoch.
+ * The host only reads a scalar of the tracker from time to time, instead of
+ * running the training set through the network to check convergence.
+ *
+ * The loss of a sample is 0.5 * sum((ci-oi)^2), its max error max(|ci-oi|).
+ * The whole output layer is handled by a single work-group of
+ * LOSS_TRACKER_BLOCK work-items, which sums the loss without atomics.
+ */
+
+#define LOSS_TRACKER_BLOCK 64
+
+// Layout of the tracker buffer (see loss_tracker.hpp)
+#define LOSS_EMA 0
+#define LOSS_EMA_MAX_ERROR 1
+#define LOSS_EPOCH_SUM 2
+#define LOSS_EPOCH_MAX_ERROR 3
+#define LOSS_LAST_EPOCH 4
+#define LOSS_LAST_EPOCH_MAX_ERROR 5
+#define LOSS_STARTED 6
+
+/**
+ * @brief Same as perceptron_train_output_layer, and accumulates the loss of
+ * the sample in tracker. decay is the weight of the past in the moving
+ * averages.
+ * Should be run with a NDRange of LOSS_TRACKER_BLOCK, in a single work-group
+ */
+void kernel perceptron_train_output_layer_tracked(
+        global const float* values,
+        global const float* expected_values,
+        global float* delta,
+        const int out_size,
+        const float decay,
+        global float* tracker)
+{
+    local float loss[LOSS_TRACKER_BLOCK];
+    local float max_error[LOSS_TRACKER_BLOCK];
+    private const int local_id = get_local_id(0);
+
+    private float sum = 0.f;
+    private float error_max = 0.f;
+    for(int i = local_id; i < out_size; i += LOSS_TRACKER_BLOCK) {
+        private const float ci = expected_values[i];
+        private const float oi = values[i];
+        delta[i] = oi * (1-oi) * (ci-oi);
+        sum += 0.5f * (ci-oi) * (ci-oi);
+        error_max = fmax(error_max, fabs(ci-oi));
+    }
+    loss[local_id] = sum;
+    max_error[local_id] = error_max;
+    barrier(CLK_LOCAL_MEM_FENCE);
+    for(int offset = LOSS_TRACKER_BLOCK/2; offset > 0; offset /= 2) {
+        if(local_id < offset) {
+            loss[local_id] += loss[local_id + offset];
+            max_error[local_id] = fmax(max_error[local_id], max_error[local_id + offset]);
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    if(local_id == 0) {
+        if(tracker[LOSS_STARTED] == 0.f) {
+            tracker[LOSS_EMA] = loss[0];
+            tracker[LOSS_EMA_MAX_ERROR] = max_error[0];
+            tracker[LOSS_STARTED] = 1.f;
+        } else {
+            tracker[LOSS_EMA] = decay * tracker[LOSS_EMA] + (1.f - decay) * loss[0];
+            tracker[LOSS_EMA_MAX_ERROR] = decay * tracker[LOSS_EMA_MAX_ERROR] + (1.f - decay) * max_error[0];
+        }
+        tracker[LOSS_EPOCH_SUM] += loss[0];
+        tracker[LOSS_EPOCH_MAX_ERROR] = fmax(tracker[LOSS_EPOCH_MAX_ERROR], max_error[0]);
+    }
+}
+
+/**
+ * @brief Keeps the mean loss and the max error of the epoch of nb_samples
+ * samples that ends, and starts a new one.
+ * Should be run with a NDRange of 1
+ */
+void kernel perceptron_loss_end_epoch(
+        const uint nb_samples,
+        global float* tracker)
+{
+    tracker[LOSS_LAST_EPOCH] = tracker[LOSS_EPOCH_SUM] / nb_samples;
+    tracker[LOSS_LAST_EPOCH_MAX_ERROR] = tracker[LOSS_EPOCH_MAX_ERROR];
+    tracker[LOSS_EPOCH_SUM] = 0.f;
+    tracker[LOSS_EPOCH_MAX_ERROR] = 0.f;
+}
+
+
+/**
+ * Kernels of mixed precision training
+ * ===================================
+ *
+ * The values, weights and deltas read by the forward and backward passes are
+ * stored in half precision, which halves their memory traffic. The weights
+ * are updated in a single precision master copy (the weights of the layers),
+ * and written back to the half precision copy.
+ *
+ * Devices with cl_khr_fp16 multiply in half precision; the others only store
+ * half values (vload_half / vstore_half, core OpenCL) and compute in single
+ * precision. Sums are in single precision in both cases.
+ *
+ * Small deltas would vanish in half precision: they are multiplied by a loss
+ * scale, and the update divides it out. A delta that does not fit a half
+ * value sets the overflow flag of the scaler, and the weight updates of the
+ * step are skipped. perceptron_half_update_scale then halves the scale, or
+ * doubles it after growth_interval steps without overflow.
+ */
+
+#define HALF_MAX_VALUE 65504.f
+
+// Layout of the scaler buffer (see mixed_precision_trainer.hpp)
+#define SCALER_SCALE 0
+#define SCALER_OVERFLOW 1
+#define SCALER_GOOD_STEPS 2
+#define SCALER_SKIPPED_STEPS 3
+
+#ifdef cl_khr_fp16
+#pragma OPENCL EXTENSION cl_khr_fp16 : enable
+// Product in half precision of a[i] and b[j]
+#define HALF_PRODUCT(a, i, b, j) ((float)((a)[i] * (b)[j]))
+#else
+#define HALF_PRODUCT(a, i, b, j) (vload_half(i, a) * vload_half(j, b))
+#endif
+
+/**
+ * @brief Stores the delta x, flags it if it does not fit a half value
+ */
+void store_half_delta(float x, size_t i, global half* delta, global float* scaler)
+{
+    if(!(fabs(x) <= HALF_MAX_VALUE)) scaler[SCALER_OVERFLOW] = 1.f;
+    vstore_half(x, i, delta);
+}
+
+/**
+ * @brief Converts count single precision values to half precision
+ * Should be run with a NDRange of count
+ */
+void kernel perceptron_half_convert(
+        const uint count,
+        global const float* in,
+        // output
+        global half* out)
+{
+    private const size_t i = get_global_id(0);
+    if(i < count) vstore_half(in[i], i, out);
+}
+
+/**
+ * @brief Same as perceptron, on half precision values and weights
+ * Should be run with a NDRange of out_layer_size
+ */
+void kernel perceptron_half(
+        const int in_layer_size,
+        const int out_layer_size,
+        global const half* in_value,
+        global const half* in_weights,
+        global half* out_values)
+{
+    private const int global_id = get_global_id(0);
+    global const half* row = in_weights + (size_t)in_layer_size*global_id;
+
+    private float sum = 0.f;
+    for(int i=0; i < in_layer_size; i++) {
+        sum += HALF_PRODUCT(row, i, in_value, i);
+    }
+    vstore_half(sigmoid(sum), global_id, out_values);
+}
+
+/**
+ * @brief Same as perceptron_train_output_layer, scaled by the loss scale
+ * Should be run with a NDRange of the output size (bias excluded)
+ */
+void kernel perceptron_half_train_output_layer(
+        global const half* values,
+        global const float* expected_values,
+        global float* scaler,
+        // output
+        global half* delta)
+{
+    private const size_t i = get_global_id(0);
+    private const float ci = expected_values[i];
+    private const float oi = vload_half(i, values);
+    store_half_delta(scaler[SCALER_SCALE] * oi * (1-oi) * (ci-oi), i, delta, scaler);
+}
+
+/**
+ * @brief Same as perceptron_train_backpropagate, on half precision values,
+ * weights and deltas. succ_layer_size excludes the bias of the next layer.
+ * Should be run with a NDRange of curr_size-1
+ */
+void kernel perceptron_half_train_backpropagate(
+        const int curr_size,
+        const int succ_layer_size,
+        global const half* current_layer_values,
+        global const half* weights,
+        global const half* succ_layer_delta_i,
+        global float* scaler,
+        // output
+        global half* current_delta_out)
+{
+    private const int i = get_global_id(0);
+    private const float oi = vload_half(i, current_layer_values);
+
+    private float sum = 0.f;
+    for(int k=0; k < succ_layer_size; k++) {
+        sum += HALF_PRODUCT(succ_layer_delta_i, k, weights, i + (size_t)curr_size * k);
+    }
+    store_half_delta(oi*(1-oi) * sum, i, current_delta_out, scaler);
+}
+
+/**
+ * @brief Same as perceptron_train_update_weights, on the single precision
+ * master weights, which are then copied to the half precision weights.
+ * Skipped when a delta of the step overflowed.
+ * Should be run with a NDRange of curr_size * (succ_layer_size-1): the
+ * weights to the bias of the next layer are never used
+ */
+void kernel perceptron_half_train_update_weights(
+        const int curr_size,
+        const float epsilon_value,
+        global const half* current_layer_values,
+        global const half* succ_layer_delta_i,
+        global const float* scaler,
+        global float* master_weights,
+        // output
+        global half* weights)
+{
+    if(scaler[SCALER_OVERFLOW] != 0.f) return;
+    private const size_t global_id = get_global_id(0);
+    private const float oi = vload_half(global_id % curr_size, current_layer_values);
+    private const float delta = vload_half(global_id / curr_size, succ_layer_delta_i) / scaler[SCALER_SCALE];
+    private const float w = master_weights[global_id] + epsilon_value * delta * oi;
+    master_weights[global_id] = w;
+    vstore_half(w, global_id, weights);
+}
+
+/**
+ * @brief Adapts the loss scale after a training step, and clears the
+ * overflow flag.
+ * Should be run with a NDRange of 1
+ */
+void kernel perceptron_half_update_scale(
+        const int growth_interval,
+        global float* scaler)
+{
+    if(scaler[SCALER_OVERFLOW] != 0.f) {
+        scaler[SCALER_SCALE] = fmax(scaler[SCALER_SCALE] * 0.5f, 1.f);
+        scaler[SCALER_GOOD_STEPS] = 0.f;
+        scaler[SCALER_SKIPPED_STEPS] += 1.f;
+        scaler[SCALER_OVERFLOW] = 0.f;
+    } else if(++scaler[SCALER_GOOD_STEPS] >= growth_interval) {
+        scaler[SCALER_SCALE] = fmin(scaler[SCALER_SCALE] * 2.f, HALF_MAX_VALUE);
+        scaler[SCALER_GOOD_STEPS] = 0.f;
+    }
+}
@@ -2,18 +2,173 @@
 #define __PERCEPTRON_LAYER_HPP__
 
 
+#include <algorithm>
 #include <initializer_list>
 #include <iostream>
 #include <random>
 #include <sstream>
 #include "openCLUtilities.hpp"
 #include "exception.hpp"
+#include "workgroup_tuner.hpp"
+#include "philox.hpp"
+#include <cmath>
+#include <cstdint>
 #include <list>
+#include <map>
 
 using std::ostream;
 using std::cout;
 using std::endl;
 
+typedef VECTOR_CLASS<cl::Event> EventList;
+
+/**
+ * @brief Scheduling of a command enqueued by a NeuronLayer.
+ *
+ * By default, the command goes to the layer's queue, and the call blocks
+ * until the queue is finished.
+ * When event is set, the call returns as soon as the command is enqueued and
+ * event signals its completion. The command then only waits for wait_list
+ * (and, on an in-order queue, for the commands enqueued before it), which lets
+ * independent commands overlap on out-of-order or multiple queues.
+ */
+struct LaunchOrder
+{
+    cl::CommandQueue* queue;
+    const EventList* wait_list;
+    cl::Event* event;
+    bool blocking;
+
+    LaunchOrder(cl::Event* event = nullptr, const EventList* wait_list = nullptr, cl::CommandQueue* queue = nullptr) : queue(queue), wait_list(wait_list), event(event), blocking(event == nullptr) {}
+
+    /**
+     * @brief Neither blocks nor signals an event: the command is only ordered
+     * by the (in-order) queue. The caller is responsible for finishing it.
+     */
+    static LaunchOrder inOrder(cl::CommandQueue* queue = nullptr) {
+        LaunchOrder order(nullptr, nullptr, queue);
+        order.blocking = false;
+        return order;
+    }
+};
+
+/**
+ * @brief A kernel launch with all of its arguments already bound (see
+ * NeuronLayer::prepareRun and the other prepare functions).
+ * The kernel instance is dedicated to this launch, so its arguments never
+ * have to be set again.
+ */
+struct BoundKernel
+{
+    cl::Kernel kernel;
+    cl::NDRange global;
+    cl::NDRange local;
+    // Arrays overwritten by the launch (KernelWrites flags)
+    unsigned writes = 0;
+};
+
+/**
+ * @brief Arrays of the layers that a kernel launch overwrites on the device,
+ * relative to the layer it is enqueued on
+ */
+enum KernelWrites : unsigned {
+    WritesNothing = 0,
+    // Values of the next layer (forward pass)
+    WritesNextValues = 1,
+    // Weights of the layer (fused backpropagation and update)
+    WritesWeights = 2,
+    // Weights of the previous layer (weight update)
+    WritesPreviousWeights = 4,
+    // Values of the layer itself (sample gathered on the device)
+    WritesValues = 8
+};
+
+/**
+ * @brief Which copy of an array of a layer (values or weights) is the latest:
+ * - Synced: the host array and the device buffer hold the same data
+ * - HostNewer: the host array was modified (setValues, setWeights,
+ *   initRandomWeights...) and is uploaded before the next kernel launch
+ * - DeviceNewer: a kernel wrote the buffer, which is read back on the next
+ *   access from the host
+ */
+enum class Mirror {
+    Synced,
+    HostNewer,
+    DeviceNewer
+};
+
+/**
+ * @brief Storage of the weights of a layer on the device
+ * - RowMajor: the weights of each output neuron are contiguous (see the
+ *   perceptron kernel). The forward pass reads rows, the backpropagation
+ *   reads columns.
+ * - Mirrored: a transposed copy is kept next to the row-major weights, and
+ *   updated along with them. Each pass reads the copy with the best access
+ *   pattern for the device: contiguous within a work-item on CPUs,
+ *   contiguous across neighbouring work-items (coalesced) on GPUs.
+ *   Costs twice the memory and writes of the weights.
+ */
+enum class WeightLayout {
+    RowMajor,
+    Mirrored
+};
+
+/**
+ * @brief Distribution of the initial weights (see NeuronLayer::initWeights)
+ * - Uniform: in [min, max)
+ * - Xavier (Glorot): uniform in [-l, l), with l = sqrt(6 / (fan_in + fan_out))
+ * - He: uniform in [-l, l), with l = sqrt(6 / fan_in)
+ * The uniform forms of Xavier and He are used: they only need exact
+ * operations, so host and device produce the same weights.
+ */
+enum class WeightInit {
+    Uniform,
+    Xavier,
+    He
+};
+
+/**
+ * @brief Bounds [min, max) of the uniform distribution of init, for a weight
+ * matrix with fan_in inputs (bias included) and fan_out outputs. min and max
+ * are left untouched for WeightInit::Uniform.
+ */
+inline void weightInitRange(WeightInit init, float fan_in, float fan_out, float& min, float& max)
+{
+    float limit;
+    switch(init) {
+        case WeightInit::Uniform:
+            return;
+        case WeightInit::Xavier:
+            limit = std::sqrt(6.f / (fan_in + fan_out));
+            break;
+        case WeightInit::He:
+        default:
+            limit = std::sqrt(6.f / fan_in);
+            break;
+    }
+    min = -limit;
+    max = limit;
+}
+
+/**
+ * @brief Relation between the host arrays of a layer and its buffers
+ * - Copy: the buffers are allocated by the device, and the host arrays are
+ *   copied to and from them.
+ * - ZeroCopy: the buffers use the host arrays as storage
+ *   (CL_MEM_USE_HOST_PTR). Transfers become map/unmap synchronizations, which
+ *   do not copy on devices sharing the host memory (CPUs, integrated GPUs).
+ *   Devices with their own memory fall back to Copy.
+ * - SharedVirtualMemory: the host arrays are OpenCL 2.0 SVM allocations
+ *   (clSVMAlloc), passed to the kernels as pointers. With fine-grain SVM,
+ *   transfers only order the commands; with coarse-grain SVM, they are
+ *   map/unmap synchronizations. Devices without SVM fall back to ZeroCopy.
+ */
+enum class HostMemory {
+    Copy,
+    ZeroCopy,
+    SharedVirtualMemory
+};
+
 /**
  * @brief NeuronLayer represents one of the perceptron neuron layers.
  * Due to GPU limitation regarding dynamic pointers within structures, it is
@@ -39,8 +194,40 @@ class NeuronLayer
         cl::CommandQueue command_queue;
         cl::Buffer buf_values;
         cl::Buffer buf_weights;
+        // Transposed weights, only in the Mirrored layout
+        cl::Buffer buf_weights_t;
 
+        // Number of the layer in the process, for display
         int mLayerNumber = 0;
+        // Position of the layer in its network: stream of the generator of
+        // its weights (see initWeights)
+        int mIndex = 0;
+
+        WeightLayout mLayout = WeightLayout::RowMajor;
+        HostMemory mHostMemory = HostMemory::Copy;
+        // The current buffers use the host arrays (see createBuffers)
+        bool mZeroCopy = false;
+        bool mBuffersCreated = false;
+        // The host arrays are SVM allocations of mSvmContext, and there are
+        // no value and weight buffers
+        bool mSvm = false;
+        bool mSvmFineGrain = false;
+        cl::Context mSvmContext;
+
+        // Latest copy of the values and of the weights, see Mirror
+        Mirror mValuesMirror = Mirror::HostNewer;
+        Mirror mWeightsMirror = Mirror::HostNewer;
+        // Whether work-items run on a CPU (contiguous accesses per work-item
+        // are faster) or a GPU (coalesced accesses are faster)
+        bool mCpuDevice = false;
+        // Kernels of the mirrored layout, by kernel of the row-major one
+        std::map<cl_kernel, cl::Kernel> mLayoutKernels;
+
+        // Optional, chooses the local size of the kernel launches
+        WorkGroupTuner* mTuner = nullptr;
+
+        // Larger launches are split (see setMaxLaunchSize)
+        size_t mMaxLaunchSize = size_t(1) << 30;
 
         const cl_int m_size;
         cl_int m_out_size = 0;
@@ -57,7 +244,8 @@ class NeuronLayer
             m_in_layer = in_layer;
             m_out_layer = out_layer;
             // Init values to 0
-            values = new T[m_size]();
+            values = allocateHostArray(m_size);
+            std::fill(values, values + m_size, T(0));
             // Bias
             values[m_size-1] = 1;
             setOutputLayer(out_layer);
@@ -78,14 +266,115 @@ class NeuronLayer
         }
 
         ~NeuronLayer() {
-            delete values;
-            delete weights;
+            // Zero-copy buffers must not outlive their host arrays
+            buf_values = cl::Buffer();
+            buf_weights = cl::Buffer();
+            // Nor may SVM allocations be freed while in use
+            if(mSvm) command_queue.finish();
+            freeHostArray(values);
+            freeHostArray(weights);
             delete m_out_layer;
         }
 
         void setNumber(int id) {
             mLayerNumber = id;
         }
+
+        void setIndex(int index) {
+            mIndex = index;
+        }
+
+        int getIndex() const {
+            return mIndex;
+        }
+
+        void setTuner(WorkGroupTuner* tuner) {
+            mTuner = tuner;
+        }
+
+        /**
+         * @brief Kernel launches with more work-items are split in several
+         * launches (eg. the weight update of layers with billions of weights),
+         * to stay within the limits of the devices.
+         * With a tuner, the local size is chosen for a launch of
+         * max_launch_size work-items: max_launch_size should be a multiple
+         * of the work-group sizes (a power of two). The work-items of the
+         * last launch that do not fill a work-group are launched apart (see
+         * enqueueSplit).
+         */
+        void setMaxLaunchSize(size_t max_launch_size) {
+            mMaxLaunchSize = max_launch_size;
+        }
+
+        /**
+         * @brief Changes the layout of the weights on the device.
+         * Should be set before upload(). Otherwise, the weights are read back
+         * from the device to build the transposed copy.
+         */
+        void setWeightLayout(WeightLayout layout) {
+            mLayout = layout;
+            mLayoutKernels.clear();
+            const cl::Device device = command_queue.getInfo<CL_QUEUE_DEVICE>();
+            mCpuDevice = (device.getInfo<CL_DEVICE_TYPE>() & CL_DEVICE_TYPE_CPU) != 0;
+
+            if(mLayout == WeightLayout::RowMajor) {
+                buf_weights_t = cl::Buffer();
+            } else if(mBuffersCreated && m_out_size > 0) {
+                cl::Context context = command_queue.getInfo<CL_QUEUE_CONTEXT>();
+                buf_weights_t = cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(T) * m_size * m_out_size);
+                enqueueReadWeights();
+                enqueueWriteTransposedWeights();
+            }
+        }
+
+        WeightLayout getWeightLayout() const {
+            return mLayout;
+        }
+
+        /**
+         * @brief Chooses whether the buffers use the host arrays as storage
+         * (see HostMemory). Should be set before the buffers are created:
+         * existing buffers are read back, created again, and uploaded again
+         * on their next use.
+         * Switching to or from SharedVirtualMemory moves the host arrays
+         * (see getValues and getWeights).
+         */
+        void setHostMemory(HostMemory host_memory) {
+            if(mBuffersCreated) enqueueReadBuffers();
+            mHostMemory = host_memory;
+            const bool svm = host_memory == HostMemory::SharedVirtualMemory && svmCapabilities() != 0;
+            if(svm != mSvm) {
+                reallocateHostArrays(svm);
+            }
+            if(mBuffersCreated) {
+                cl::Context context = command_queue.getInfo<CL_QUEUE_CONTEXT>();
+                createBuffers(context);
+            }
+        }
+
+        HostMemory getHostMemory() const {
+            return mHostMemory;
+        }
+
+        /**
+         * @brief Whether the host arrays really are SVM allocations:
+         * SharedVirtualMemory was asked, and the device supports SVM.
+         */
+        bool isSharedVirtualMemory() const {
+            return mSvm;
+        }
+
+        /**
+         * @brief Whether the buffers really share the host arrays: ZeroCopy
+         * (or SharedVirtualMemory without SVM device) was asked, and the
+         * device uses the host memory.
+         */
+        bool isZeroCopy() const {
+            if(mHostMemory == HostMemory::Copy || mSvm) return false;
+            const cl::Device device = command_queue.getInfo<CL_QUEUE_DEVICE>();
+            return device.getInfo<CL_DEVICE_HOST_UNIFIED_MEMORY>() == CL_TRUE;
+        }
+
         void setInputLayer(NeuronLayer *in_layer) {
             m_in_layer = in_layer;
         }
@@ -95,7 +384,7 @@ class NeuronLayer
             if(out_layer != nullptr) {
                 const cl_int& out_size = out_layer->getSize();
                 if(weights == nullptr)
-                    weights = new T[m_size*out_size];
+                    weights = allocateHostArray(static_cast<size_t>(m_size)*out_size);
                 m_out_size = out_size;
             } else {
                 m_out_size = 0;
@@ -104,15 +393,55 @@ class NeuronLayer
 
 
         void initRandomWeights(const float& min = -0.5, const float& max = 0.5) {
-            if(m_out_size == 0) throw LayerNotLinkedException();
-
             std::random_device rd; // obtain a random number from hardware
-            std::mt19937 eng(rd()); // seed the generator
-            std::uniform_real_distribution<float> distr(min, max);
+            const uint64_t seed = (static_cast<uint64_t>(rd()) << 32) | rd();
+            initWeights(WeightInit::Uniform, seed, min, max);
+        }
 
-            for(int i=0; i< m_size * m_out_size; i++) {
-                weights[i] = distr(eng);
-            }
+        /**
+         * @brief Initializes the weights on the host, reproducibly from seed
+         * (see philox.hpp), in parallel for large layers. The layer draws from
+         * the stream getIndex() of the generator: networks of the same
+         * topology get the same weights from the same seed.
+         * min and max are only used by WeightInit::Uniform.
+         * Gives the same weights as enqueueInitWeights.
+         */
+        void initWeights(WeightInit init, uint64_t seed, float min = -0.5f, float max = 0.5f) {
+            if(m_out_size == 0) throw LayerNotLinkedException();
+            initRange(init, min, max);
+            philox::fillUniform(weights, getNbWeights(), seed, mIndex, min, max);
+            mWeightsMirror = Mirror::HostNewer;
+        }
+
+        /**
+         * @brief Initializes the weights directly on the device, with kernel
+         * perceptron_init_weights: nothing is computed nor uploaded on the
+         * host. See initWeights.
+         */
+        void enqueueInitWeights(cl::Kernel& kernel, WeightInit init, uint64_t seed, float min = -0.5f, float max = 0.5f, const LaunchOrder& order = LaunchOrder()) {
+            if(m_out_size == 0) throw LayerNotLinkedException();
+            initRange(init, min, max);
+            const cl_ulong nb_weights = getNbWeights();
+            const cl_uint size = m_size;
+            const cl_uint out_size = m_out_size;
+            const cl_uint stream = mIndex;
+            auto bind = [=](cl::Kernel& k) {
+                k.setArg(0, nb_weights);
+                k.setArg(1, size);
+                k.setArg(2, out_size);
+                k.setArg(3, static_cast<cl_uint>(seed));
+                k.setArg(4, static_cast<cl_uint>(seed >> 32));
+                k.setArg(5, stream);
+                k.setArg(6, min);
+                k.setArg(7, max);
+                setWeightsArg(k, 8);
+                // A null transposed buffer is not written
+                k.setArg(9, (mLayout == WeightLayout::Mirrored) ? buf_weights_t : cl::Buffer());
+            };
+            // The host weights are about to be replaced, they need no upload
+            mWeightsMirror = Mirror::Synced;
+            if(enqueueKernel(kernel, (nb_weights+3)/4, WritesWeights, bind, bind, order) != CL_SUCCESS)
+                throw std::runtime_error("PerceptronLayer::enqueueInitWeights - Error running weight initialization kernel");
         }
 
         NLayer* getNextLayer() {
@@ -127,14 +456,35 @@ class NeuronLayer
             return m_size;
         }
 
-        cl_int getNbWeights() const  {
-            return m_size * m_out_size;
+        // 64 bits: wide layers have more than 2^31 weights
+        size_t getNbWeights() const  {
+            return static_cast<size_t>(m_size) * m_out_size;
         }
 
+        /**
+         * @brief Host copy of the values, read back first if a kernel changed
+         * them. Modifications must go through setValues.
+         */
         T* getValues() {
+            enqueueReadValues();
             return values;
         }
 
+        // Host copy of the weights, read back first if a kernel changed them.
+        // Modifications must go through setWeights.
+        T* getWeights() {
+            enqueueReadWeights();
+            return weights;
+        }
+
+        Mirror getValuesMirror() const {
+            return mValuesMirror;
+        }
+
+        Mirror getWeightsMirror() const {
+            return mWeightsMirror;
+        }
+
         void setValues(const std::vector<T>& init) {
             // Do not replace bias
             if(init.size() != m_size-1) {
@@ -147,6 +497,7 @@ class NeuronLayer
             }
             // bias
             values[m_size-1] = 1;
+            mValuesMirror = Mirror::HostNewer;
         }
 
         void setValues(const std::list<T>& init) {
@@ -161,22 +512,46 @@ class NeuronLayer
             }
             // bias
             values[m_size-1] = 1;
+            mValuesMirror = Mirror::HostNewer;
         }
 
-        void uploadInputValues() {
-            command_queue.enqueueWriteBuffer(buf_values, CL_TRUE, 0, sizeof(T)*m_size, values);
+        /**
+         * @brief Uploads the values (host array) to the device.
+         * When order is asynchronous, the values must not be modified on the
+         * host before order.event completes.
+         */
+        void uploadInputValues(const LaunchOrder& order = LaunchOrder()) {
+            mValuesMirror = Mirror::Synced;
+            if(sharesHostArrays()) {
+                enqueueSyncToDevice(buf_values, values, sizeof(T)*m_size, order);
+                return;
+            }
+            cl::CommandQueue& queue = (order.queue != nullptr) ? *order.queue : command_queue;
+            const cl_bool blocking = order.blocking ? CL_TRUE : CL_FALSE;
+            queue.enqueueWriteBuffer(buf_values, blocking, 0, sizeof(T)*m_size, values, order.wait_list, order.event);
         }
 
         void setWeights(const std::list<T>& weights_list) {
-            if(m_out_layer != nullptr && weights_list.size() != m_size * (m_out_size-1)) {
+            if(m_out_layer != nullptr && weights_list.size() != static_cast<size_t>(m_size) * (m_out_size-1)) {
                 throw std::runtime_error("Your initializer list for weights exceeds the maximum size!");
             }
 
-            int j=0;
+            size_t j=0;
             for(auto it = begin(weights_list); it != end(weights_list); it++)
             {
                 weights[j++] = *it;
             }
+            mWeightsMirror = Mirror::HostNewer;
+        }
+
+        /**
+         * @brief Copies getNbWeights() weights from weights_array, in the
+         * layout of getWeights
+         */
+        void setWeights(const T* weights_array) {
+            if(m_out_layer == nullptr) throw LayerNotLinkedException();
+            std::copy(weights_array, weights_array + getNbWeights(), weights);
+            mWeightsMirror = Mirror::HostNewer;
         }
 
         /**
@@ -185,23 +560,102 @@ class NeuronLayer
          */
         void createBuffers(cl::Context& context)
         {
-            // Creates buffer on the device
-            buf_values = cl::Buffer(context, CL_MEM_READ_ONLY, sizeof(T) * m_size);
-            buf_weights = cl::Buffer(context, CL_MEM_READ_ONLY, sizeof(T) * m_size * m_out_size);
+            mBuffersCreated = true;
+            // The new buffers hold nothing yet
+            mValuesMirror = Mirror::HostNewer;
+            mWeightsMirror = Mirror::HostNewer;
+            mZeroCopy = isZeroCopy();
+            if(mSvm) {
+                // Kernels access the SVM allocations directly
+                buf_values = cl::Buffer();
+                buf_weights = cl::Buffer();
+            } else if(mZeroCopy) {
+                // The host arrays are the storage of the buffers. The last
+                // layer has no weights to share.
+                buf_values = cl::Buffer(context, CL_MEM_READ_WRITE | CL_MEM_USE_HOST_PTR, sizeof(T) * m_size, values);
+                if(m_out_size > 0)
+                    buf_weights = cl::Buffer(context, CL_MEM_READ_WRITE | CL_MEM_USE_HOST_PTR, sizeof(T) * m_size * m_out_size, weights);
+                else
+                    buf_weights = cl::Buffer(context, CL_MEM_READ_ONLY, sizeof(T) * m_size * m_out_size);
+            } else {
+                const cl::Device device = command_queue.getInfo<CL_QUEUE_DEVICE>();
+                if(sizeof(T) * m_size * m_out_size > device.getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>()) {
+                    std::stringstream error;
+                    error << "NeuronLayer::createBuffers - The weights of layer " << mLayerNumber << " exceed CL_DEVICE_MAX_MEM_ALLOC_SIZE, use a StreamedPerceptron";
+                    throw std::runtime_error(error.str());
+                }
+                // Creates buffer on the device
+                buf_values = cl::Buffer(context, CL_MEM_READ_ONLY, sizeof(T) * m_size);
+                buf_weights = cl::Buffer(context, CL_MEM_READ_ONLY, sizeof(T) * m_size * m_out_size);
+            }
+            if(mLayout == WeightLayout::Mirrored && m_out_size > 0) {
+                buf_weights_t = cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(T) * m_size * m_out_size);
+            }
         }
 
+        /**
+         * @brief Uploads the arrays modified on the host since the last
+         * synchronization. Arrays for which the device holds the latest data
+         * are left untouched (see Mirror).
+         * Kernel launches call it on the layers they use, so uploading
+         * explicitly is only needed to control when the transfer happens.
+         */
         void enqueueWriteBuffers()
         {
+            if(!mBuffersCreated) return;
             // Prepare device memory for each layer
-            command_queue.enqueueWriteBuffer(buf_values, CL_TRUE, 0, sizeof(T)*m_size, values);
-            command_queue.enqueueWriteBuffer(buf_weights, CL_TRUE, 0, sizeof(T)*m_out_size*m_size, weights);
+            if(mValuesMirror == Mirror::HostNewer) {
+                if(sharesHostArrays())
+                    enqueueSyncToDevice(buf_values, values, sizeof(T)*m_size, LaunchOrder());
+                else
+                    command_queue.enqueueWriteBuffer(buf_values, CL_TRUE, 0, sizeof(T)*m_size, values);
+                mValuesMirror = Mirror::Synced;
+            }
+            if(mWeightsMirror == Mirror::HostNewer) {
+                if(sharesHostArrays()) {
+                    if(m_out_size > 0)
+                        enqueueSyncToDevice(buf_weights, weights, sizeof(T)*m_out_size*m_size, LaunchOrder());
+                } else {
+                    command_queue.enqueueWriteBuffer(buf_weights, CL_TRUE, 0, sizeof(T)*m_out_size*m_size, weights);
+                }
+                if(mLayout == WeightLayout::Mirrored && m_out_size > 0) {
+                    enqueueWriteTransposedWeights();
+                }
+                mWeightsMirror = Mirror::Synced;
+            }
+        }
+
+        /**
+         * @brief Uploads the transposed host weights (Mirrored layout)
+         */
+        void enqueueWriteTransposedWeights()
+        {
+            std::vector<T> transposed(getNbWeights());
+            for(size_t k=0; k < static_cast<size_t>(m_out_size); k++) {
+                for(size_t i=0; i < static_cast<size_t>(m_size); i++) {
+                    transposed[k + m_out_size * i] = weights[i + m_size * k];
+                }
+            }
+            command_queue.enqueueWriteBuffer(buf_weights_t, CL_TRUE, 0, sizeof(T)*m_out_size*m_size, transposed.data());
         }
 
         void enqueueWriteInputBuffer(const std::vector<T>& input_values)
         {
+            if(sharesHostArrays()) {
+                std::copy(input_values.begin(), input_values.begin() + m_size, values);
+                enqueueSyncToDevice(buf_values, values, sizeof(T)*m_size, LaunchOrder());
+                mValuesMirror = Mirror::Synced;
+                return;
+            }
             command_queue.enqueueWriteBuffer(buf_values, CL_TRUE, 0, sizeof(T)*m_size, input_values.data());
+            mValuesMirror = Mirror::DeviceNewer;
         }
 
+        /**
+         * @brief Reads back the arrays that kernels modified since the last
+         * synchronization (see Mirror). The others are already up to date on
+         * the host.
+         */
         void enqueueReadBuffers()
         {
             enqueueReadValues();
@@ -209,77 +663,616 @@ class NeuronLayer
         }
 
         void enqueueReadValues() {
-            command_queue.enqueueReadBuffer(buf_values, CL_TRUE, 0, sizeof(T)*m_size, values);
+            if(mValuesMirror != Mirror::DeviceNewer) return;
+            if(sharesHostArrays()) {
+                enqueueSyncToHost(buf_values, values, sizeof(T)*m_size);
+            } else {
+                command_queue.enqueueReadBuffer(buf_values, CL_TRUE, 0, sizeof(T)*m_size, values);
+            }
+            mValuesMirror = Mirror::Synced;
         }
         void enqueueReadWeights()
         {
-            command_queue.enqueueReadBuffer(buf_weights, CL_TRUE, 0, sizeof(T)*m_size*m_out_size, weights);
+            if(mWeightsMirror != Mirror::DeviceNewer) return;
+            if(sharesHostArrays()) {
+                if(m_out_size > 0)
+                    enqueueSyncToHost(buf_weights, weights, sizeof(T)*m_size*m_out_size);
+            } else {
+                command_queue.enqueueReadBuffer(buf_weights, CL_TRUE, 0, sizeof(T)*m_size*m_out_size, weights);
+            }
+            mWeightsMirror = Mirror::Synced;
+        }
+
+        /**
+         * @brief Writes the values of the neurons (bias excluded) from input,
+         * straight to the device: the host array is left untouched.
+         * When order is asynchronous, input must stay valid until order.event
+         * completes.
+         */
+        void enqueueWriteValues(const T* input, const LaunchOrder& order = LaunchOrder())
+        {
+            enqueueValuesCopy(const_cast<T*>(input), true, order);
+            mValuesMirror = Mirror::DeviceNewer;
+        }
+
+        /**
+         * @brief Reads the values of the neurons (bias excluded) straight into
+         * output, the host array is left untouched.
+         * When order is asynchronous, output is only valid once order.event
+         * completes.
+         */
+        void enqueueReadValues(T* output, const LaunchOrder& order = LaunchOrder())
+        {
+            // The host may hold newer values
+            enqueueWriteBuffers();
+            enqueueValuesCopy(output, false, order);
+        }
+
+        /**
+         * @brief Copies the weights of the layer into those of destination, a
+         * layer of the same shape and context, without going through the
+         * host. The copy follows the commands already enqueued on the queue
+         * of order.
+         */
+        void enqueueCopyWeights(NeuronLayer& destination, const LaunchOrder& order = LaunchOrder())
+        {
+            if(destination.m_size != m_size || destination.m_out_size != m_out_size) {
+                throw std::runtime_error("NeuronLayer::enqueueCopyWeights - Layers must have the same shape");
+            } else if(mSvm || destination.mSvm) {
+                throw std::runtime_error("NeuronLayer::enqueueCopyWeights - Not supported in the SharedVirtualMemory mode");
+            }
+            // The host may hold newer weights
+            enqueueWriteBuffers();
+            cl::CommandQueue& queue = (order.queue != nullptr) ? *order.queue : command_queue;
+            queue.enqueueCopyBuffer(buf_weights, destination.buf_weights, 0, 0, sizeof(T) * m_size * m_out_size, order.wait_list, order.event);
+            if(order.blocking) queue.finish();
+            destination.mWeightsMirror = Mirror::DeviceNewer;
+            if(destination.mLayout == WeightLayout::Mirrored && m_out_size > 0) {
+                // The transposed copy is built on the host, as in setWeightLayout
+                queue.finish();
+                destination.enqueueReadWeights();
+                destination.enqueueWriteTransposedWeights();
+            }
+        }
+
+        /**
+         * @brief Binds the values (resp. weights) of the layer to argument
+         * index of kernel, whatever their storage: buffer, or SVM pointer.
+         */
+        void setValuesArg(cl::Kernel& kernel, cl_uint index) const {
+            setStorageArg(kernel, index, buf_values, values);
+        }
+        void setWeightsArg(cl::Kernel& kernel, cl_uint index) const {
+            setStorageArg(kernel, index, buf_weights, weights);
         }
 
         // Should only be called by run (existence of last element not checked)
+        // Null in the SharedVirtualMemory mode, see setValuesArg
         cl::Buffer getValuesBuf() const {
             return buf_values;
         }
         cl::Buffer getWeightsBuf() const {
             return buf_weights;
         }
+        cl::Buffer getTransposedWeightsBuf() const {
+            return buf_weights_t;
+        }
 
-        void enqueueRun(cl::Kernel &kernel) {
-            if(m_out_layer != nullptr) {
-                kernel.setArg(0, m_size);
-                kernel.setArg(1, m_out_size-1);
-                kernel.setArg(2, buf_values);
-                kernel.setArg(3, buf_weights);
-                kernel.setArg(4, m_out_layer->getValuesBuf());
-                if(command_queue.enqueueNDRangeKernel(kernel, cl::NullRange,cl::NDRange(m_out_size-1),cl::NullRange) != CL_SUCCESS) 
-                    throw std::runtime_error("PerceptronLayer::enqueueRun - Error running kernel");
-                command_queue.finish();
-            } else {
-                throw std::runtime_error("Can't run kernel on a null layer!");
+    private:
+        /**
+         * @brief Bounds [min, max) of the uniform distribution of init
+         */
+        void initRange(WeightInit init, float& min, float& max) const {
+            weightInitRange(init, m_size, m_out_size-1, min, max);
+        }
+
+        /**
+         * @brief Uploads what the host modified in the layers a kernel
+         * enqueued on this layer uses
+         */
+        void syncNeighbourhoodToDevice() {
+            if(m_in_layer != nullptr) m_in_layer->enqueueWriteBuffers();
+            enqueueWriteBuffers();
+            if(m_out_layer != nullptr) m_out_layer->enqueueWriteBuffers();
+        }
+
+        void markDeviceWrites(unsigned writes) {
+            if((writes & WritesNextValues) && m_out_layer != nullptr) m_out_layer->mValuesMirror = Mirror::DeviceNewer;
+            if(writes & WritesValues) mValuesMirror = Mirror::DeviceNewer;
+            if(writes & WritesWeights) mWeightsMirror = Mirror::DeviceNewer;
+            if((writes & WritesPreviousWeights) && m_in_layer != nullptr) m_in_layer->mWeightsMirror = Mirror::DeviceNewer;
+        }
+
+        bool sharesHostArrays() const {
+            return mZeroCopy || mSvm;
+        }
+
+        void enqueueValuesCopy(T* host, bool to_device, const LaunchOrder& order)
+        {
+            cl::CommandQueue& queue = (order.queue != nullptr) ? *order.queue : command_queue;
+            const size_t bytes = sizeof(T) * (m_size-1);
+            if(mSvm) {
+#ifdef CL_VERSION_2_0
+                std::vector<cl_event> wait;
+                if(order.wait_list != nullptr) {
+                    for(size_t i=0; i < order.wait_list->size(); i++) wait.push_back((*order.wait_list)[i]());
+                }
+                cl_event copied_event;
+                if(clEnqueueSVMMemcpy(queue(), order.blocking ? CL_TRUE : CL_FALSE, to_device ? values : host, to_device ? host : values, bytes, wait.size(), wait.empty() ? nullptr : wait.data(), &copied_event) != CL_SUCCESS)
+                    throw std::runtime_error("NeuronLayer - SVM copy failed");
+                cl::Event copied(copied_event);
+                if(order.event != nullptr) *order.event = copied;
+#endif
+                return;
             }
+            // Also valid for zero-copy buffers: the runtime copies from/to the
+            // shared host array
+            const cl_bool blocking = order.blocking ? CL_TRUE : CL_FALSE;
+            if(to_device)
+                queue.enqueueWriteBuffer(buf_values, blocking, 0, bytes, host, order.wait_list, order.event);
+            else
+                queue.enqueueReadBuffer(buf_values, blocking, 0, bytes, host, order.wait_list, order.event);
+        }
+
+        /**
+         * @brief SVM support of the device, 0 without OpenCL 2.0 (device or
+         * headers)
+         */
+        cl_bitfield svmCapabilities() const {
+#ifdef CL_VERSION_2_0
+            const cl::Device device = command_queue.getInfo<CL_QUEUE_DEVICE>();
+            cl_device_svm_capabilities capabilities = 0;
+            // The query fails on OpenCL 1.x devices
+            if(clGetDeviceInfo(device(), CL_DEVICE_SVM_CAPABILITIES, sizeof(capabilities), &capabilities, nullptr) != CL_SUCCESS)
+                return 0;
+            return capabilities;
+#else
+            return 0;
+#endif
         }
 
-        void enqueueTrainOutputLayer(cl::Kernel &kernel, cl::Buffer& expected_out_buf, cl::Buffer& delta_out_buf) {
+        T* allocateHostArray(size_t count) {
+#ifdef CL_VERSION_2_0
+            if(mSvm) {
+                const cl_svm_mem_flags flags = CL_MEM_READ_WRITE | (mSvmFineGrain ? CL_MEM_SVM_FINE_GRAIN_BUFFER : 0);
+                void* ptr = clSVMAlloc(mSvmContext(), flags, sizeof(T) * count, 0);
+                if(ptr == nullptr) throw std::runtime_error("NeuronLayer - SVM allocation failed");
+                return static_cast<T*>(ptr);
+            }
+#endif
+            return static_cast<T*>(alignedAlloc(sizeof(T) * count));
+        }
 
-            kernel.setArg(0, buf_values);
-            kernel.setArg(1, expected_out_buf);
-            kernel.setArg(2, delta_out_buf);
-            command_queue.enqueueNDRangeKernel(kernel, cl::NullRange,cl::NDRange(m_size-1),cl::NullRange);
-            if(command_queue.finish()!= CL_SUCCESS) {
-                throw std::runtime_error("PerceptronLayer::enqueueTrainOutputLayer - command queue failed to execute");
+        void freeHostArray(T* ptr) {
+            if(ptr == nullptr) return;
+#ifdef CL_VERSION_2_0
+            if(mSvm) {
+                clSVMFree(mSvmContext(), ptr);
+                return;
             }
+#endif
+            alignedFree(ptr);
         }
 
-        void enqueueTrainBackpropagate(cl::Kernel &kernel, cl::Buffer& delta_out_buf, cl::Buffer& succ_delta_buf) {
-            if(m_out_layer != nullptr) {
-                kernel.setArg(0, m_size);
-                kernel.setArg(1, m_out_layer->getSize());
-                kernel.setArg(2, buf_values);
-                kernel.setArg(3, buf_weights);
-                kernel.setArg(4, succ_delta_buf);
-                kernel.setArg(5, delta_out_buf);
-                command_queue.enqueueNDRangeKernel(kernel, cl::NullRange,cl::NDRange(m_size-1),cl::NullRange);
-                command_queue.finish();
+        /**
+         * @brief Moves the host arrays to SVM allocations (svm), or back to
+         * host memory
+         */
+        void reallocateHostArrays(bool svm) {
+            T* old_values = values;
+            T* old_weights = weights;
+            const bool old_svm = mSvm;
+            command_queue.finish();
+
+            mSvm = svm;
+            if(mSvm) {
+                mSvmContext = command_queue.getInfo<CL_QUEUE_CONTEXT>();
+#ifdef CL_VERSION_2_0
+                mSvmFineGrain = (svmCapabilities() & CL_DEVICE_SVM_FINE_GRAIN_BUFFER) != 0;
+#endif
+            }
+            values = allocateHostArray(m_size);
+            std::copy(old_values, old_values + m_size, values);
+            if(old_weights != nullptr) {
+                weights = allocateHostArray(getNbWeights());
+                std::copy(old_weights, old_weights + getNbWeights(), weights);
+            }
+
+            // Frees with the allocator of the old arrays
+            mSvm = old_svm;
+            freeHostArray(old_values);
+            freeHostArray(old_weights);
+            mSvm = svm;
+        }
+
+        void setStorageArg(cl::Kernel& kernel, cl_uint index, const cl::Buffer& buffer, const T* ptr) const {
+#ifdef CL_VERSION_2_0
+            if(mSvm) {
+                if(clSetKernelArgSVMPointer(kernel(), index, ptr) != CL_SUCCESS)
+                    throw std::runtime_error("NeuronLayer - Could not set the SVM pointer argument");
+                return;
+            }
+#endif
+            kernel.setArg(index, buffer);
+        }
+
+        /**
+         * @brief Zero-copy counterpart of a write: mapping the buffer (or the
+         * SVM allocation ptr) for writing then unmapping it publishes the host
+         * array to the device.
+         * The region is invalidated, so that the map never copies the device
+         * contents over the host array.
+         */
+        void enqueueSyncToDevice(cl::Buffer& buffer, T* ptr, size_t bytes, const LaunchOrder& order)
+        {
+            cl::CommandQueue& queue = (order.queue != nullptr) ? *order.queue : command_queue;
+            if(mSvm) {
+                enqueueSvmSync(queue, ptr, bytes, CL_MAP_WRITE_INVALIDATE_REGION, order);
+                return;
+            }
+            cl::Event mapped;
+            void* mapped_ptr = queue.enqueueMapBuffer(buffer, CL_FALSE, CL_MAP_WRITE_INVALIDATE_REGION, 0, bytes, order.wait_list, &mapped);
+            EventList after_map;
+            after_map.push_back(mapped);
+            queue.enqueueUnmapMemObject(buffer, mapped_ptr, &after_map, order.event);
+            if(order.blocking) queue.finish();
+        }
+
+        /**
+         * @brief Zero-copy counterpart of a (blocking) read: once mapped for
+         * reading, the host array holds the results of the device.
+         */
+        void enqueueSyncToHost(cl::Buffer& buffer, T* svm_ptr, size_t bytes)
+        {
+            if(mSvm) {
+                enqueueSvmSync(command_queue, svm_ptr, bytes, CL_MAP_READ, LaunchOrder());
+                return;
+            }
+            void* ptr = command_queue.enqueueMapBuffer(buffer, CL_TRUE, CL_MAP_READ, 0, bytes);
+            command_queue.enqueueUnmapMemObject(buffer, ptr);
+            command_queue.finish();
+        }
+
+        /**
+         * @brief Synchronization of an SVM allocation. Fine-grain allocations
+         * are coherent at command boundaries: only the order is kept. Coarse
+         * grain ones are mapped then unmapped.
+         */
+        void enqueueSvmSync(cl::CommandQueue& queue, T* ptr, size_t bytes, cl_map_flags flags, const LaunchOrder& order)
+        {
+            if(mSvmFineGrain) {
+                queue.enqueueMarkerWithWaitList(order.wait_list, order.event);
             } else {
-                throw std::runtime_error("Can't run kernel on a null layer!");
+#ifdef CL_VERSION_2_0
+                std::vector<cl_event> wait;
+                if(order.wait_list != nullptr) {
+                    for(size_t i=0; i < order.wait_list->size(); i++) wait.push_back((*order.wait_list)[i]());
+                }
+                cl_event mapped_event;
+                if(clEnqueueSVMMap(queue(), CL_FALSE, flags, ptr, bytes, wait.size(), wait.empty() ? nullptr : wait.data(), &mapped_event) != CL_SUCCESS)
+                    throw std::runtime_error("NeuronLayer - SVM map failed");
+                // The wrappers own (and release) the events
+                cl::Event mapped(mapped_event);
+                cl_event unmapped_event;
+                if(clEnqueueSVMUnmap(queue(), ptr, 1, &mapped_event, &unmapped_event) != CL_SUCCESS)
+                    throw std::runtime_error("NeuronLayer - SVM unmap failed");
+                cl::Event unmapped(unmapped_event);
+                if(order.event != nullptr) *order.event = unmapped;
+#endif
+            }
+            if(order.blocking) queue.finish();
+        }
+
+        bool forwardReadsTransposed() const {
+            return mLayout == WeightLayout::Mirrored && !mCpuDevice;
+        }
+
+        bool backpropagateReadsTransposed() const {
+            return mLayout == WeightLayout::Mirrored && mCpuDevice;
+        }
+
+        /**
+         * @brief Kernel implementing kernel for the weight layout of the layer.
+         * The kernels of the Mirrored layout are looked up by name in the
+         * program of kernel.
+         */
+        cl::Kernel& layoutKernel(cl::Kernel& kernel) {
+            if(mLayout == WeightLayout::RowMajor) return kernel;
+
+            auto found = mLayoutKernels.find(kernel());
+            if(found != mLayoutKernels.end()) return found->second;
+
+            const std::string name = kernel.getInfo<CL_KERNEL_FUNCTION_NAME>();
+            std::string layout_name = name;
+            if(name == "perceptron" && forwardReadsTransposed()) {
+                layout_name = "perceptron_transposed";
+            } else if(name == "perceptron_train_backpropagate" && backpropagateReadsTransposed()) {
+                layout_name = "perceptron_train_backpropagate_transposed";
+            } else if(name == "perceptron_train_update_weights" || name == "perceptron_train_backpropagate_update_weights") {
+                layout_name = name + "_mirrored";
             }
+            cl::Kernel layout_kernel = (layout_name == name) ? kernel : cloneKernel(kernel, layout_name);
+            return mLayoutKernels[kernel()] = layout_kernel;
+        }
+
+        /**
+         * Argument binders of each kernel.
+         * Buffers are captured by value, so that a binder can be kept and used
+         * after the call that created it.
+         */
+        WorkGroupTuner::ArgBinder runArgs() {
+            if(m_out_layer == nullptr) throw std::runtime_error("Can't run kernel on a null layer!");
+            return [this](cl::Kernel& k) {
+                k.setArg(0, m_size);
+                k.setArg(1, m_out_size-1);
+                setValuesArg(k, 2);
+                if(forwardReadsTransposed()) k.setArg(3, buf_weights_t);
+                else setWeightsArg(k, 3);
+                m_out_layer->setValuesArg(k, 4);
+            };
         }
 
-        void enqueueTrainUpdateWeights(cl::Kernel& kernel, cl::Buffer& delta_buf, const float& epsilon)
+        WorkGroupTuner::ArgBinder trainOutputLayerArgs(const cl::Buffer& expected_out_buf, const cl::Buffer& delta_out_buf) {
+            return [this, expected_out_buf, delta_out_buf](cl::Kernel& k) {
+                setValuesArg(k, 0);
+                k.setArg(1, expected_out_buf);
+                k.setArg(2, delta_out_buf);
+            };
+        }
+
+        WorkGroupTuner::ArgBinder trainBackpropagateArgs(const cl::Buffer& delta_out_buf, const cl::Buffer& succ_delta_buf) {
+            if(m_out_layer == nullptr) throw std::runtime_error("Can't run kernel on a null layer!");
+            return [this, delta_out_buf, succ_delta_buf](cl::Kernel& k) {
+                k.setArg(0, m_size);
+                k.setArg(1, m_out_layer->getSize());
+                setValuesArg(k, 2);
+                if(backpropagateReadsTransposed()) k.setArg(3, buf_weights_t);
+                else setWeightsArg(k, 3);
+                k.setArg(4, succ_delta_buf);
+                k.setArg(5, delta_out_buf);
+            };
+        }
+
+        WorkGroupTuner::ArgBinder trainUpdateWeightsArgs(const cl::Buffer& delta_buf, const float& epsilon) {
+            NLayer* prev_layer = getPreviousLayer();
+            if(prev_layer == nullptr) throw std::runtime_error("Can't run kernel on a null layer!");
+            if(prev_layer->getWeightLayout() == WeightLayout::Mirrored) {
+                return [this, prev_layer, delta_buf, epsilon](cl::Kernel& k) {
+                    k.setArg(0, prev_layer->getSize());
+                    k.setArg(1, m_size);
+                    k.setArg(2, epsilon);
+                    prev_layer->setValuesArg(k, 3);
+                    k.setArg(4, delta_buf);
+                    prev_layer->setWeightsArg(k, 5);
+                    k.setArg(6, prev_layer->getTransposedWeightsBuf());
+                };
+            }
+            return [prev_layer, delta_buf, epsilon](cl::Kernel& k) {
+                k.setArg(0, prev_layer->getSize());
+                k.setArg(1, epsilon);
+                prev_layer->setValuesArg(k, 2);
+                k.setArg(3, delta_buf);
+                prev_layer->setWeightsArg(k, 4);
+            };
+        }
+
+        WorkGroupTuner::ArgBinder trainBackpropagateUpdateWeightsArgs(const cl::Buffer& delta_out_buf, const cl::Buffer& succ_delta_buf, const float& epsilon) {
+            if(m_out_layer == nullptr) throw std::runtime_error("Can't run kernel on a null layer!");
+            if(mLayout == WeightLayout::Mirrored) {
+                return [this, delta_out_buf, succ_delta_buf, epsilon](cl::Kernel& k) {
+                    k.setArg(0, m_size);
+                    k.setArg(1, m_out_layer->getSize());
+                    k.setArg(2, epsilon);
+                    setValuesArg(k, 3);
+                    setWeightsArg(k, 4);
+                    k.setArg(5, buf_weights_t);
+                    k.setArg(6, succ_delta_buf);
+                    k.setArg(7, delta_out_buf);
+                };
+            }
+            return [this, delta_out_buf, succ_delta_buf, epsilon](cl::Kernel& k) {
+                k.setArg(0, m_size);
+                k.setArg(1, m_out_layer->getSize());
+                k.setArg(2, epsilon);
+                setValuesArg(k, 3);
+                setWeightsArg(k, 4);
+                k.setArg(5, succ_delta_buf);
+                k.setArg(6, delta_out_buf);
+            };
+        }
+
+        /**
+         * @brief Enqueues kernel on [0, global), in launches of at most
+         * mMaxLaunchSize work-items. They use global offsets, so the kernels
+         * see the same get_global_id as with a single launch.
+         * The local size was chosen for a full launch: the work-items of the
+         * last launch that do not fill a work-group are launched apart, with
+         * the local size chosen by the driver (OpenCL 1.x requires the global
+         * size to be a multiple of the local size).
+         */
+        cl_int enqueueSplit(cl::CommandQueue& queue, const cl::Kernel& kernel, size_t global, const cl::NDRange& local, const LaunchOrder& order)
         {
+            if(global <= mMaxLaunchSize) {
+                return queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(global), local, order.wait_list, order.event);
+            }
+            const size_t local_size = (local.dimensions() == 0) ? 1 : local[0];
+            EventList launches;
+            auto launch = [&](size_t offset, size_t size, const cl::NDRange& launch_local) {
+                cl::Event launched;
+                const cl_int status = queue.enqueueNDRangeKernel(kernel, cl::NDRange(offset), cl::NDRange(size), launch_local, order.wait_list, &launched);
+                if(status == CL_SUCCESS) launches.push_back(launched);
+                return status;
+            };
+            for(size_t offset = 0; offset < global; offset += mMaxLaunchSize) {
+                const size_t size = std::min(mMaxLaunchSize, global - offset);
+                const size_t full = size - size % local_size;
+                cl_int status = CL_SUCCESS;
+                if(full > 0) status = launch(offset, full, local);
+                if(status == CL_SUCCESS && full < size) status = launch(offset + full, size - full, cl::NullRange);
+                if(status != CL_SUCCESS) return status;
+            }
+            // The launches may complete in any order on an out-of-order queue
+            if(order.event != nullptr) return queue.enqueueMarkerWithWaitList(&launches, order.event);
+            return CL_SUCCESS;
+        }
+
+        size_t trainUpdateWeightsGlobalSize() {
             NLayer* prev_layer = getPreviousLayer();
-            if(prev_layer != nullptr) {
-                kernel.setArg(0, prev_layer->getSize());
-                kernel.setArg(1, epsilon);
-                kernel.setArg(2, prev_layer->getValuesBuf());
-                kernel.setArg(3, delta_buf);
-                kernel.setArg(4, prev_layer->getWeightsBuf());
-                if(command_queue.enqueueNDRangeKernel(kernel, cl::NullRange,cl::NDRange((m_size-1)*(prev_layer->getSize())),cl::NullRange) != CL_SUCCESS) 
-                    throw std::runtime_error("PerceptronLayer::enqueueTrainUpdateWeights - Error running weight update kernel");
-                command_queue.finish();
+            if(prev_layer == nullptr) throw std::runtime_error("Can't run kernel on a null layer!");
+            return static_cast<size_t>(m_size-1)*prev_layer->getSize();
+        }
+
+        std::string shapeKey() const {
+            std::ostringstream shape;
+            shape << m_size << "x" << m_out_size;
+            return shape.str();
+        }
+
+    public:
+        /**
+         * @brief Enqueues kernel on global work-items, as scheduled by order.
+         * Without tuner, the driver chooses the local size. Otherwise, the
+         * kernel variant and local size are the ones selected by the tuner,
+         * which uses bind_for_tuning to set the arguments of the candidates it
+         * benchmarks.
+         * Host modifications of the layers used by the kernel are uploaded
+         * first, and the arrays the kernel writes (KernelWrites flags) are
+         * marked as newer on the device.
+         */
+        cl_int enqueueKernel(cl::Kernel& base_kernel, size_t global, unsigned writes, const WorkGroupTuner::ArgBinder& bind, const WorkGroupTuner::ArgBinder& bind_for_tuning, const LaunchOrder& order)
+        {
+            syncNeighbourhoodToDevice();
+            markDeviceWrites(writes);
+            cl::Kernel& kernel = layoutKernel(base_kernel);
+            cl::CommandQueue& queue = (order.queue != nullptr) ? *order.queue : command_queue;
+            cl_int status;
+            if(mTuner == nullptr) {
+                bind(kernel);
+                status = enqueueSplit(queue, kernel, global, cl::NullRange, order);
             } else {
-                throw std::runtime_error("Can't run kernel on a null layer!");
+                // Benchmarks must not run before the inputs of the kernel are ready
+                auto bind_when_ready = [&](cl::Kernel& k) {
+                    if(order.wait_list != nullptr && order.wait_list->size() > 0)
+                        cl::Event::waitForEvents(*order.wait_list);
+                    bind_for_tuning(k);
+                };
+                WorkGroupTuner::Choice choice = mTuner->select(queue, kernel, shapeKey(), std::min(global, mMaxLaunchSize), bind_when_ready);
+                cl::Kernel& tuned = mTuner->kernelFor(kernel, choice);
+                bind(tuned);
+                const cl::NDRange local = (choice.local == 0) ? cl::NullRange : cl::NDRange(choice.local);
+                status = enqueueSplit(queue, tuned, global, local, order);
+            }
+            if(status == CL_SUCCESS && order.blocking) {
+                status = queue.finish();
             }
+            return status;
+        }
+
+        /**
+         * @brief Resolves once everything enqueueKernel does on each call:
+         * the kernel variant and local size (when a tuner is set), and the
+         * arguments, bound on a kernel instance dedicated to this launch.
+         */
+        BoundKernel prepareKernel(const cl::Kernel& base_kernel, size_t global, unsigned writes, const WorkGroupTuner::ArgBinder& bind, const WorkGroupTuner::ArgBinder& bind_for_tuning)
+        {
+            cl::Kernel base = base_kernel;
+            const cl::Kernel& kernel = layoutKernel(base);
+            BoundKernel bound;
+            bound.global = cl::NDRange(global);
+            bound.local = cl::NullRange;
+            bound.writes = writes;
+            if(mTuner == nullptr) {
+                bound.kernel = cloneKernel(kernel);
+            } else {
+                // Tuning runs the kernel
+                syncNeighbourhoodToDevice();
+                markDeviceWrites(writes);
+                WorkGroupTuner::Choice choice = mTuner->select(command_queue, kernel, shapeKey(), std::min(global, mMaxLaunchSize), bind_for_tuning);
+                bound.kernel = cloneKernel(kernel, choice.variant);
+                if(choice.local != 0) bound.local = cl::NDRange(choice.local);
+            }
+            bind(bound.kernel);
+            return bound;
+        }
+
+        cl_int enqueueBound(const BoundKernel& bound, const LaunchOrder& order = LaunchOrder())
+        {
+            syncNeighbourhoodToDevice();
+            markDeviceWrites(bound.writes);
+            cl::CommandQueue& queue = (order.queue != nullptr) ? *order.queue : command_queue;
+            cl_int status = enqueueSplit(queue, bound.kernel, bound.global[0], bound.local, order);
+            if(status == CL_SUCCESS && order.blocking) {
+                status = queue.finish();
+            }
+            return status;
+        }
+
+        BoundKernel prepareRun(const cl::Kernel& kernel) {
+            auto bind = runArgs();
+            return prepareKernel(kernel, m_out_size-1, WritesNextValues, bind, bind);
+        }
+
+        BoundKernel prepareTrainOutputLayer(const cl::Kernel& kernel, const cl::Buffer& expected_out_buf, const cl::Buffer& delta_out_buf) {
+            auto bind = trainOutputLayerArgs(expected_out_buf, delta_out_buf);
+            return prepareKernel(kernel, m_size-1, WritesNothing, bind, bind);
+        }
+
+        BoundKernel prepareTrainBackpropagate(const cl::Kernel& kernel, const cl::Buffer& delta_out_buf, const cl::Buffer& succ_delta_buf) {
+            auto bind = trainBackpropagateArgs(delta_out_buf, succ_delta_buf);
+            return prepareKernel(kernel, m_size-1, WritesNothing, bind, bind);
+        }
+
+        BoundKernel prepareTrainUpdateWeights(const cl::Kernel& kernel, const cl::Buffer& delta_buf, const float& epsilon) {
+            // Benchmarking with a null learning rate leaves the weights unchanged
+            return prepareKernel(kernel, trainUpdateWeightsGlobalSize(), WritesPreviousWeights, trainUpdateWeightsArgs(delta_buf, epsilon), trainUpdateWeightsArgs(delta_buf, 0.f));
+        }
+
+        /**
+         * @brief Fused backpropagation into this layer and update of its
+         * weights (perceptron_train_backpropagate_update_weights)
+         */
+        BoundKernel prepareTrainBackpropagateUpdateWeights(const cl::Kernel& kernel, const cl::Buffer& delta_out_buf, const cl::Buffer& succ_delta_buf, const float& epsilon) {
+            // Benchmarking with a null learning rate leaves the weights unchanged
+            return prepareKernel(kernel, m_size, WritesWeights, trainBackpropagateUpdateWeightsArgs(delta_out_buf, succ_delta_buf, epsilon), trainBackpropagateUpdateWeightsArgs(delta_out_buf, succ_delta_buf, 0.f));
+        }
+
+        void enqueueRun(cl::Kernel &kernel, const LaunchOrder& order = LaunchOrder()) {
+            auto bind = runArgs();
+            if(enqueueKernel(kernel, m_out_size-1, WritesNextValues, bind, bind, order) != CL_SUCCESS) 
+                throw std::runtime_error("PerceptronLayer::enqueueRun - Error running kernel");
+        }
+
+        void enqueueTrainOutputLayer(cl::Kernel &kernel, cl::Buffer& expected_out_buf, cl::Buffer& delta_out_buf, const LaunchOrder& order = LaunchOrder()) {
+            auto bind = trainOutputLayerArgs(expected_out_buf, delta_out_buf);
+            if(enqueueKernel(kernel, m_size-1, WritesNothing, bind, bind, order) != CL_SUCCESS) {
+                throw std::runtime_error("PerceptronLayer::enqueueTrainOutputLayer - command queue failed to execute");
+            }
+        }
+
+        void enqueueTrainBackpropagate(cl::Kernel &kernel, cl::Buffer& delta_out_buf, cl::Buffer& succ_delta_buf, const LaunchOrder& order = LaunchOrder()) {
+            auto bind = trainBackpropagateArgs(delta_out_buf, succ_delta_buf);
+            if(enqueueKernel(kernel, m_size-1, WritesNothing, bind, bind, order) != CL_SUCCESS) {
+                throw std::runtime_error("PerceptronLayer::enqueueTrainBackpropagate - Error running backpropagation kernel");
+            }
+        }
+
+        void enqueueTrainUpdateWeights(cl::Kernel& kernel, cl::Buffer& delta_buf, const float& epsilon, const LaunchOrder& order = LaunchOrder())
+        {
+            // Benchmarking with a null learning rate leaves the weights unchanged
+            if(enqueueKernel(kernel, trainUpdateWeightsGlobalSize(), WritesPreviousWeights, trainUpdateWeightsArgs(delta_buf, epsilon), trainUpdateWeightsArgs(delta_buf, 0.f), order) != CL_SUCCESS) 
+                throw std::runtime_error("PerceptronLayer::enqueueTrainUpdateWeights - Error running weight update kernel");
+        }
+
+        /**
+         * @brief Backpropagation into this layer and update of its weights in
+         * a single launch, reading the weight matrix once.
+         * Replaces enqueueTrainBackpropagate on this layer followed by
+         * enqueueTrainUpdateWeights on the next one.
+         */
+        void enqueueTrainBackpropagateUpdateWeights(cl::Kernel& kernel, cl::Buffer& delta_out_buf, cl::Buffer& succ_delta_buf, const float& epsilon, const LaunchOrder& order = LaunchOrder())
+        {
+            if(enqueueKernel(kernel, m_size, WritesWeights, trainBackpropagateUpdateWeightsArgs(delta_out_buf, succ_delta_buf, epsilon), trainBackpropagateUpdateWeightsArgs(delta_out_buf, succ_delta_buf, 0.f), order) != CL_SUCCESS) 
+                throw std::runtime_error("PerceptronLayer::enqueueTrainBackpropagateUpdateWeights - Error running fused training kernel");
         }
 
         friend ostream& operator<< (ostream &out, const NeuronLayer& layer) {
@@ -290,7 +1283,7 @@ class NeuronLayer
             }
             out << "\n\tWeights: ";
             if(layer.m_out_layer != nullptr) {
-                for(int i=0; i<layer.m_size*layer.m_out_size; i++) {
+                for(size_t i=0; i<layer.getNbWeights(); i++) {
                     out << layer.weights[i] << "\t" ;
                 }
             } else {
@@ -0,0 +1,69 @@
+#ifndef __PERMUTATION_HPP__
+#define __PERMUTATION_HPP__
+
+#include <cstdint>
+
+/**
+ * Permutation
+ * ===========
+ *
+ * Host side of the shuffle of the perceptron_shuffle kernel: a pseudo-random
+ * permutation of [0, n), keyed by a seed and an epoch, computed index by
+ * index (4-round Feistel network, restricted to [0, n) by cycle walking).
+ * Both compute the same order, with the same 32-bit operations.
+ */
+namespace permutation {
+
+inline uint32_t hash(uint32_t x, uint32_t key)
+{
+    x ^= key;
+    x *= 0x9E3779B1u;
+    x ^= x >> 15;
+    x *= 0x85EBCA77u;
+    x ^= x >> 13;
+    return x;
+}
+
+/**
+ * @brief Half of the bits of the indices of the Feistel network over n
+ * indices (its domain is the smallest power of 4 not below n)
+ */
+inline uint32_t halfBits(uint32_t n)
+{
+    uint32_t bits = 0;
+    while(bits < 32 && (uint64_t(1) << bits) < n) bits++;
+    return (bits + 1) / 2;
+}
+
+inline uint32_t feistel(uint32_t i, uint32_t half_bits, uint64_t seed, uint32_t epoch)
+{
+    const uint32_t seed_lo = static_cast<uint32_t>(seed);
+    const uint32_t seed_hi = static_cast<uint32_t>(seed >> 32);
+    const uint32_t mask = (1u << half_bits) - 1;
+    uint32_t left = i >> half_bits;
+    uint32_t right = i & mask;
+    for(uint32_t round = 0; round < 4; round++) {
+        const uint32_t key = hash(seed_lo + round * 0x632BE59Bu, seed_hi ^ epoch);
+        const uint32_t next = left ^ ((hash(right, key) >> 16) & mask);
+        left = right;
+        right = next;
+    }
+    return (left << half_bits) | right;
+}
+
+/**
+ * @brief Index of the i-th sample of epoch, among n
+ */
+inline uint32_t index(uint32_t i, uint32_t n, uint64_t seed, uint32_t epoch)
+{
+    const uint32_t half_bits = halfBits(n);
+    uint32_t j = i;
+    do {
+        j = feistel(j, half_bits, seed, epoch);
+    } while(j >= n);
+    return j;
+}
+
+}
+
+#endif
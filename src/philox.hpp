@@ -0,0 +1,108 @@
+#ifndef __PHILOX_HPP__
+#define __PHILOX_HPP__
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <thread>
+#include <vector>
+
+/**
+ * Philox
+ * ======
+ *
+ * Host side of the counter-based random number generator of the
+ * perceptron_init_weights kernel: Philox4x32-10 (Salmon et al., "Parallel
+ * random numbers: as easy as 1, 2, 3", SC11).
+ *
+ * Each block of 4 random words only depends on the key (seed) and on its
+ * counter (block index and stream), so blocks can be generated in any order,
+ * by any number of threads or work-items, and the results are reproducible
+ * from the seed.
+ * Numbers are converted to floats exactly, with the same operations as the
+ * kernel, so that both produce identical values.
+ */
+namespace philox {
+
+static const uint32_t M0 = 0xD2511F53u;
+static const uint32_t M1 = 0xCD9E8D57u;
+static const uint32_t W0 = 0x9E3779B9u;
+static const uint32_t W1 = 0xBB67AE85u;
+
+/**
+ * @brief Replaces the counter ctr by the 4 random words of (ctr, key)
+ */
+inline void philox4x32_10(uint32_t ctr[4], uint32_t key0, uint32_t key1)
+{
+    for(int round = 0; round < 10; round++) {
+        if(round > 0) {
+            key0 += W0;
+            key1 += W1;
+        }
+        const uint64_t p0 = static_cast<uint64_t>(M0) * ctr[0];
+        const uint64_t p1 = static_cast<uint64_t>(M1) * ctr[2];
+        const uint32_t hi0 = static_cast<uint32_t>(p0 >> 32), lo0 = static_cast<uint32_t>(p0);
+        const uint32_t hi1 = static_cast<uint32_t>(p1 >> 32), lo1 = static_cast<uint32_t>(p1);
+        ctr[0] = hi1 ^ ctr[1] ^ key0;
+        ctr[1] = lo1;
+        ctr[2] = hi0 ^ ctr[3] ^ key1;
+        ctr[3] = lo0;
+    }
+}
+
+/**
+ * @brief Uniform float in [min, max) from a random word (24 bits, exact)
+ */
+inline float toUniform(uint32_t word, float min, float max)
+{
+    const float u = static_cast<float>(word >> 8) * (1.0f / 16777216.0f);
+    return std::fma(max - min, u, min);
+}
+
+/**
+ * @brief Fills values[0, count) with uniform numbers in [min, max), from seed
+ * and stream. Values 4*b to 4*b+3 come from block b.
+ * values may be a part of a larger array starting at index first: it then
+ * receives the same numbers as this part of the array.
+ * Large arrays are split between the hardware threads.
+ */
+template<typename T>
+void fillUniform(T* values, size_t count, uint64_t seed, uint32_t stream, float min, float max, size_t first = 0)
+{
+    const uint32_t key0 = static_cast<uint32_t>(seed);
+    const uint32_t key1 = static_cast<uint32_t>(seed >> 32);
+    const size_t first_block = first / 4;
+    const size_t nb_blocks = (first + count + 3) / 4 - first_block;
+
+    auto fill_blocks = [=](size_t begin, size_t end) {
+        for(size_t block = first_block + begin; block < first_block + end; block++) {
+            uint32_t ctr[4] = {static_cast<uint32_t>(block), static_cast<uint32_t>(static_cast<uint64_t>(block) >> 32), stream, 0};
+            philox4x32_10(ctr, key0, key1);
+            for(size_t j = 0; j < 4; j++) {
+                const size_t i = 4*block + j;
+                if(i >= first && i < first + count) values[i - first] = toUniform(ctr[j], min, max);
+            }
+        }
+    };
+
+    // Threads only pay off for large arrays
+    const size_t min_blocks_per_thread = 1 << 14;
+    const size_t nb_threads = std::max<size_t>(1, std::min<size_t>(std::thread::hardware_concurrency(), nb_blocks / min_blocks_per_thread));
+    if(nb_threads == 1) {
+        fill_blocks(0, nb_blocks);
+        return;
+    }
+    std::vector<std::thread> threads;
+    const size_t blocks_per_thread = (nb_blocks + nb_threads - 1) / nb_threads;
+    for(size_t t = 0; t < nb_threads; t++) {
+        const size_t begin = t * blocks_per_thread;
+        const size_t end = std::min(nb_blocks, begin + blocks_per_thread);
+        if(begin < end) threads.push_back(std::thread(fill_blocks, begin, end));
+    }
+    for(std::thread& thread : threads) thread.join();
+}
+
+}
+
+#endif
@@ -0,0 +1,427 @@
+#ifndef __PIPELINE_PERCEPTRON_HPP__
+#define __PIPELINE_PERCEPTRON_HPP__
+
+#include "perceptron.hpp"
+#include "parallel_device.hpp"
+
+#include <chrono>
+#include <condition_variable>
+#include <exception>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * PipelinePerceptron
+ * ==================
+ *
+ * Fully-connected perceptron whose consecutive layers are split across
+ * several devices (pipeline parallelism). Each device owns a stage: a
+ * Perceptron made of a range of consecutive layers. The last layer of a stage
+ * is also the first layer of the next one; its values go forward and its
+ * delta goes backward between the stages, through the host (buffers and
+ * events cannot be shared between contexts).
+ *
+ * Each stage is driven by its own host thread, and the samples flow through
+ * the pipeline as micro-batches, GPipe-style (Huang et al., "GPipe:
+ * efficient training of giant neural networks using pipeline parallelism"):
+ * - forward: stage s runs micro-batch m while stage s+1 runs micro-batch m-1
+ * - backward: once the last stage has run the forward pass of all the
+ *   micro-batches, deltas flow back through the stages, in reverse order of
+ *   the micro-batches
+ * The values computed in the forward pass of each micro-batch are kept on
+ * the device of the stage (stash) until its backward pass.
+ *
+ * A micro-batch is a single sample, as the training kernels process one
+ * sample at a time. The weights of a stage are updated by the backward pass
+ * of each micro-batch (fused backpropagation and update kernel): the forward
+ * passes of a mini-batch all use the weights of the previous mini-batch, as
+ * in mini-batch gradient descent.
+ *
+ * Stages should take the same time, or the slowest one sets the pace:
+ * getStageReports gives the share of the time each stage was busy.
+ *
+ * How to use
+ * ----------
+ * std::vector<ParallelDevice> devices = {{gpu0_context, gpu0_queue, gpu0_program},
+ *                                        {gpu1_context, gpu1_queue, gpu1_program}};
+ * PipelinePerceptron<float> p({1024, 4096, 4096, 4096, 10}, devices);
+ * p.trainMiniBatch(inputs, outputs, epsilon);
+ * p.run(inputs, predictions);
+ * for(auto& stage : p.getStageReports()) cout << stage.utilization << endl;
+ **/
+template<typename T>
+class PipelinePerceptron
+{
+    typedef NeuronLayer<T> NLayer;
+
+    public:
+        struct StageReport {
+            // Layers of the stage, in the whole network
+            int first_layer;
+            int last_layer;
+            // Time spent running commands of the stage, during the last call
+            // to run or trainMiniBatch
+            double busy_seconds;
+            // busy_seconds over the duration of the call
+            double utilization;
+        };
+
+    private:
+        /**
+         * @brief Hands the values (or deltas) of the micro-batches from the
+         * thread of a stage to the thread of its neighbour
+         */
+        class Channel
+        {
+            private:
+                std::mutex mMutex;
+                std::condition_variable mReady;
+                std::map<int, std::vector<T>> mItems;
+                bool mClosed = false;
+
+            public:
+                void push(int micro_batch, std::vector<T> item) {
+                    std::lock_guard<std::mutex> lock(mMutex);
+                    mItems[micro_batch] = std::move(item);
+                    mReady.notify_all();
+                }
+
+                /**
+                 * @brief Waits for the item of micro_batch
+                 */
+                std::vector<T> pop(int micro_batch) {
+                    std::unique_lock<std::mutex> lock(mMutex);
+                    mReady.wait(lock, [&]() { return mClosed || mItems.count(micro_batch) > 0; });
+                    if(mItems.count(micro_batch) == 0) throw std::runtime_error("PipelinePerceptron - Pipeline aborted");
+                    std::vector<T> item = std::move(mItems[micro_batch]);
+                    mItems.erase(micro_batch);
+                    return item;
+                }
+
+                /**
+                 * @brief Wakes up the waiting thread, after a failure of a stage
+                 */
+                void close() {
+                    std::lock_guard<std::mutex> lock(mMutex);
+                    mClosed = true;
+                    mReady.notify_all();
+                }
+
+                void reset() {
+                    std::lock_guard<std::mutex> lock(mMutex);
+                    mItems.clear();
+                    mClosed = false;
+                }
+        };
+
+        struct Stage {
+            ParallelDevice device;
+            std::unique_ptr<Perceptron<T>> perceptron;
+            std::vector<NLayer*> layers;
+            int first_layer = 0;
+
+            cl::Kernel run;
+            cl::Kernel train_output_layer;
+            cl::Kernel train_backpropagate;
+            cl::Kernel train_update_weights;
+            cl::Kernel train_backpropagate_update_weights;
+
+            // Values of the layers, per micro-batch, from the forward to the
+            // backward pass
+            std::vector<std::vector<cl::Buffer>> stash;
+            double busy_seconds = 0.;
+        };
+
+        std::vector<Stage> mStages;
+        // mForward[s] goes from stage s to s+1, mBackward[s] from s+1 to s
+        std::vector<std::unique_ptr<Channel>> mForward;
+        std::vector<std::unique_ptr<Channel>> mBackward;
+        double mWallSeconds = 0.;
+
+        typedef std::chrono::steady_clock Clock;
+
+        static double secondsSince(const Clock::time_point& start) {
+            return std::chrono::duration<double>(Clock::now() - start).count();
+        }
+
+        void ensureStash(Stage& stage, size_t nb_micro_batches)
+        {
+            while(stage.stash.size() < nb_micro_batches) {
+                std::vector<cl::Buffer> values;
+                for(NLayer* layer : stage.layers) {
+                    values.push_back(cl::Buffer(stage.device.context, CL_MEM_READ_WRITE, sizeof(T) * layer->getSize()));
+                }
+                stage.stash.push_back(values);
+            }
+        }
+
+        StepPlan<T>& getStepPlan(Stage& stage, const float& epsilon)
+        {
+            return stage.perceptron->getStepPlan(stage.run, stage.train_output_layer, stage.train_backpropagate, stage.train_update_weights, epsilon);
+        }
+
+        /**
+         * @brief Thread of stage s: forward pass of all the micro-batches,
+         * then, when training, their backward pass
+         */
+        void runStage(int s, const std::vector<std::vector<T>>& inputs, const std::vector<std::vector<T>>* expected, std::vector<std::vector<T>>* outputs, const float& epsilon)
+        {
+            Stage& stage = mStages[s];
+            cl::CommandQueue& queue = stage.device.queue;
+            const LaunchOrder order = LaunchOrder::inOrder(&queue);
+            const bool train = (expected != nullptr);
+            const bool last_stage = (s+1 == static_cast<int>(mStages.size()));
+            const int nb_micro_batches = inputs.size();
+            const int n = stage.layers.size();
+            NLayer* first = stage.layers.front();
+            NLayer* last = stage.layers.back();
+            StepPlan<T>& plan = getStepPlan(stage, epsilon);
+            if(train) ensureStash(stage, nb_micro_batches);
+
+            for(int m=0; m < nb_micro_batches; m++) {
+                const std::vector<T> in = (s == 0) ? inputs[m] : mForward[s-1]->pop(m);
+                const Clock::time_point start = Clock::now();
+                first->enqueueWriteValues(in.data(), order);
+                for(int l=0; l < n-1; l++) {
+                    plan.enqueueForward(l, order);
+                }
+                if(train) {
+                    for(int l=0; l < n; l++) {
+                        queue.enqueueCopyBuffer(stage.layers[l]->getValuesBuf(), stage.stash[m][l], 0, 0, sizeof(T) * stage.layers[l]->getSize());
+                    }
+                }
+                std::vector<T> out;
+                if(!last_stage || !train) {
+                    out.resize(last->getSize()-1);
+                    last->enqueueReadValues(out.data(), order);
+                }
+                queue.finish();
+                stage.busy_seconds += secondsSince(start);
+
+                if(!last_stage) {
+                    mForward[s]->push(m, std::move(out));
+                } else if(!train) {
+                    (*outputs)[m] = std::move(out);
+                }
+            }
+            if(!train) return;
+
+            for(int m=nb_micro_batches-1; m >= 0; m--) {
+                std::vector<T> delta;
+                if(!last_stage) delta = mBackward[s]->pop(m);
+                const Clock::time_point start = Clock::now();
+                for(int l=0; l < n; l++) {
+                    queue.enqueueCopyBuffer(stage.stash[m][l], stage.layers[l]->getValuesBuf(), 0, 0, sizeof(T) * stage.layers[l]->getSize());
+                }
+                if(last_stage) {
+                    const std::vector<T>& out = (*expected)[m];
+                    queue.enqueueWriteBuffer(plan.getExpectedOutputBuf(), CL_FALSE, 0, sizeof(T) * out.size(), out.data());
+                    plan.enqueueOutputDelta(order);
+                } else {
+                    queue.enqueueWriteBuffer(plan.getDeltaBuf(n-1), CL_FALSE, 0, sizeof(T) * delta.size(), delta.data());
+                }
+                for(int l=n-2; l >= 0; l--) {
+                    plan.enqueueBackpropagateUpdateWeights(l, order);
+                }
+                std::vector<T> in_delta;
+                if(s > 0) {
+                    in_delta.resize(first->getSize()-1);
+                    queue.enqueueReadBuffer(plan.getDeltaBuf(0), CL_FALSE, 0, sizeof(T) * in_delta.size(), in_delta.data());
+                }
+                queue.finish();
+                stage.busy_seconds += secondsSince(start);
+                if(s > 0) mBackward[s-1]->push(m, std::move(in_delta));
+            }
+        }
+
+        /**
+         * @brief Runs all the stages concurrently, and rethrows the first
+         * failure of a stage
+         */
+        void runPipeline(const std::vector<std::vector<T>>& inputs, const std::vector<std::vector<T>>* expected, std::vector<std::vector<T>>* outputs, const float& epsilon)
+        {
+            const size_t input_size = mStages.front().layers.front()->getSize()-1;
+            const size_t output_size = mStages.back().layers.back()->getSize()-1;
+            for(size_t m=0; m < inputs.size(); m++) {
+                if(inputs[m].size() != input_size || (expected != nullptr && (*expected)[m].size() != output_size)) {
+                    throw std::runtime_error("PipelinePerceptron - Sample sizes must match the input and output layers!");
+                }
+            }
+            for(auto& channel : mForward) channel->reset();
+            for(auto& channel : mBackward) channel->reset();
+            for(Stage& stage : mStages) stage.busy_seconds = 0.;
+
+            std::mutex error_mutex;
+            std::exception_ptr error;
+            const Clock::time_point start = Clock::now();
+            std::vector<std::thread> threads;
+            for(size_t s=0; s < mStages.size(); s++) {
+                threads.push_back(std::thread([&, s]() {
+                    try {
+                        runStage(s, inputs, expected, outputs, epsilon);
+                    } catch(...) {
+                        {
+                            std::lock_guard<std::mutex> lock(error_mutex);
+                            if(!error) error = std::current_exception();
+                        }
+                        for(auto& channel : mForward) channel->close();
+                        for(auto& channel : mBackward) channel->close();
+                    }
+                }));
+            }
+            for(std::thread& thread : threads) thread.join();
+            mWallSeconds = secondsSince(start);
+            if(error) std::rethrow_exception(error);
+        }
+
+    public:
+        /**
+         * @brief Places the layers onto the devices, one stage per device.
+         *
+         * @param sizes
+         *      Number of neurons of each layer, bias excluded (as in
+         *      Perceptron::createLayer)
+         * @param stage_layers
+         *      First layer of each stage. When empty, the stages are chosen
+         *      by balanceStages.
+         */
+        PipelinePerceptron(const std::vector<int>& sizes, const std::vector<ParallelDevice>& devices, std::vector<int> stage_layers = std::vector<int>())
+        {
+            if(stage_layers.empty()) stage_layers = balanceStages(sizes, devices.size());
+            if(stage_layers.size() != devices.size() || stage_layers[0] != 0) {
+                throw std::runtime_error("PipelinePerceptron - There must be one stage per device, the first one starting at layer 0");
+            }
+            stage_layers.push_back(sizes.size()-1);
+
+            mStages.resize(devices.size());
+            for(size_t s=0; s < devices.size(); s++) {
+                Stage& stage = mStages[s];
+                const int first_layer = stage_layers[s];
+                const int last_layer = stage_layers[s+1];
+                if(last_layer <= first_layer) {
+                    throw std::runtime_error("PipelinePerceptron - Each stage needs at least two layers");
+                }
+                stage.device = devices[s];
+                stage.first_layer = first_layer;
+                stage.perceptron.reset(new Perceptron<T>(stage.device.context, stage.device.queue));
+                for(int l=first_layer; l <= last_layer; l++) {
+                    stage.perceptron->createLayer(sizes[l]);
+                }
+                stage.perceptron->upload();
+                for(NLayer* layer = stage.perceptron->getFirstLayer(); layer != nullptr; layer = layer->getNextLayer()) {
+                    // Same weights from the same seed as the whole network
+                    layer->setIndex(first_layer + stage.layers.size());
+                    stage.layers.push_back(layer);
+                }
+
+                cl::Program& program = stage.device.program;
+                stage.run = cl::Kernel(program, "perceptron");
+                stage.train_output_layer = cl::Kernel(program, "perceptron_train_output_layer");
+                stage.train_backpropagate = cl::Kernel(program, "perceptron_train_backpropagate");
+                stage.train_update_weights = cl::Kernel(program, "perceptron_train_update_weights");
+                // Also computes the delta of the first layer of the stage,
+                // which goes back to the previous stage
+                stage.train_backpropagate_update_weights = cl::Kernel(program, "perceptron_train_backpropagate_update_weights");
+                stage.perceptron->useFusedTrainingKernel(stage.train_backpropagate_update_weights);
+
+                if(s > 0) {
+                    mForward.push_back(std::unique_ptr<Channel>(new Channel()));
+                    mBackward.push_back(std::unique_ptr<Channel>(new Channel()));
+                }
+            }
+        }
+
+        /**
+         * @brief First layer of each of nb_stages stages, so that the stages
+         * have about the same number of weights (the cost of the forward and
+         * backward passes)
+         */
+        static std::vector<int> balanceStages(const std::vector<int>& sizes, int nb_stages)
+        {
+            const int nb_matrices = sizes.size()-1;
+            if(nb_stages < 1 || nb_stages > nb_matrices) {
+                throw std::runtime_error("PipelinePerceptron::balanceStages - Each stage needs at least two layers");
+            }
+            std::vector<double> cost(nb_matrices);
+            double total = 0.;
+            for(int l=0; l < nb_matrices; l++) {
+                cost[l] = (sizes[l] + 1.) * (sizes[l+1] + 1.);
+                total += cost[l];
+            }
+
+            std::vector<int> stage_layers(1, 0);
+            double cumulated = 0.;
+            for(int l=0; l+1 < nb_matrices; l++) {
+                cumulated += cost[l];
+                const int stages_left = nb_stages - stage_layers.size();
+                const int matrices_left = nb_matrices - (l+1);
+                if(stages_left > 0 && (cumulated >= total * stage_layers.size() / nb_stages || matrices_left == stages_left)) {
+                    stage_layers.push_back(l+1);
+                }
+            }
+            return stage_layers;
+        }
+
+        int getNbStages() const {
+            return mStages.size();
+        }
+
+        /**
+         * @brief Perceptron of stage s, whose first layer is the layer
+         * getStageReports()[s].first_layer of the network
+         */
+        Perceptron<T>& getStage(int s) {
+            return *mStages[s].perceptron;
+        }
+
+        void initWeights(WeightInit init, uint64_t seed)
+        {
+            for(Stage& stage : mStages) stage.perceptron->initWeights(init, seed);
+        }
+
+        /**
+         * @brief Runs the network on each input, and stores the values of the
+         * output layer (bias excluded) in outputs
+         */
+        void run(const std::vector<std::vector<T>>& inputs, std::vector<std::vector<T>>& outputs)
+        {
+            outputs.resize(inputs.size());
+            runPipeline(inputs, nullptr, &outputs, 0.f);
+        }
+
+        /**
+         * @brief Trains the network on a mini-batch, each sample being a
+         * micro-batch of the pipeline
+         */
+        void trainMiniBatch(const std::vector<std::vector<T>>& inputs, const std::vector<std::vector<T>>& expected, const float& epsilon)
+        {
+            if(inputs.size() != expected.size()) {
+                throw std::runtime_error("PipelinePerceptron::trainMiniBatch - Training input and output size must match!");
+            }
+            runPipeline(inputs, &expected, nullptr, epsilon);
+        }
+
+        /**
+         * @brief Busy time of each stage during the last call to run or
+         * trainMiniBatch. A stage with a low utilization waits for the
+         * others: some of its layers should go to the slower stages.
+         */
+        std::vector<StageReport> getStageReports() const
+        {
+            std::vector<StageReport> reports;
+            for(size_t s=0; s < mStages.size(); s++) {
+                StageReport report;
+                report.first_layer = mStages[s].first_layer;
+                report.last_layer = mStages[s].first_layer + mStages[s].layers.size() - 1;
+                report.busy_seconds = mStages[s].busy_seconds;
+                report.utilization = (mWallSeconds > 0.) ? mStages[s].busy_seconds / mWallSeconds : 0.;
+                reports.push_back(report);
+            }
+            return reports;
+        }
+};
+
+#endif
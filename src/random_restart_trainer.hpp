@@ -0,0 +1,169 @@
+#ifndef __RANDOM_RESTART_TRAINER_HPP__
+#define __RANDOM_RESTART_TRAINER_HPP__
+
+#include "parallel_device.hpp"
+#include "perceptron.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <exception>
+#include <memory>
+#include <thread>
+#include <vector>
+
+/**
+ * RandomRestartTrainer
+ * ====================
+ *
+ * Trains R replicas of a perceptron concurrently, each from its own random
+ * weights, and keeps the first one that converges.
+ *
+ * Plain gradient descent on a small network (such as the 2-2-1 XOR network)
+ * sometimes gets stuck in a local minimum, and Perceptron::train then runs
+ * until max_iterations before giving up. Restarting from other weights
+ * usually converges quickly: running the restarts at the same time cuts the
+ * tail of the training time.
+ *
+ * Each replica is trained by Perceptron::train in its own thread, with its
+ * own command queue, on one of the devices (round robin: with a single
+ * device, the replicas share it). As soon as a replica converges, the others
+ * are told to stop, and return at their next iteration.
+ *
+ * Replica r is initialized by Perceptron::initWeights with seed + r, so a
+ * training is reproducible up to which replica converges first.
+ *
+ * How to use
+ * ----------
+ * RandomRestartTrainer<float> trainer({2, 2, 1}, devices, 8);
+ * if(trainer.train(training_in, training_out, epsilon, confidence, max_iter, seed)) {
+ *     Perceptron<float>& best = trainer.getModel();
+ *     ...
+ * }
+ **/
+template<typename T>
+class RandomRestartTrainer
+{
+    public:
+        struct Result {
+            bool converged = false;
+            // Replica that converged first
+            int replica = -1;
+            double seconds = 0.;
+        };
+
+    private:
+        struct Replica {
+            cl::CommandQueue queue;
+            cl::Kernel run;
+            cl::Kernel train_output_layer;
+            cl::Kernel train_backpropagate;
+            cl::Kernel train_update_weights;
+            std::unique_ptr<Perceptron<T>> perceptron;
+        };
+
+        std::vector<Replica> mReplicas;
+        Result mResult;
+
+    public:
+        /**
+         * @brief nb_replicas networks of the given layer sizes (bias excluded,
+         * as in Perceptron::createLayer), spread over devices
+         */
+        RandomRestartTrainer(const std::vector<int>& sizes, std::vector<ParallelDevice>& devices, int nb_replicas)
+        {
+            if(devices.empty() || nb_replicas < 1) {
+                throw std::runtime_error("RandomRestartTrainer - At least one device and one replica are needed");
+            }
+            if(sizes.size() < 2) {
+                throw std::runtime_error("RandomRestartTrainer - You must have more than one layer to train a perceptron !");
+            }
+            mReplicas.resize(nb_replicas);
+            for(int r=0; r < nb_replicas; r++) {
+                ParallelDevice& device = devices[r % devices.size()];
+                Replica& replica = mReplicas[r];
+                replica.queue = cl::CommandQueue(device.context, device.queue.getInfo<CL_QUEUE_DEVICE>());
+                replica.run = cl::Kernel(device.program, "perceptron");
+                replica.train_output_layer = cl::Kernel(device.program, "perceptron_train_output_layer");
+                replica.train_backpropagate = cl::Kernel(device.program, "perceptron_train_backpropagate");
+                replica.train_update_weights = cl::Kernel(device.program, "perceptron_train_update_weights");
+                replica.perceptron.reset(new Perceptron<T>(device.context, replica.queue));
+                replica.perceptron->useFusedTrainingKernel(cl::Kernel(device.program, "perceptron_train_backpropagate_update_weights"));
+                for(int size : sizes) replica.perceptron->createLayer(size);
+                replica.perceptron->upload();
+            }
+        }
+
+        int getNbReplicas() const {
+            return mReplicas.size();
+        }
+
+        /**
+         * @brief Trains all the replicas from new random weights, until one
+         * of them converges (see Perceptron::train), or all of them reach
+         * max_iterations. Returns whether one converged.
+         */
+        bool train(const std::vector<std::vector<T>>& training_in_values, const std::vector<std::vector<T>>& training_out_values, const float& epsilon, const float& confidence, const int& max_iterations, uint64_t seed)
+        {
+            for(size_t r=0; r < mReplicas.size(); r++) {
+                // Uploaded before the first kernel
+                mReplicas[r].perceptron->initWeights(WeightInit::Uniform, seed + r);
+            }
+
+            std::atomic<bool> stop(false);
+            std::atomic<int> winner(-1);
+            std::vector<std::exception_ptr> errors(mReplicas.size());
+            auto train_replica = [&](int r) {
+                Replica& replica = mReplicas[r];
+                try {
+                    if(replica.perceptron->train(replica.run, replica.train_output_layer, replica.train_backpropagate, replica.train_update_weights, training_in_values, training_out_values, epsilon, confidence, max_iterations, &stop)) {
+                        int none = -1;
+                        winner.compare_exchange_strong(none, r);
+                        stop = true;
+                    }
+                } catch(...) {
+                    // The other replicas would most likely fail the same way
+                    errors[r] = std::current_exception();
+                    stop = true;
+                }
+            };
+
+            const auto start = std::chrono::steady_clock::now();
+            std::vector<std::thread> threads;
+            for(size_t r=0; r < mReplicas.size(); r++) {
+                threads.push_back(std::thread(train_replica, r));
+            }
+            for(std::thread& thread : threads) thread.join();
+
+            mResult.replica = winner;
+            mResult.converged = (mResult.replica >= 0);
+            mResult.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            if(!mResult.converged) {
+                for(const std::exception_ptr& error : errors) {
+                    if(error) std::rethrow_exception(error);
+                }
+            }
+            return mResult.converged;
+        }
+
+        const Result& getResult() const {
+            return mResult;
+        }
+
+        /**
+         * @brief The replica that converged in the last call to train
+         */
+        Perceptron<T>& getModel()
+        {
+            if(!mResult.converged) throw std::runtime_error("RandomRestartTrainer::getModel - No replica has converged");
+            return *mReplicas[mResult.replica].perceptron;
+        }
+
+        /**
+         * @brief Forward kernel of the model (to run or predict with it)
+         */
+        cl::Kernel& getRunKernel() {
+            return mReplicas[mResult.converged ? mResult.replica : 0].run;
+        }
+};
+
+#endif
@@ -0,0 +1,136 @@
+#include "ring_allreduce.hpp"
+
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <stdexcept>
+#include <thread>
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace {
+
+sockaddr_un socketAddress(const std::string& path)
+{
+    sockaddr_un address;
+    std::memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if(path.size() >= sizeof(address.sun_path)) {
+        throw std::runtime_error("RingAllReduce - Socket path too long: " + path);
+    }
+    std::strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path) - 1);
+    return address;
+}
+
+std::string socketPath(const std::string& path_prefix, int rank)
+{
+    return path_prefix + "." + std::to_string(rank);
+}
+
+}
+
+RingAllReduce::RingAllReduce(const std::string& path_prefix, int rank, int nb_processes, int timeout_seconds) : mRank(rank), mNbProcesses(nb_processes), mTimeoutMs(timeout_seconds * 1000)
+{
+    if(nb_processes < 1 || rank < 0 || rank >= nb_processes) {
+        throw std::runtime_error("RingAllReduce - rank must be in [0, nb_processes)");
+    }
+    if(nb_processes == 1) return;
+
+    // Listens for the previous process
+    const std::string path = socketPath(path_prefix, rank);
+    const sockaddr_un own_address = socketAddress(path);
+    const int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(listener < 0) throw std::runtime_error("RingAllReduce - Cannot create a socket");
+    unlink(path.c_str());
+    if(bind(listener, reinterpret_cast<const sockaddr*>(&own_address), sizeof(own_address)) != 0 || listen(listener, 1) != 0) {
+        close(listener);
+        throw std::runtime_error("RingAllReduce - Cannot listen on " + path);
+    }
+
+    // Connects to the next one, which may not be listening yet
+    const sockaddr_un next_address = socketAddress(socketPath(path_prefix, (rank + 1) % nb_processes));
+    const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(timeout_seconds);
+    while(mNext < 0) {
+        const int next = socket(AF_UNIX, SOCK_STREAM, 0);
+        if(next >= 0 && connect(next, reinterpret_cast<const sockaddr*>(&next_address), sizeof(next_address)) == 0) {
+            mNext = next;
+            break;
+        }
+        if(next >= 0) close(next);
+        if(std::chrono::steady_clock::now() > deadline) {
+            close(listener);
+            unlink(path.c_str());
+            throw std::runtime_error("RingAllReduce - The next process did not start");
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+
+    pollfd incoming = {listener, POLLIN, 0};
+    if(poll(&incoming, 1, mTimeoutMs) == 1) {
+        mPrevious = accept(listener, nullptr, nullptr);
+    }
+    close(listener);
+    unlink(path.c_str());
+    if(mPrevious < 0) {
+        close(mNext);
+        throw std::runtime_error("RingAllReduce - The previous process did not connect");
+    }
+}
+
+RingAllReduce::~RingAllReduce()
+{
+    if(mNext >= 0) close(mNext);
+    if(mPrevious >= 0) close(mPrevious);
+}
+
+void RingAllReduce::sendReceive(const void* send, size_t send_bytes, void* receive, size_t receive_bytes)
+{
+    const char* send_data = static_cast<const char*>(send);
+    char* receive_data = static_cast<char*>(receive);
+    size_t sent = 0, received = 0;
+    while(sent < send_bytes || received < receive_bytes) {
+        pollfd fds[2];
+        int nb_fds = 0;
+        int send_fd = -1, receive_fd = -1;
+        if(sent < send_bytes) {
+            send_fd = nb_fds;
+            fds[nb_fds++] = {mNext, POLLOUT, 0};
+        }
+        if(received < receive_bytes) {
+            receive_fd = nb_fds;
+            fds[nb_fds++] = {mPrevious, POLLIN, 0};
+        }
+        const int ready = poll(fds, nb_fds, mTimeoutMs);
+        if(ready < 0 && errno == EINTR) continue;
+        if(ready <= 0) throw std::runtime_error("RingAllReduce - Timeout while exchanging with the other processes");
+
+        if(send_fd >= 0 && (fds[send_fd].revents & (POLLOUT | POLLERR | POLLHUP))) {
+            const ssize_t count = ::send(mNext, send_data + sent, send_bytes - sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+            if(count < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                throw std::runtime_error("RingAllReduce - The next process left");
+            }
+            if(count > 0) {
+                sent += count;
+                mStats.bytes_sent += count;
+            }
+        }
+        if(receive_fd >= 0 && (fds[receive_fd].revents & (POLLIN | POLLERR | POLLHUP))) {
+            const ssize_t count = recv(mPrevious, receive_data + received, receive_bytes - received, MSG_DONTWAIT);
+            if(count == 0 || (count < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+                throw std::runtime_error("RingAllReduce - The previous process left");
+            }
+            if(count > 0) {
+                received += count;
+                mStats.bytes_received += count;
+            }
+        }
+    }
+}
+
+double RingAllReduce::now() const
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
@@ -0,0 +1,166 @@
+#ifndef __RING_ALLREDUCE_HPP__
+#define __RING_ALLREDUCE_HPP__
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/**
+ * RingAllReduce
+ * =============
+ *
+ * Sums arrays across the processes of a host (synchronous data-parallel
+ * training, see DataParallelTrainer), over Unix domain sockets.
+ *
+ * The processes form a ring: each one sends to the next (rank+1) and
+ * receives from the previous one (rank-1). An array is split into as many
+ * chunks as processes, and summed in two passes around the ring
+ * (reduce-scatter, then all-gather), so that each process sends and receives
+ * 2 (N-1)/N times the array, whatever the number N of processes. Sending and
+ * receiving are interleaved as data arrives, so large chunks stream through
+ * the ring.
+ * All the processes get bitwise identical sums.
+ *
+ * All the processes must be started with the same path prefix and number of
+ * processes, and call allReduce in the same order with the same sizes.
+ *
+ * How to use
+ * ----------
+ * In each of the N processes (rank in [0, N)):
+ * RingAllReduce ring("/tmp/training", rank, N);
+ * ring.allReduce(gradients.data(), gradients.size());
+ */
+class RingAllReduce
+{
+    public:
+        struct Stats {
+            size_t bytes_sent = 0;
+            size_t bytes_received = 0;
+            // Time spent in allReduce
+            double seconds = 0.;
+        };
+
+        /**
+         * @brief Connects to the neighbours in the ring: the socket of each
+         * process is path_prefix.rank. Waits up to timeout_seconds for the
+         * other processes (and for each transfer).
+         */
+        RingAllReduce(const std::string& path_prefix, int rank, int nb_processes, int timeout_seconds = 60);
+        ~RingAllReduce();
+
+        RingAllReduce(const RingAllReduce&) = delete;
+        RingAllReduce& operator=(const RingAllReduce&) = delete;
+
+        int getRank() const {
+            return mRank;
+        }
+
+        int getNbProcesses() const {
+            return mNbProcesses;
+        }
+
+        /**
+         * @brief Replaces data by its sum over all the processes
+         */
+        template<typename T>
+        void allReduce(T* data, size_t count);
+
+        /**
+         * @brief Concatenates the arrays of all the processes, in the order of
+         * their ranks, into gathered. The arrays may have different sizes:
+         * counts receives them.
+         */
+        template<typename T>
+        void allGather(const T* data, size_t count, std::vector<T>& gathered, std::vector<size_t>& counts);
+
+        /**
+         * @brief Same as allGather, when the sizes of the arrays of all the
+         * processes are already known (eg. from a previous allGather): saves
+         * the exchange of the sizes. data holds counts[getRank()] values.
+         */
+        template<typename T>
+        void allGather(const T* data, const std::vector<size_t>& counts, std::vector<T>& gathered);
+
+        const Stats& getStats() const {
+            return mStats;
+        }
+
+    private:
+        int mRank;
+        int mNbProcesses;
+        int mTimeoutMs;
+        // Sockets to the next and from the previous process
+        int mNext = -1;
+        int mPrevious = -1;
+        Stats mStats;
+
+        /**
+         * @brief Sends send_bytes to the next process while receiving
+         * receive_bytes from the previous one
+         */
+        void sendReceive(const void* send, size_t send_bytes, void* receive, size_t receive_bytes);
+
+        double now() const;
+};
+
+template<typename T>
+void RingAllReduce::allReduce(T* data, size_t count)
+{
+    if(mNbProcesses == 1) return;
+    const double start = now();
+    const int n = mNbProcesses;
+    auto chunk_begin = [&](int chunk) { return count * chunk / n; };
+    auto chunk_size = [&](int chunk) { return chunk_begin(chunk+1) - chunk_begin(chunk); };
+    std::vector<T> received(count / n + 1);
+
+    // Reduce-scatter: after n-1 steps, the process holds the sum of the
+    // chunk rank+1
+    for(int step=0; step < n-1; step++) {
+        const int send_chunk = (mRank - step + n) % n;
+        const int receive_chunk = (mRank - step - 1 + 2*n) % n;
+        sendReceive(data + chunk_begin(send_chunk), sizeof(T) * chunk_size(send_chunk), received.data(), sizeof(T) * chunk_size(receive_chunk));
+        T* sum = data + chunk_begin(receive_chunk);
+        for(size_t i=0; i < chunk_size(receive_chunk); i++) sum[i] += received[i];
+    }
+    // All-gather of the summed chunks
+    for(int step=0; step < n-1; step++) {
+        const int send_chunk = (mRank - step + 1 + n) % n;
+        const int receive_chunk = (mRank - step + n) % n;
+        sendReceive(data + chunk_begin(send_chunk), sizeof(T) * chunk_size(send_chunk), data + chunk_begin(receive_chunk), sizeof(T) * chunk_size(receive_chunk));
+    }
+    mStats.seconds += now() - start;
+}
+
+template<typename T>
+void RingAllReduce::allGather(const T* data, size_t count, std::vector<T>& gathered, std::vector<size_t>& counts)
+{
+    const int n = mNbProcesses;
+    std::vector<uint64_t> sizes(n, 0);
+    sizes[mRank] = count;
+    allReduce(sizes.data(), sizes.size());
+    counts.assign(sizes.begin(), sizes.end());
+    allGather(data, counts, gathered);
+}
+
+template<typename T>
+void RingAllReduce::allGather(const T* data, const std::vector<size_t>& counts, std::vector<T>& gathered)
+{
+    const int n = mNbProcesses;
+    const double start = now();
+    std::vector<size_t> offsets(n+1, 0);
+    for(int p=0; p < n; p++) offsets[p+1] = offsets[p] + counts[p];
+    gathered.resize(offsets[n]);
+    std::copy(data, data + counts[mRank], gathered.begin() + offsets[mRank]);
+
+    // At step s, the array of rank-s moves one process further
+    for(int step=0; step < n-1; step++) {
+        const int send_array = (mRank - step + n) % n;
+        const int receive_array = (mRank - step - 1 + 2*n) % n;
+        sendReceive(gathered.data() + offsets[send_array], sizeof(T) * counts[send_array], gathered.data() + offsets[receive_array], sizeof(T) * counts[receive_array]);
+    }
+    mStats.seconds += now() - start;
+}
+
+#endif
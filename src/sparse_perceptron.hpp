@@ -0,0 +1,315 @@
+#ifndef __SPARSE_PERCEPTRON_HPP__
+#define __SPARSE_PERCEPTRON_HPP__
+
+#include "perceptron.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+/**
+ * SparsePerceptron
+ * ================
+ *
+ * Fully-connected perceptron whose weights have been pruned: each weight
+ * matrix only stores its non-zero weights, in CSR form (see the
+ * perceptron_sparse kernels). Forward pass, backpropagation and weight
+ * update skip the pruned weights, so the cost of a layer is proportional to
+ * its number of non-zero weights.
+ *
+ * A sparse perceptron is built from a trained dense Perceptron by magnitude
+ * pruning: in each weight matrix, the given fraction of the weights with the
+ * lowest absolute value is removed. Bias weights are always kept.
+ * It can then be fine-tuned with trainStep(); pruned weights stay pruned.
+ *
+ * How to use
+ * ----------
+ * Perceptron<float> dense(context, queue);
+ * ... create layers, train ...
+ * SparsePerceptron<float> sparse(dense, 0.9, context, queue, program);
+ * sparse.setInputValues(...);
+ * sparse.run();
+ * const std::vector<float>& out = sparse.readOutputValues();
+ **/
+template<typename T>
+class SparsePerceptron
+{
+    private:
+        /**
+         * A layer of neurons, and the sparse weights to the next one.
+         * Sizes include the bias neuron, whose value is always 1.
+         */
+        struct Layer {
+            cl_int size = 0;
+            std::vector<T> values;
+            cl::Buffer buf_values;
+            cl::Buffer buf_delta;
+
+            // Weights to the next layer, one row per neuron of the next
+            // layer (bias excluded)
+            cl_int rows = 0;
+            std::vector<cl_int> row_ptr;
+            std::vector<cl_int> col_idx;
+            std::vector<T> weights;
+            // CSC view: col_ptr, csc_row, and position in weights
+            std::vector<cl_int> col_ptr;
+            std::vector<cl_int> csc_row;
+            std::vector<cl_int> csc_pos;
+
+            cl::Buffer buf_row_ptr;
+            cl::Buffer buf_col_idx;
+            cl::Buffer buf_weights;
+            cl::Buffer buf_col_ptr;
+            cl::Buffer buf_csc_row;
+            cl::Buffer buf_csc_pos;
+
+            // Kernels with their arguments bound
+            cl::Kernel run;
+            cl::Kernel backpropagate;
+            cl::Kernel update;
+        };
+
+        cl::Context mContext;
+        cl::CommandQueue mQueue;
+        std::vector<Layer> mLayers;
+        std::vector<T> mOutputValues;
+        cl::Buffer mExpectedOutBuf;
+        cl::Kernel mTrainOutputLayerKernel;
+        float mEpsilon = 0.f;
+
+        template<typename V>
+        cl::Buffer createBuffer(cl_mem_flags flags, const std::vector<V>& data) {
+            // Empty buffers are not allowed
+            cl::Buffer buf(mContext, flags, sizeof(V) * std::max<size_t>(data.size(), 1));
+            if(!data.empty()) mQueue.enqueueWriteBuffer(buf, CL_TRUE, 0, sizeof(V) * data.size(), data.data());
+            return buf;
+        }
+
+        /**
+         * @brief Keeps the weights of the dense matrix (rows x cols, row-major)
+         * but the sparsity fraction of lowest magnitude, and bias weights.
+         * Ties are broken by position, so that exactly that fraction is
+         * pruned.
+         */
+        static void prune(Layer& layer, const T* dense, cl_int rows, cl_int cols, const float& sparsity)
+        {
+            // Positions of the weights in dense, bias excluded
+            std::vector<size_t> ranks;
+            ranks.reserve(static_cast<size_t>(rows) * (cols-1));
+            for(int k=0; k < rows; k++) {
+                for(int i=0; i < cols-1; i++) {
+                    ranks.push_back(i + static_cast<size_t>(cols)*k);
+                }
+            }
+            std::vector<bool> kept(static_cast<size_t>(rows) * cols, true);
+            const size_t pruned = static_cast<size_t>(sparsity * ranks.size());
+            if(pruned > 0) {
+                auto lower = [dense](size_t a, size_t b) {
+                    const T wa = std::fabs(dense[a]), wb = std::fabs(dense[b]);
+                    return wa < wb || (wa == wb && a < b);
+                };
+                std::nth_element(ranks.begin(), ranks.begin() + (pruned-1), ranks.end(), lower);
+                for(size_t j=0; j < pruned; j++) kept[ranks[j]] = false;
+            }
+
+            layer.rows = rows;
+            layer.row_ptr.assign(1, 0);
+            for(int k=0; k < rows; k++) {
+                for(int i=0; i < cols; i++) {
+                    const T w = dense[i + cols*k];
+                    if(kept[i + static_cast<size_t>(cols)*k]) {
+                        layer.col_idx.push_back(i);
+                        layer.weights.push_back(w);
+                    }
+                }
+                layer.row_ptr.push_back(layer.weights.size());
+            }
+
+            // CSC view of the same weights
+            layer.col_ptr.assign(cols+1, 0);
+            for(cl_int i : layer.col_idx) layer.col_ptr[i+1]++;
+            for(int i=0; i < cols; i++) layer.col_ptr[i+1] += layer.col_ptr[i];
+            layer.csc_row.resize(layer.weights.size());
+            layer.csc_pos.resize(layer.weights.size());
+            std::vector<cl_int> next = layer.col_ptr;
+            for(int k=0; k < rows; k++) {
+                for(int j=layer.row_ptr[k]; j < layer.row_ptr[k+1]; j++) {
+                    const int position = next[layer.col_idx[j]]++;
+                    layer.csc_row[position] = k;
+                    layer.csc_pos[position] = j;
+                }
+            }
+        }
+
+    public:
+        /**
+         * @brief Prunes the weights of dense, and uploads the result.
+         *
+         * @param sparsity
+         *      Fraction of the (non-bias) weights to remove from each weight
+         *      matrix, in [0, 1]
+         * @param program
+         *      Program built from perceptron_layer.cl
+         */
+        SparsePerceptron(Perceptron<T>& dense, const float& sparsity, cl::Context& context, cl::CommandQueue& queue, cl::Program& program) : mContext(context), mQueue(queue)
+        {
+            if(sparsity < 0.f || sparsity > 1.f) {
+                throw std::runtime_error("SparsePerceptron - sparsity must be in [0, 1]");
+            }
+            if(dense.getFirstLayer() == nullptr || dense.getFirstLayer()->getNextLayer() == nullptr) {
+                throw std::runtime_error("SparsePerceptron - You must have more than one layer to prune a perceptron !");
+            }
+            dense.enqueueReadAllBuffers();
+
+            for(NeuronLayer<T>* dense_layer = dense.getFirstLayer(); dense_layer != nullptr; dense_layer = dense_layer->getNextLayer()) {
+                Layer layer;
+                layer.size = dense_layer->getSize();
+                layer.values.assign(layer.size, 0);
+                layer.values[layer.size-1] = 1;
+                if(dense_layer->getNextLayer() != nullptr) {
+                    prune(layer, dense_layer->getWeights(), dense_layer->getNextLayer()->getSize()-1, layer.size, sparsity);
+                }
+                mLayers.push_back(layer);
+            }
+
+            mTrainOutputLayerKernel = cl::Kernel(program, "perceptron_train_output_layer");
+            for(size_t l=0; l < mLayers.size(); l++) {
+                Layer& layer = mLayers[l];
+                layer.buf_values = createBuffer(CL_MEM_READ_WRITE, layer.values);
+                layer.buf_delta = cl::Buffer(mContext, CL_MEM_READ_WRITE, sizeof(T) * layer.size);
+            }
+            mExpectedOutBuf = cl::Buffer(mContext, CL_MEM_READ_ONLY, sizeof(T) * (mLayers.back().size-1));
+
+            for(size_t l=0; l+1 < mLayers.size(); l++) {
+                Layer& layer = mLayers[l];
+                Layer& next = mLayers[l+1];
+                layer.buf_row_ptr = createBuffer(CL_MEM_READ_ONLY, layer.row_ptr);
+                layer.buf_col_idx = createBuffer(CL_MEM_READ_ONLY, layer.col_idx);
+                layer.buf_weights = createBuffer(CL_MEM_READ_WRITE, layer.weights);
+                layer.buf_col_ptr = createBuffer(CL_MEM_READ_ONLY, layer.col_ptr);
+                layer.buf_csc_row = createBuffer(CL_MEM_READ_ONLY, layer.csc_row);
+                layer.buf_csc_pos = createBuffer(CL_MEM_READ_ONLY, layer.csc_pos);
+
+                layer.run = cl::Kernel(program, "perceptron_sparse");
+                layer.run.setArg(0, layer.buf_row_ptr);
+                layer.run.setArg(1, layer.buf_col_idx);
+                layer.run.setArg(2, layer.buf_weights);
+                layer.run.setArg(3, layer.buf_values);
+                layer.run.setArg(4, next.buf_values);
+
+                layer.backpropagate = cl::Kernel(program, "perceptron_sparse_train_backpropagate");
+                layer.backpropagate.setArg(0, layer.buf_col_ptr);
+                layer.backpropagate.setArg(1, layer.buf_csc_row);
+                layer.backpropagate.setArg(2, layer.buf_csc_pos);
+                layer.backpropagate.setArg(3, layer.buf_weights);
+                layer.backpropagate.setArg(4, layer.buf_values);
+                layer.backpropagate.setArg(5, next.buf_delta);
+                layer.backpropagate.setArg(6, layer.buf_delta);
+
+                layer.update = cl::Kernel(program, "perceptron_sparse_train_update_weights");
+                layer.update.setArg(0, mEpsilon);
+                layer.update.setArg(1, layer.buf_row_ptr);
+                layer.update.setArg(2, layer.buf_col_idx);
+                layer.update.setArg(3, layer.buf_values);
+                layer.update.setArg(4, next.buf_delta);
+                layer.update.setArg(5, layer.buf_weights);
+            }
+            mTrainOutputLayerKernel.setArg(0, mLayers.back().buf_values);
+            mTrainOutputLayerKernel.setArg(1, mExpectedOutBuf);
+            mTrainOutputLayerKernel.setArg(2, mLayers.back().buf_delta);
+        }
+
+        /**
+         * @brief Number of stored weights, over all layers
+         */
+        size_t getNbNonZeroWeights() const {
+            size_t count = 0;
+            for(const auto& layer : mLayers) count += layer.weights.size();
+            return count;
+        }
+
+        void setInputValues(const std::vector<T>& values)
+        {
+            Layer& input = mLayers.front();
+            if(values.size() != static_cast<size_t>(input.size-1)) {
+                throw std::runtime_error("SparsePerceptron::setInputValues - input size must match the first layer size!");
+            }
+            std::copy(values.begin(), values.end(), input.values.begin());
+            mQueue.enqueueWriteBuffer(input.buf_values, CL_TRUE, 0, sizeof(T)*values.size(), input.values.data());
+        }
+
+        void run()
+        {
+            for(size_t l=0; l+1 < mLayers.size(); l++) {
+                mQueue.enqueueNDRangeKernel(mLayers[l].run, cl::NullRange, cl::NDRange(mLayers[l].rows), cl::NullRange);
+            }
+            if(mQueue.finish() != CL_SUCCESS) {
+                throw std::runtime_error("SparsePerceptron::run - command queue failed to execute");
+            }
+        }
+
+        /**
+         * @brief Reads the values of the output layer (bias excluded)
+         */
+        const std::vector<T>& readOutputValues()
+        {
+            const Layer& output = mLayers.back();
+            mOutputValues.resize(output.size-1);
+            mQueue.enqueueReadBuffer(output.buf_values, CL_TRUE, 0, sizeof(T)*mOutputValues.size(), mOutputValues.data());
+            return mOutputValues;
+        }
+
+        /**
+         * @brief Reads the pruned weights back into the host arrays
+         * (see getWeights)
+         */
+        void enqueueReadWeights()
+        {
+            for(size_t l=0; l+1 < mLayers.size(); l++) {
+                Layer& layer = mLayers[l];
+                mQueue.enqueueReadBuffer(layer.buf_weights, CL_TRUE, 0, sizeof(T)*layer.weights.size(), layer.weights.data());
+            }
+        }
+
+        /**
+         * @brief Non-zero weights between layer and the next one, in CSR
+         * order (see getRowPointers and getColumnIndices)
+         */
+        const std::vector<T>& getWeights(int layer) const { return mLayers[layer].weights; }
+        const std::vector<cl_int>& getRowPointers(int layer) const { return mLayers[layer].row_ptr; }
+        const std::vector<cl_int>& getColumnIndices(int layer) const { return mLayers[layer].col_idx; }
+
+        /**
+         * @brief Trains the network on one sample
+         */
+        void trainStep(const std::vector<T>& training_in, const std::vector<T>& training_out, const float& epsilon)
+        {
+            if(epsilon != mEpsilon) {
+                mEpsilon = epsilon;
+                for(size_t l=0; l+1 < mLayers.size(); l++) mLayers[l].update.setArg(0, mEpsilon);
+            }
+            const int n = mLayers.size();
+            if(training_out.size() != static_cast<size_t>(mLayers.back().size-1)) {
+                throw std::runtime_error("SparsePerceptron::trainStep - Expected output size must match the output layer size!");
+            }
+
+            setInputValues(training_in);
+            mQueue.enqueueWriteBuffer(mExpectedOutBuf, CL_FALSE, 0, sizeof(T)*training_out.size(), training_out.data());
+            for(int l=0; l < n-1; l++) {
+                mQueue.enqueueNDRangeKernel(mLayers[l].run, cl::NullRange, cl::NDRange(mLayers[l].rows), cl::NullRange);
+            }
+            mQueue.enqueueNDRangeKernel(mTrainOutputLayerKernel, cl::NullRange, cl::NDRange(mLayers.back().size-1), cl::NullRange);
+            // The delta of the input layer is never used
+            for(int l=n-2; l >= 1; l--) {
+                mQueue.enqueueNDRangeKernel(mLayers[l].backpropagate, cl::NullRange, cl::NDRange(mLayers[l].size-1), cl::NullRange);
+            }
+            for(int l=0; l < n-1; l++) {
+                mQueue.enqueueNDRangeKernel(mLayers[l].update, cl::NullRange, cl::NDRange(mLayers[l].rows), cl::NullRange);
+            }
+            if(mQueue.finish() != CL_SUCCESS) {
+                throw std::runtime_error("SparsePerceptron::trainStep - command queue failed to execute");
+            }
+        }
+};
+
+#endif
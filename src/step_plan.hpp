@@ -0,0 +1,300 @@
+#ifndef __STEP_PLAN_HPP__
+#define __STEP_PLAN_HPP__
+
+#include "perceptron_layer.hpp"
+#include "buffer_pool.hpp"
+
+#include <memory>
+#include <vector>
+
+/**
+ * StepPlan
+ * ========
+ *
+ * Precompiled inference and training step of a perceptron.
+ *
+ * NeuronLayer::enqueueRun and the training functions bind all of the kernel
+ * arguments on every call, although they never change between iterations.
+ * For small networks, this host overhead dominates.
+ * A StepPlan resolves everything once for a given topology: each layer and
+ * stage gets its own cl::Kernel instance with its arguments bound (and its
+ * tuned variant and local size, see WorkGroupTuner). Running the network or a
+ * training step is then just a sequence of enqueues.
+ *
+ * The plan also holds the device buffers used for training (delta of each
+ * layer and expected output). They come from the BufferPool of the context,
+ * and go back to it when the plan is destroyed, so that rebuilding a plan (or
+ * building the plan of another model) does not create buffers again. The
+ * plan first waits for the queues its buffers are used on (see addQueue).
+ *
+ * The plan must be rebuilt when the topology or the device buffers of the
+ * layers change (Perceptron::getStepPlan takes care of it).
+ *
+ * Stages are indexed by layer (0 is the input layer):
+ * - forward l computes the values of layer l+1 from the values of layer l
+ * - the output delta is computed for the last layer
+ * - backpropagate l computes the delta of layer l, for 1 <= l < last
+ * - update l updates the weights of layer l (between layer l and l+1)
+ * - with a fused kernel (see useFusedKernel), backpropagate-update l does
+ *   both the backpropagation into layer l and the update of its weights
+ */
+template<typename T>
+class StepPlan
+{
+    typedef NeuronLayer<T> NLayer;
+
+    private:
+        cl::CommandQueue mQueue;
+        // Other queues running the stages, finished before the buffers are
+        // given back
+        std::vector<cl::CommandQueue> mQueues;
+        std::shared_ptr<BufferPool> mPool;
+        std::vector<NLayer*> mLayers;
+        std::vector<PooledBuffer> mDeltaBufs;
+        PooledBuffer mExpectedOutBuf;
+
+        // Kernels used to build the plan
+        cl::Kernel mKernel;
+        cl::Kernel mTrainOutputLayerKernel;
+        cl::Kernel mTrainBackpropagateKernel;
+        cl::Kernel mTrainUpdateWeightsKernel;
+        float mEpsilon;
+
+        std::vector<BoundKernel> mForward;
+        BoundKernel mOutputDelta;
+        std::vector<BoundKernel> mBackpropagate;
+        std::vector<BoundKernel> mUpdate;
+
+        // Optional fused backpropagation and weight update
+        bool mFused = false;
+        cl::Kernel mFusedKernel;
+        std::vector<BoundKernel> mBackpropagateUpdate;
+
+        void prepareFused()
+        {
+            const int n = mLayers.size();
+            mBackpropagateUpdate.resize(n-1);
+            for(int l=0; l < n-1; l++) {
+                mBackpropagateUpdate[l] = mLayers[l]->prepareTrainBackpropagateUpdateWeights(mFusedKernel, mDeltaBufs[l].get(), mDeltaBufs[l+1].get(), mEpsilon);
+            }
+        }
+
+        void check(cl_int status, const char* what) const {
+            if(status != CL_SUCCESS) throw std::runtime_error(std::string("StepPlan::") + what + " - Error running kernel");
+        }
+
+    public:
+        StepPlan(cl::Context& context, const cl::CommandQueue& queue, NLayer* first_layer, const cl::Kernel& kernel, const cl::Kernel& train_output_layer_kernel, const cl::Kernel& train_backpropagate_kernel, const cl::Kernel& train_update_weights_kernel, const float& epsilon) : mQueue(queue), mPool(BufferPool::sharedForContext(context)), mKernel(kernel), mTrainOutputLayerKernel(train_output_layer_kernel), mTrainBackpropagateKernel(train_backpropagate_kernel), mTrainUpdateWeightsKernel(train_update_weights_kernel), mEpsilon(epsilon)
+        {
+            NLayer* layer = first_layer;
+            while(layer != nullptr) {
+                mLayers.push_back(layer);
+                mDeltaBufs.push_back(PooledBuffer(mPool, sizeof(T) * layer->getSize(), CL_MEM_READ_WRITE));
+                // A recycled buffer holds the deltas of its previous user
+                mQueue.enqueueFillBuffer(mDeltaBufs.back().get(), T(0), 0, sizeof(T) * layer->getSize());
+                layer = layer->getNextLayer();
+            }
+            // The stages may run on other queues (see addQueue)
+            mQueue.finish();
+            if(mLayers.size() < 2) {
+                throw std::runtime_error("StepPlan - You must have more than one layer to build a plan !");
+            }
+            mExpectedOutBuf = PooledBuffer(mPool, sizeof(T) * (getOutputLayer()->getSize()-1), CL_MEM_READ_ONLY);
+
+            const int n = mLayers.size();
+            mForward.resize(n-1);
+            mBackpropagate.resize(n-1);
+            for(int l=0; l < n-1; l++) {
+                mForward[l] = mLayers[l]->prepareRun(kernel);
+                if(l >= 1) mBackpropagate[l] = mLayers[l]->prepareTrainBackpropagate(train_backpropagate_kernel, mDeltaBufs[l].get(), mDeltaBufs[l+1].get());
+            }
+            mOutputDelta = getOutputLayer()->prepareTrainOutputLayer(train_output_layer_kernel, mExpectedOutBuf.get(), mDeltaBufs[n-1].get());
+            setEpsilon(epsilon);
+        }
+
+        StepPlan(const StepPlan&) = delete;
+        StepPlan& operator=(const StepPlan&) = delete;
+
+        ~StepPlan()
+        {
+            // The buffers may be handed out again as soon as they are released
+            mQueue.finish();
+            for(cl::CommandQueue& queue : mQueues) queue.finish();
+        }
+
+        /**
+         * @brief Registers another queue the stages of the plan are enqueued
+         * on (see Perceptron::setConcurrentQueues)
+         */
+        void addQueue(const cl::CommandQueue& queue)
+        {
+            if(queue() == mQueue()) return;
+            for(const cl::CommandQueue& known : mQueues) {
+                if(known() == queue()) return;
+            }
+            mQueues.push_back(queue);
+        }
+
+        /**
+         * @brief True if the plan was built from these kernels
+         */
+        bool uses(const cl::Kernel& kernel, const cl::Kernel& train_output_layer_kernel, const cl::Kernel& train_backpropagate_kernel, const cl::Kernel& train_update_weights_kernel) const
+        {
+            return kernel() == mKernel() && train_output_layer_kernel() == mTrainOutputLayerKernel()
+                && train_backpropagate_kernel() == mTrainBackpropagateKernel() && train_update_weights_kernel() == mTrainUpdateWeightsKernel();
+        }
+
+        /**
+         * @brief Rebinds the update kernels (only if epsilon changed)
+         */
+        void setEpsilon(const float& epsilon)
+        {
+            if(epsilon == mEpsilon && mUpdate.size() > 0) return;
+            mEpsilon = epsilon;
+            const int n = mLayers.size();
+            mUpdate.resize(n-1);
+            for(int l=0; l < n-1; l++) {
+                mUpdate[l] = mLayers[l+1]->prepareTrainUpdateWeights(mTrainUpdateWeightsKernel, mDeltaBufs[l+1].get(), epsilon);
+            }
+            if(mFused) prepareFused();
+        }
+
+        /**
+         * @brief Trains with fused_kernel
+         * (perceptron_train_backpropagate_update_weights), which reads each
+         * weight matrix once per step instead of twice.
+         */
+        void useFusedKernel(const cl::Kernel& fused_kernel)
+        {
+            if(mFused && fused_kernel() == mFusedKernel()) return;
+            mFusedKernel = fused_kernel;
+            mFused = true;
+            prepareFused();
+        }
+
+        void disableFusedKernel()
+        {
+            mFused = false;
+            mBackpropagateUpdate.clear();
+        }
+
+        bool isFused() const {
+            return mFused;
+        }
+
+        int getNbLayers() const {
+            return mLayers.size();
+        }
+
+        NLayer* getOutputLayer() const {
+            return mLayers.back();
+        }
+
+        cl::Buffer& getDeltaBuf(int layer) {
+            return mDeltaBufs[layer].get();
+        }
+
+        cl::Buffer& getExpectedOutputBuf() {
+            return mExpectedOutBuf.get();
+        }
+
+        void enqueueForward(int layer, const LaunchOrder& order = LaunchOrder()) {
+            check(mLayers[layer]->enqueueBound(mForward[layer], order), "enqueueForward");
+        }
+
+        /**
+         * @brief Replaces the output delta of the training steps by bound,
+         * which must compute the same delta (see LossTracker)
+         */
+        void setOutputDelta(const BoundKernel& bound) {
+            mOutputDelta = bound;
+        }
+
+        /**
+         * @brief Restores the output delta of perceptron_train_output_layer
+         */
+        void resetOutputDelta() {
+            const int n = mLayers.size();
+            mOutputDelta = getOutputLayer()->prepareTrainOutputLayer(mTrainOutputLayerKernel, mExpectedOutBuf.get(), mDeltaBufs[n-1].get());
+        }
+
+        void enqueueOutputDelta(const LaunchOrder& order = LaunchOrder()) {
+            check(getOutputLayer()->enqueueBound(mOutputDelta, order), "enqueueOutputDelta");
+        }
+
+        void enqueueBackpropagate(int layer, const LaunchOrder& order = LaunchOrder()) {
+            check(mLayers[layer]->enqueueBound(mBackpropagate[layer], order), "enqueueBackpropagate");
+        }
+
+        void enqueueUpdateWeights(int layer, const LaunchOrder& order = LaunchOrder()) {
+            check(mLayers[layer+1]->enqueueBound(mUpdate[layer], order), "enqueueUpdateWeights");
+        }
+
+        void enqueueBackpropagateUpdateWeights(int layer, const LaunchOrder& order = LaunchOrder()) {
+            if(!mFused) throw std::runtime_error("StepPlan::enqueueBackpropagateUpdateWeights - No fused kernel");
+            check(mLayers[layer]->enqueueBound(mBackpropagateUpdate[layer], order), "enqueueBackpropagateUpdateWeights");
+        }
+
+        /**
+         * @brief Runs the network on the values of the first layer (already
+         * on the device), and waits for the result.
+         */
+        void enqueueRun()
+        {
+            for(int l=0; l < getNbLayers()-1; l++) {
+                enqueueForward(l, LaunchOrder::inOrder(&mQueue));
+            }
+            mQueue.finish();
+        }
+
+        /**
+         * @brief Enqueues the stages of a training step on the sample already
+         * in the input layer and the expected output buffer (see EpochSampler):
+         * forward pass, delta of the output layer, back propagation and
+         * update of the weights
+         */
+        void enqueueTrainStages(const LaunchOrder& order)
+        {
+            const int n = getNbLayers();
+            for(int l=0; l < n-1; l++) {
+                enqueueForward(l, order);
+            }
+            enqueueOutputDelta(order);
+            if(mFused) {
+                for(int l=n-2; l >= 0; l--) {
+                    enqueueBackpropagateUpdateWeights(l, order);
+                }
+            } else {
+                for(int l=n-2; l >= 1; l--) {
+                    enqueueBackpropagate(l, order);
+                }
+                for(int l=0; l < n-1; l++) {
+                    enqueueUpdateWeights(l, order);
+                }
+            }
+        }
+
+        /**
+         * @brief Uploads one sample and enqueues its training stages (see
+         * enqueueTrainStages) on the (in-order) queue of the plan, and waits
+         * for their completion.
+         */
+        void enqueueTrainStep(const std::vector<T>& training_in, const std::vector<T>& training_out)
+        {
+            const LaunchOrder order = LaunchOrder::inOrder(&mQueue);
+            if(training_out.size() != static_cast<size_t>(getOutputLayer()->getSize()-1)) {
+                throw std::runtime_error("StepPlan::enqueueTrainStep - Expected output size must match the output layer size!");
+            }
+
+            mLayers[0]->setValues(training_in);
+            mLayers[0]->uploadInputValues(order);
+            mQueue.enqueueWriteBuffer(mExpectedOutBuf.get(), CL_FALSE, 0, sizeof(T)*training_out.size(), training_out.data());
+
+            enqueueTrainStages(order);
+            if(mQueue.finish() != CL_SUCCESS) {
+                throw std::runtime_error("StepPlan::enqueueTrainStep - command queue failed to execute");
+            }
+        }
+};
+
+#endif
@@ -0,0 +1,435 @@
+#ifndef __STREAMED_PERCEPTRON_HPP__
+#define __STREAMED_PERCEPTRON_HPP__
+
+#include "perceptron_layer.hpp"
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+/**
+ * StreamedPerceptron
+ * ==================
+ *
+ * Fully-connected perceptron whose weights do not fit in the device memory
+ * (CL_DEVICE_GLOBAL_MEM_SIZE or CL_DEVICE_MAX_MEM_ALLOC_SIZE, on which
+ * NeuronLayer::createBuffers fails).
+ *
+ * The weights stay in host memory, or in a model file mapped in memory, with
+ * the layout of the NeuronLayer weights: for each pair of consecutive layers,
+ * a row-major matrix of (next layer size) x (layer size) weights, bias
+ * included. Only the values and the deltas of the neurons live on the device.
+ *
+ * Weight matrices are streamed by tiles of consecutive rows through a ring of
+ * device buffers (see the perceptron_streamed kernels). Uploads go to a
+ * transfer queue and kernels to the compute queue, synchronized by events:
+ * while tile i is computed, tiles i+1 .. i+ring_size-2 are uploaded. During
+ * training, each tile is updated in place on the device, then written back
+ * to the host before its slot of the ring is reused.
+ * A training step reads the weights twice (forward pass, then fused
+ * backpropagation and update) and writes them once.
+ *
+ * The kernels rely on the order of the compute queue (the tiles of a layer
+ * accumulate into the same sums, each layer reads the values of the previous
+ * one), which must be in-order. The transfers only overlap the kernels when
+ * the transfer queue is a second queue of the same device; with a single
+ * queue, the results are the same.
+ *
+ * How to use
+ * ----------
+ * StreamedPerceptron<float> p({100000, 50000, 10}, context, queue, transfer_queue, program);
+ * p.initWeights(WeightInit::Xavier, seed);
+ * p.trainStep(input, expected_output, epsilon);
+ * p.setInputValues(...);
+ * p.run();
+ * const std::vector<float>& out = p.readOutputValues();
+ **/
+template<typename T>
+class StreamedPerceptron
+{
+    public:
+        // Upload granularity, when none is given
+        static const size_t DEFAULT_TILE_BYTES = 64 << 20;
+
+    private:
+        /**
+         * A layer of neurons, and the weights to the next one.
+         * Sizes include the bias neuron, whose value is always 1.
+         */
+        struct Layer {
+            cl_int size = 0;
+            cl::Buffer buf_values;
+            cl::Buffer buf_delta;
+            // Backpropagated sums, accumulated over the tiles
+            cl::Buffer buf_sum;
+
+            // Host weights to the next layer (next size x size), and number
+            // of rows computed (the bias of the next layer has no weights)
+            T* weights = nullptr;
+            cl_int rows = 0;
+            cl_int tile_rows = 0;
+        };
+
+        /**
+         * Device buffer of the ring
+         */
+        struct Slot {
+            cl::Buffer buffer;
+            // Upload of the tile the buffer holds
+            cl::Event uploaded;
+            // Last command using the tile, the next upload waits for it
+            cl::Event released;
+        };
+
+        cl::Context mContext;
+        cl::CommandQueue mQueue;
+        cl::CommandQueue mTransferQueue;
+        std::vector<Layer> mLayers;
+        std::vector<Slot> mRing;
+        size_t mNextSlot = 0;
+
+        // Storage of the weights of all layers
+        T* mWeights = nullptr;
+        size_t mNbWeights = 0;
+        bool mMapped = false;
+
+        std::vector<T> mOutputValues;
+        cl::Buffer mExpectedOutBuf;
+
+        cl::Kernel mRunKernel;
+        cl::Kernel mTrainOutputLayerKernel;
+        cl::Kernel mUpdateKernel;
+        cl::Kernel mDeltaKernel;
+
+        void allocateWeights(const std::string& model_file)
+        {
+            const size_t bytes = sizeof(T) * mNbWeights;
+            if(model_file.empty()) {
+                mWeights = static_cast<T*>(alignedAlloc(bytes));
+                std::fill(mWeights, mWeights + mNbWeights, T(0));
+                return;
+            }
+#ifdef _WIN32
+            throw std::runtime_error("StreamedPerceptron - Model files are not supported on this platform");
+#else
+            const int file = open(model_file.c_str(), O_RDWR | O_CREAT, 0644);
+            if(file < 0) throw std::runtime_error("StreamedPerceptron - Cannot open model file " + model_file);
+            struct stat file_stat;
+            if(fstat(file, &file_stat) != 0 || (file_stat.st_size != 0 && static_cast<size_t>(file_stat.st_size) != bytes)) {
+                close(file);
+                throw std::runtime_error("StreamedPerceptron - Size of model file " + model_file + " does not match the topology");
+            }
+            // A new file is filled with zero weights
+            if(file_stat.st_size == 0 && ftruncate(file, bytes) != 0) {
+                close(file);
+                throw std::runtime_error("StreamedPerceptron - Cannot resize model file " + model_file);
+            }
+            void* mapping = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, file, 0);
+            // The mapping keeps the file open
+            close(file);
+            if(mapping == MAP_FAILED) throw std::runtime_error("StreamedPerceptron - Cannot map model file " + model_file);
+            mWeights = static_cast<T*>(mapping);
+            mMapped = true;
+#endif
+        }
+
+        void freeWeights()
+        {
+            if(mWeights == nullptr) return;
+#ifndef _WIN32
+            if(mMapped) {
+                munmap(mWeights, sizeof(T) * mNbWeights);
+                mWeights = nullptr;
+                return;
+            }
+#endif
+            alignedFree(mWeights);
+            mWeights = nullptr;
+        }
+
+        /**
+         * @brief Streams the weights between layer l and the next one through
+         * the ring, and runs on each tile the forward pass (update == false),
+         * or the backpropagation and weight update (update == true).
+         */
+        void enqueueStreamLayer(int l, bool update, const float& epsilon)
+        {
+            Layer& layer = mLayers[l];
+            Layer& next = mLayers[l+1];
+            const int nb_tiles = (layer.rows + layer.tile_rows - 1) / layer.tile_rows;
+            const size_t ring_size = mRing.size();
+            const size_t first_slot = mNextSlot;
+            mNextSlot += nb_tiles;
+
+            auto first_row = [&](int t) { return t * layer.tile_rows; };
+            auto tile_bytes = [&](int t) { return sizeof(T) * layer.size * std::min(layer.tile_rows, layer.rows - first_row(t)); };
+            auto tile_weights = [&](int t) { return layer.weights + static_cast<size_t>(first_row(t)) * layer.size; };
+            auto upload = [&](int t) {
+                Slot& slot = mRing[(first_slot + t) % ring_size];
+                EventList deps;
+                if(slot.released() != nullptr) deps.push_back(slot.released);
+                mTransferQueue.enqueueWriteBuffer(slot.buffer, CL_FALSE, 0, tile_bytes(t), tile_weights(t), deps.empty() ? nullptr : &deps, &slot.uploaded);
+            };
+
+            // The first tiles are uploaded ahead, one slot stays free for the
+            // tile being written back
+            const int ahead = std::max<int>(1, ring_size-1);
+            for(int t=0; t < std::min(ahead, nb_tiles); t++) upload(t);
+
+            for(int t=0; t < nb_tiles; t++) {
+                if(t + ahead < nb_tiles) upload(t + ahead);
+                Slot& slot = mRing[(first_slot + t) % ring_size];
+                const cl_int row = first_row(t);
+                const cl_int rows = std::min(layer.tile_rows, layer.rows - row);
+                EventList deps;
+                deps.push_back(slot.uploaded);
+                cl::Event computed;
+                if(update) {
+                    mUpdateKernel.setArg(0, layer.size);
+                    mUpdateKernel.setArg(1, row);
+                    mUpdateKernel.setArg(2, rows);
+                    mUpdateKernel.setArg(3, epsilon);
+                    mUpdateKernel.setArg(4, layer.buf_values);
+                    mUpdateKernel.setArg(5, slot.buffer);
+                    mUpdateKernel.setArg(6, next.buf_delta);
+                    mUpdateKernel.setArg(7, layer.buf_sum);
+                    mQueue.enqueueNDRangeKernel(mUpdateKernel, cl::NullRange, cl::NDRange(layer.size), cl::NullRange, &deps, &computed);
+
+                    // Written back before the slot is reused
+                    deps.clear();
+                    deps.push_back(computed);
+                    mTransferQueue.enqueueReadBuffer(slot.buffer, CL_FALSE, 0, tile_bytes(t), tile_weights(t), &deps, &slot.released);
+                } else {
+                    mRunKernel.setArg(0, layer.size);
+                    mRunKernel.setArg(1, row);
+                    mRunKernel.setArg(2, layer.buf_values);
+                    mRunKernel.setArg(3, slot.buffer);
+                    mRunKernel.setArg(4, next.buf_values);
+                    mQueue.enqueueNDRangeKernel(mRunKernel, cl::NullRange, cl::NDRange(rows), cl::NullRange, &deps, &computed);
+                    slot.released = computed;
+                }
+            }
+            mTransferQueue.flush();
+            mQueue.flush();
+        }
+
+        void enqueueForward()
+        {
+            for(size_t l=0; l+1 < mLayers.size(); l++) {
+                enqueueStreamLayer(l, false, 0.f);
+            }
+        }
+
+        void finish(const char* what)
+        {
+            if(mQueue.finish() != CL_SUCCESS || mTransferQueue.finish() != CL_SUCCESS) {
+                throw std::runtime_error(std::string("StreamedPerceptron::") + what + " - command queue failed to execute");
+            }
+        }
+
+    public:
+        /**
+         * @brief Creates the layers, and the ring of device buffers.
+         *
+         * @param sizes
+         *      Number of neurons of each layer, bias excluded (as in
+         *      Perceptron::createLayer)
+         * @param queue
+         *      Queue of the kernels, in-order
+         * @param transfer_queue
+         *      Queue of the weight transfers, on the same device
+         * @param program
+         *      Program built from perceptron_layer.cl
+         * @param tile_bytes
+         *      Size of the buffers of the ring. A tile holds at least one row
+         *      of weights.
+         * @param ring_size
+         *      Number of buffers of the ring (at least 2). The device memory
+         *      used by the weights is about ring_size * tile_bytes.
+         * @param model_file
+         *      When set, the weights are stored in this file, mapped in
+         *      memory. An existing file must have the size of the topology
+         *      and is used as is; a new file starts with zero weights.
+         */
+        StreamedPerceptron(const std::vector<int>& sizes, cl::Context& context, cl::CommandQueue& queue, cl::CommandQueue& transfer_queue, cl::Program& program, size_t tile_bytes = DEFAULT_TILE_BYTES, int ring_size = 3, const std::string& model_file = "") : mContext(context), mQueue(queue), mTransferQueue(transfer_queue)
+        {
+            if(sizes.size() < 2) {
+                throw std::runtime_error("StreamedPerceptron - You must have more than one layer !");
+            }
+            if(ring_size < 2) {
+                throw std::runtime_error("StreamedPerceptron - The ring needs at least 2 buffers");
+            }
+            if(mQueue.getInfo<CL_QUEUE_PROPERTIES>() & CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE) {
+                throw std::runtime_error("StreamedPerceptron - The queue of the kernels must be in-order");
+            }
+            const cl::Device device = mQueue.getInfo<CL_QUEUE_DEVICE>();
+            tile_bytes = std::min<size_t>(tile_bytes, device.getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>());
+
+            mLayers.resize(sizes.size());
+            for(size_t l=0; l < sizes.size(); l++) {
+                mLayers[l].size = sizes[l] + 1;
+            }
+            size_t slot_bytes = 0;
+            for(size_t l=0; l+1 < mLayers.size(); l++) {
+                Layer& layer = mLayers[l];
+                const size_t row_bytes = sizeof(T) * layer.size;
+                if(row_bytes > device.getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>()) {
+                    throw std::runtime_error("StreamedPerceptron - A row of weights exceeds CL_DEVICE_MAX_MEM_ALLOC_SIZE");
+                }
+                layer.rows = mLayers[l+1].size - 1;
+                layer.tile_rows = std::max<size_t>(1, std::min<size_t>(layer.rows, tile_bytes / row_bytes));
+                slot_bytes = std::max(slot_bytes, row_bytes * layer.tile_rows);
+                mNbWeights += static_cast<size_t>(layer.size) * mLayers[l+1].size;
+            }
+
+            allocateWeights(model_file);
+            size_t offset = 0;
+            for(size_t l=0; l+1 < mLayers.size(); l++) {
+                mLayers[l].weights = mWeights + offset;
+                offset += static_cast<size_t>(mLayers[l].size) * mLayers[l+1].size;
+            }
+
+            for(Layer& layer : mLayers) {
+                std::vector<T> values(layer.size, 0);
+                values[layer.size-1] = 1;
+                layer.buf_values = cl::Buffer(mContext, CL_MEM_READ_WRITE, sizeof(T) * layer.size);
+                layer.buf_delta = cl::Buffer(mContext, CL_MEM_READ_WRITE, sizeof(T) * layer.size);
+                layer.buf_sum = cl::Buffer(mContext, CL_MEM_READ_WRITE, sizeof(T) * layer.size);
+                mQueue.enqueueWriteBuffer(layer.buf_values, CL_TRUE, 0, sizeof(T) * layer.size, values.data());
+            }
+            mExpectedOutBuf = cl::Buffer(mContext, CL_MEM_READ_ONLY, sizeof(T) * (mLayers.back().size-1));
+
+            mRing.resize(ring_size);
+            for(Slot& slot : mRing) {
+                slot.buffer = cl::Buffer(mContext, CL_MEM_READ_WRITE, slot_bytes);
+            }
+
+            mRunKernel = cl::Kernel(program, "perceptron_streamed");
+            mUpdateKernel = cl::Kernel(program, "perceptron_streamed_train_backpropagate_update_weights");
+            mDeltaKernel = cl::Kernel(program, "perceptron_streamed_train_delta");
+            mTrainOutputLayerKernel = cl::Kernel(program, "perceptron_train_output_layer");
+            mTrainOutputLayerKernel.setArg(0, mLayers.back().buf_values);
+            mTrainOutputLayerKernel.setArg(1, mExpectedOutBuf);
+            mTrainOutputLayerKernel.setArg(2, mLayers.back().buf_delta);
+        }
+
+        StreamedPerceptron(const StreamedPerceptron&) = delete;
+        StreamedPerceptron& operator=(const StreamedPerceptron&) = delete;
+
+        ~StreamedPerceptron()
+        {
+            // Write-backs may still target the host weights
+            mQueue.finish();
+            mTransferQueue.finish();
+            freeWeights();
+        }
+
+        /**
+         * @brief Initializes the weights of all layers on the host,
+         * reproducibly from seed (layer l uses the stream l of the generator,
+         * see NeuronLayer::initWeights)
+         */
+        void initWeights(WeightInit init, uint64_t seed, float min = -0.5f, float max = 0.5f)
+        {
+            finish("initWeights");
+            for(size_t l=0; l+1 < mLayers.size(); l++) {
+                float layer_min = min, layer_max = max;
+                weightInitRange(init, mLayers[l].size, mLayers[l+1].size-1, layer_min, layer_max);
+                philox::fillUniform(mLayers[l].weights, static_cast<size_t>(mLayers[l].size) * mLayers[l+1].size, seed, l, layer_min, layer_max);
+            }
+        }
+
+        /**
+         * @brief Weights between layer and the next one, on the host
+         * (row-major, (next layer size) x (layer size)). Up to date after
+         * run, trainStep or sync.
+         */
+        T* getWeights(int layer) {
+            return mLayers[layer].weights;
+        }
+
+        /**
+         * @brief Number of rows of weights uploaded at once for layer
+         */
+        int getTileRows(int layer) const {
+            return mLayers[layer].tile_rows;
+        }
+
+        /**
+         * @brief Waits for the pending transfers, and writes the weights to the
+         * model file (if any)
+         */
+        void sync()
+        {
+            finish("sync");
+#ifndef _WIN32
+            if(mMapped && msync(mWeights, sizeof(T) * mNbWeights, MS_SYNC) != 0) {
+                throw std::runtime_error("StreamedPerceptron::sync - Cannot write the model file");
+            }
+#endif
+        }
+
+        void setInputValues(const std::vector<T>& values)
+        {
+            Layer& input = mLayers.front();
+            if(values.size() != static_cast<size_t>(input.size-1)) {
+                throw std::runtime_error("StreamedPerceptron::setInputValues - input size must match the first layer size!");
+            }
+            mQueue.enqueueWriteBuffer(input.buf_values, CL_TRUE, 0, sizeof(T)*values.size(), values.data());
+        }
+
+        void run()
+        {
+            enqueueForward();
+            finish("run");
+        }
+
+        /**
+         * @brief Reads the values of the output layer (bias excluded)
+         */
+        const std::vector<T>& readOutputValues()
+        {
+            const Layer& output = mLayers.back();
+            mOutputValues.resize(output.size-1);
+            mQueue.enqueueReadBuffer(output.buf_values, CL_TRUE, 0, sizeof(T)*mOutputValues.size(), mOutputValues.data());
+            return mOutputValues;
+        }
+
+        /**
+         * @brief Trains the network on one sample. The updated weights are
+         * back on the host when it returns.
+         */
+        void trainStep(const std::vector<T>& training_in, const std::vector<T>& training_out, const float& epsilon)
+        {
+            const int n = mLayers.size();
+            if(training_out.size() != static_cast<size_t>(mLayers.back().size-1)) {
+                throw std::runtime_error("StreamedPerceptron::trainStep - Expected output size must match the output layer size!");
+            }
+
+            setInputValues(training_in);
+            mQueue.enqueueWriteBuffer(mExpectedOutBuf, CL_FALSE, 0, sizeof(T)*training_out.size(), training_out.data());
+            enqueueForward();
+            mQueue.enqueueNDRangeKernel(mTrainOutputLayerKernel, cl::NullRange, cl::NDRange(mLayers.back().size-1), cl::NullRange);
+
+            for(int l=n-2; l >= 0; l--) {
+                enqueueStreamLayer(l, true, epsilon);
+                // The delta of the input layer is never used
+                if(l >= 1) {
+                    mDeltaKernel.setArg(0, mLayers[l].buf_values);
+                    mDeltaKernel.setArg(1, mLayers[l].buf_sum);
+                    mDeltaKernel.setArg(2, mLayers[l].buf_delta);
+                    mQueue.enqueueNDRangeKernel(mDeltaKernel, cl::NullRange, cl::NDRange(mLayers[l].size-1), cl::NullRange);
+                }
+            }
+            finish("trainStep");
+        }
+};
+
+#endif
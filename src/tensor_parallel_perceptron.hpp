@@ -0,0 +1,365 @@
+#ifndef __TENSOR_PARALLEL_PERCEPTRON_HPP__
+#define __TENSOR_PARALLEL_PERCEPTRON_HPP__
+
+#include "perceptron_layer.hpp"
+#include "parallel_device.hpp"
+
+#include <algorithm>
+#include <vector>
+
+/**
+ * TensorParallelPerceptron
+ * ========================
+ *
+ * Fully-connected perceptron whose layers are split across several devices
+ * (tensor, or model, parallelism): the neurons of each layer are partitioned
+ * into contiguous blocks, one per device, and each device stores the rows of
+ * the weight matrices computing its neurons (see the perceptron_streamed
+ * kernels, which work on blocks of rows). A layer too wide for one device is
+ * thus spread over the memory and the compute units of all of them.
+ *
+ * Every device keeps the values of all the neurons, as the next layer needs
+ * them all:
+ * - forward: each device computes the values of its block, then the blocks
+ *   are exchanged (all-gather) before the next layer
+ * - backward: each device updates its rows of weights, and computes their
+ *   contribution to the backpropagated sums of all the neurons of the
+ *   previous layer. The partial sums are added up, and each device gets the
+ *   sums of its own block (reduce-scatter), from which it computes their
+ *   delta.
+ * The exchanges go through the host, so the devices may be in different
+ * contexts.
+ *
+ * The weights are the same as those of a Perceptron initialized with
+ * initWeights and the same seed, when layer l of the perceptron uses the
+ * stream l.
+ *
+ * How to use
+ * ----------
+ * std::vector<ParallelDevice> devices = {{gpu0_context, gpu0_queue, gpu0_program},
+ *                                        {gpu1_context, gpu1_queue, gpu1_program}};
+ * TensorParallelPerceptron<float> p({1024, 65536, 10}, devices);
+ * p.initWeights(WeightInit::Xavier, seed);
+ * p.trainStep(input, expected_output, epsilon);
+ * p.setInputValues(...);
+ * p.run();
+ * const std::vector<float>& out = p.readOutputValues();
+ **/
+template<typename T>
+class TensorParallelPerceptron
+{
+    private:
+        /**
+         * Part of the network on one device. Buffers are indexed by layer;
+         * weights[l] holds the rows of the weights between layer l and l+1
+         * computing the block of layer l+1 of the device.
+         */
+        struct Shard {
+            ParallelDevice device;
+            // All the neurons of each layer (bias included)
+            std::vector<cl::Buffer> values;
+            // Only the block of the device is computed
+            std::vector<cl::Buffer> delta;
+            // Backpropagated sums of all the neurons, then of the block
+            std::vector<cl::Buffer> sum;
+            std::vector<cl::Buffer> weights;
+            cl::Buffer expected;
+
+            cl::Kernel run;
+            cl::Kernel train_output_layer;
+            cl::Kernel train_backpropagate_update_weights;
+            cl::Kernel train_delta;
+        };
+
+        // Sizes of the layers, bias included
+        std::vector<cl_int> mSizes;
+        std::vector<Shard> mShards;
+        // mFirstNeuron[l][d]: first neuron of layer l computed by device d
+        // (the device computes up to mFirstNeuron[l][d+1], excluded)
+        std::vector<std::vector<cl_int>> mFirstNeuron;
+        std::vector<T> mOutputValues;
+        // Host side of the exchanges, per layer: the writes to the devices
+        // read them until the queues are finished
+        std::vector<std::vector<T>> mGathered;
+        std::vector<std::vector<T>> mSums;
+
+        cl_int blockSize(int layer, int device) const {
+            return mFirstNeuron[layer][device+1] - mFirstNeuron[layer][device];
+        }
+
+        void finishAll(const char* what)
+        {
+            for(Shard& shard : mShards) {
+                if(shard.device.queue.finish() != CL_SUCCESS) {
+                    throw std::runtime_error(std::string("TensorParallelPerceptron::") + what + " - command queue failed to execute");
+                }
+            }
+        }
+
+        /**
+         * @brief Copies the block of layer of every device into host, and the
+         * other blocks to every device (all-gather)
+         */
+        void allGatherValues(int layer)
+        {
+            const int nb_devices = mShards.size();
+            std::vector<T>& host = mGathered[layer];
+            host.resize(mSizes[layer]-1);
+            std::vector<cl::Event> read(nb_devices);
+            for(int d=0; d < nb_devices; d++) {
+                if(blockSize(layer, d) == 0) continue;
+                mShards[d].device.queue.enqueueReadBuffer(mShards[d].values[layer], CL_FALSE, sizeof(T) * mFirstNeuron[layer][d], sizeof(T) * blockSize(layer, d), host.data() + mFirstNeuron[layer][d], nullptr, &read[d]);
+            }
+            // Events of different contexts cannot be waited for together
+            for(int d=0; d < nb_devices; d++) {
+                if(blockSize(layer, d) > 0) read[d].wait();
+            }
+            for(int d=0; d < nb_devices; d++) {
+                cl::CommandQueue& queue = mShards[d].device.queue;
+                const size_t begin = mFirstNeuron[layer][d];
+                const size_t end = mFirstNeuron[layer][d+1];
+                if(begin > 0) queue.enqueueWriteBuffer(mShards[d].values[layer], CL_FALSE, 0, sizeof(T) * begin, host.data());
+                if(end < host.size()) queue.enqueueWriteBuffer(mShards[d].values[layer], CL_FALSE, sizeof(T) * end, sizeof(T) * (host.size() - end), host.data() + end);
+            }
+        }
+
+        /**
+         * @brief Adds up the backpropagated sums of layer of all devices, and
+         * gives each device the sums of its block (reduce-scatter)
+         */
+        void reduceScatterSums(int layer)
+        {
+            std::vector<T>& total = mSums[layer];
+            const int nb_devices = mShards.size();
+            const size_t size = mSizes[layer]-1;
+            std::vector<std::vector<T>> partial(nb_devices, std::vector<T>(size));
+            std::vector<cl::Event> read(nb_devices);
+            for(int d=0; d < nb_devices; d++) {
+                mShards[d].device.queue.enqueueReadBuffer(mShards[d].sum[layer], CL_FALSE, 0, sizeof(T) * size, partial[d].data(), nullptr, &read[d]);
+            }
+            total.assign(size, 0);
+            for(int d=0; d < nb_devices; d++) {
+                read[d].wait();
+                for(size_t i=0; i < size; i++) total[i] += partial[d][i];
+            }
+            for(int d=0; d < nb_devices; d++) {
+                if(blockSize(layer, d) == 0) continue;
+                mShards[d].device.queue.enqueueWriteBuffer(mShards[d].sum[layer], CL_FALSE, sizeof(T) * mFirstNeuron[layer][d], sizeof(T) * blockSize(layer, d), total.data() + mFirstNeuron[layer][d]);
+            }
+        }
+
+        void enqueueForward()
+        {
+            for(size_t l=0; l+1 < mSizes.size(); l++) {
+                for(size_t d=0; d < mShards.size(); d++) {
+                    Shard& shard = mShards[d];
+                    const cl_int rows = blockSize(l+1, d);
+                    if(rows == 0) continue;
+                    shard.run.setArg(0, mSizes[l]);
+                    shard.run.setArg(1, mFirstNeuron[l+1][d]);
+                    shard.run.setArg(2, shard.values[l]);
+                    shard.run.setArg(3, shard.weights[l]);
+                    shard.run.setArg(4, shard.values[l+1]);
+                    shard.device.queue.enqueueNDRangeKernel(shard.run, cl::NullRange, cl::NDRange(rows), cl::NullRange);
+                }
+                allGatherValues(l+1);
+            }
+        }
+
+    public:
+        /**
+         * @brief Partitions the layers across the devices, and creates the
+         * buffers of each device.
+         *
+         * @param sizes
+         *      Number of neurons of each layer, bias excluded (as in
+         *      Perceptron::createLayer)
+         */
+        TensorParallelPerceptron(const std::vector<int>& sizes, const std::vector<ParallelDevice>& devices)
+        {
+            if(sizes.size() < 2) {
+                throw std::runtime_error("TensorParallelPerceptron - You must have more than one layer !");
+            }
+            if(devices.empty()) {
+                throw std::runtime_error("TensorParallelPerceptron - No device");
+            }
+            const int nb_devices = devices.size();
+            for(int size : sizes) {
+                mSizes.push_back(size + 1);
+                std::vector<cl_int> first(nb_devices+1);
+                for(int d=0; d <= nb_devices; d++) {
+                    first[d] = static_cast<cl_int>((static_cast<size_t>(size) * d) / nb_devices);
+                }
+                mFirstNeuron.push_back(first);
+            }
+
+            mGathered.resize(mSizes.size());
+            mSums.resize(mSizes.size());
+            mShards.resize(nb_devices);
+            for(int d=0; d < nb_devices; d++) {
+                Shard& shard = mShards[d];
+                shard.device = devices[d];
+                cl::Context& context = shard.device.context;
+                for(size_t l=0; l < mSizes.size(); l++) {
+                    std::vector<T> values(mSizes[l], 0);
+                    values[mSizes[l]-1] = 1;
+                    shard.values.push_back(cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(T) * mSizes[l]));
+                    shard.delta.push_back(cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(T) * mSizes[l]));
+                    shard.sum.push_back(cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(T) * mSizes[l]));
+                    shard.device.queue.enqueueWriteBuffer(shard.values[l], CL_TRUE, 0, sizeof(T) * mSizes[l], values.data());
+                    if(l+1 < mSizes.size()) {
+                        // Empty buffers are not allowed
+                        const size_t rows = std::max<cl_int>(blockSize(l+1, d), 1);
+                        shard.weights.push_back(cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(T) * rows * mSizes[l]));
+                    }
+                }
+                shard.expected = cl::Buffer(context, CL_MEM_READ_ONLY, sizeof(T) * (mSizes.back()-1));
+
+                cl::Program& program = shard.device.program;
+                shard.run = cl::Kernel(program, "perceptron_streamed");
+                shard.train_output_layer = cl::Kernel(program, "perceptron_train_output_layer");
+                shard.train_backpropagate_update_weights = cl::Kernel(program, "perceptron_streamed_train_backpropagate_update_weights");
+                shard.train_delta = cl::Kernel(program, "perceptron_streamed_train_delta");
+            }
+        }
+
+        int getNbDevices() const {
+            return mShards.size();
+        }
+
+        /**
+         * @brief Neurons [first, end) of layer (bias excluded) computed by
+         * device
+         */
+        std::pair<int, int> getBlock(int layer, int device) const {
+            return std::make_pair(mFirstNeuron[layer][device], mFirstNeuron[layer][device+1]);
+        }
+
+        /**
+         * @brief Initializes the weights on the host, reproducibly from seed
+         * (layer l uses the stream l of the generator, see
+         * NeuronLayer::initWeights), and uploads the rows of each device
+         */
+        void initWeights(WeightInit init, uint64_t seed, float min = -0.5f, float max = 0.5f)
+        {
+            std::vector<T> rows;
+            for(size_t l=0; l+1 < mSizes.size(); l++) {
+                float layer_min = min, layer_max = max;
+                weightInitRange(init, mSizes[l], mSizes[l+1]-1, layer_min, layer_max);
+                for(size_t d=0; d < mShards.size(); d++) {
+                    const size_t nb_weights = static_cast<size_t>(blockSize(l+1, d)) * mSizes[l];
+                    if(nb_weights == 0) continue;
+                    rows.resize(nb_weights);
+                    philox::fillUniform(rows.data(), nb_weights, seed, l, layer_min, layer_max, static_cast<size_t>(mFirstNeuron[l+1][d]) * mSizes[l]);
+                    mShards[d].device.queue.enqueueWriteBuffer(mShards[d].weights[l], CL_TRUE, 0, sizeof(T) * nb_weights, rows.data());
+                }
+            }
+        }
+
+        /**
+         * @brief Weights between layer and the next one, gathered from all the
+         * devices (row-major, (next layer size - 1) x (layer size): the bias
+         * of the next layer has no weights)
+         */
+        std::vector<T> readWeights(int layer)
+        {
+            std::vector<T> weights(static_cast<size_t>(mSizes[layer+1]-1) * mSizes[layer]);
+            for(size_t d=0; d < mShards.size(); d++) {
+                const size_t nb_weights = static_cast<size_t>(blockSize(layer+1, d)) * mSizes[layer];
+                if(nb_weights == 0) continue;
+                mShards[d].device.queue.enqueueReadBuffer(mShards[d].weights[layer], CL_TRUE, 0, sizeof(T) * nb_weights, weights.data() + static_cast<size_t>(mFirstNeuron[layer+1][d]) * mSizes[layer]);
+            }
+            return weights;
+        }
+
+        void setInputValues(const std::vector<T>& values)
+        {
+            if(values.size() != static_cast<size_t>(mSizes.front()-1)) {
+                throw std::runtime_error("TensorParallelPerceptron::setInputValues - input size must match the first layer size!");
+            }
+            for(Shard& shard : mShards) {
+                shard.device.queue.enqueueWriteBuffer(shard.values.front(), CL_TRUE, 0, sizeof(T)*values.size(), values.data());
+            }
+        }
+
+        void run()
+        {
+            enqueueForward();
+            finishAll("run");
+        }
+
+        /**
+         * @brief Reads the values of the output layer (bias excluded)
+         */
+        const std::vector<T>& readOutputValues()
+        {
+            mOutputValues.resize(mSizes.back()-1);
+            mShards.front().device.queue.enqueueReadBuffer(mShards.front().values.back(), CL_TRUE, 0, sizeof(T)*mOutputValues.size(), mOutputValues.data());
+            return mOutputValues;
+        }
+
+        /**
+         * @brief Trains the network on one sample
+         */
+        void trainStep(const std::vector<T>& training_in, const std::vector<T>& training_out, const float& epsilon)
+        {
+            const int n = mSizes.size();
+            if(training_out.size() != static_cast<size_t>(mSizes.back()-1)) {
+                throw std::runtime_error("TensorParallelPerceptron::trainStep - Expected output size must match the output layer size!");
+            }
+
+            setInputValues(training_in);
+            for(Shard& shard : mShards) {
+                shard.device.queue.enqueueWriteBuffer(shard.expected, CL_FALSE, 0, sizeof(T)*training_out.size(), training_out.data());
+            }
+            enqueueForward();
+
+            // Delta of the block of each device, in the output layer
+            for(size_t d=0; d < mShards.size(); d++) {
+                Shard& shard = mShards[d];
+                if(blockSize(n-1, d) == 0) continue;
+                shard.train_output_layer.setArg(0, shard.values[n-1]);
+                shard.train_output_layer.setArg(1, shard.expected);
+                shard.train_output_layer.setArg(2, shard.delta[n-1]);
+                shard.device.queue.enqueueNDRangeKernel(shard.train_output_layer, cl::NDRange(mFirstNeuron[n-1][d]), cl::NDRange(blockSize(n-1, d)), cl::NullRange);
+            }
+
+            for(int l=n-2; l >= 0; l--) {
+                for(size_t d=0; d < mShards.size(); d++) {
+                    Shard& shard = mShards[d];
+                    const cl_int first_row = mFirstNeuron[l+1][d];
+                    const cl_int rows = blockSize(l+1, d);
+                    // The kernel only resets the sums for the first row
+                    if(rows == 0 || first_row != 0) {
+                        shard.device.queue.enqueueFillBuffer(shard.sum[l], T(0), 0, sizeof(T) * mSizes[l]);
+                    }
+                    if(rows == 0) continue;
+                    cl::Kernel& update = shard.train_backpropagate_update_weights;
+                    update.setArg(0, mSizes[l]);
+                    update.setArg(1, first_row);
+                    update.setArg(2, rows);
+                    update.setArg(3, epsilon);
+                    update.setArg(4, shard.values[l]);
+                    update.setArg(5, shard.weights[l]);
+                    update.setArg(6, shard.delta[l+1]);
+                    update.setArg(7, shard.sum[l]);
+                    shard.device.queue.enqueueNDRangeKernel(update, cl::NullRange, cl::NDRange(mSizes[l]), cl::NullRange);
+                }
+                // The delta of the input layer is never used
+                if(l == 0) break;
+
+                reduceScatterSums(l);
+                for(size_t d=0; d < mShards.size(); d++) {
+                    Shard& shard = mShards[d];
+                    if(blockSize(l, d) == 0) continue;
+                    shard.train_delta.setArg(0, shard.values[l]);
+                    shard.train_delta.setArg(1, shard.sum[l]);
+                    shard.train_delta.setArg(2, shard.delta[l]);
+                    shard.device.queue.enqueueNDRangeKernel(shard.train_delta, cl::NDRange(mFirstNeuron[l][d]), cl::NDRange(blockSize(l, d)), cl::NullRange);
+                }
+            }
+            finishAll("trainStep");
+        }
+};
+
+#endif
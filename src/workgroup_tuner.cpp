@@ -0,0 +1,157 @@
+#include "workgroup_tuner.hpp"
+
+#include <chrono>
+#include <limits>
+#include <sstream>
+
+WorkGroupTuner::WorkGroupTuner(const std::string& database_path) : mDatabasePath(database_path)
+{
+    // The forward kernel caches the input values in local memory
+    addVariant("perceptron", "perceptron_tiled");
+    load();
+}
+
+void WorkGroupTuner::addVariant(const std::string& kernel_name, const std::string& variant_name)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    mVariants[kernel_name].push_back(variant_name);
+}
+
+void WorkGroupTuner::setRepetitions(int repetitions)
+{
+    if(repetitions < 1) throw std::runtime_error("WorkGroupTuner::setRepetitions - at least one repetition is needed");
+    mRepetitions = repetitions;
+}
+
+std::string WorkGroupTuner::deviceKey(const cl::Device& device)
+{
+    return device.getInfo<CL_DEVICE_NAME>() + " (" + device.getInfo<CL_DRIVER_VERSION>() + ")";
+}
+
+std::vector<size_t> WorkGroupTuner::candidateLocalSizes(const cl::Kernel& kernel, const cl::Device& device, size_t global) const
+{
+    const size_t max_local = kernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device);
+
+    // 0 stands for cl::NullRange (driver choice)
+    std::vector<size_t> sizes = {0};
+    for(size_t local = 1; local <= max_local && local <= global; local *= 2) {
+        // OpenCL 1.x requires the global size to be a multiple of the local size
+        if(global % local == 0) sizes.push_back(local);
+    }
+    return sizes;
+}
+
+double WorkGroupTuner::benchmark(const cl::CommandQueue& queue, cl::Kernel& kernel, size_t global, size_t local) const
+{
+    const cl::NDRange local_range = (local == 0) ? cl::NullRange : cl::NDRange(local);
+    try {
+        // Warm up (first launch may include lazy compilation and transfers)
+        queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(global), local_range);
+        queue.finish();
+
+        auto start = std::chrono::steady_clock::now();
+        for(int i=0; i<mRepetitions; i++) {
+            queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(global), local_range);
+        }
+        queue.finish();
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        return elapsed.count();
+    } catch(cl::Error& error) {
+        // Not a valid configuration for this kernel (eg. too much local memory)
+        return std::numeric_limits<double>::infinity();
+    }
+}
+
+cl::Kernel& WorkGroupTuner::cachedKernel(const cl::Kernel& kernel, const std::string& name)
+{
+    cl::Program program = kernel.getInfo<CL_KERNEL_PROGRAM>();
+    auto key = std::make_pair(program(), name);
+    auto it = mKernels.find(key);
+    if(it == mKernels.end()) {
+        it = mKernels.insert(std::make_pair(key, cl::Kernel(program, name.c_str()))).first;
+    }
+    return it->second;
+}
+
+WorkGroupTuner::Choice WorkGroupTuner::select(const cl::CommandQueue& queue, const cl::Kernel& kernel, const std::string& shape, size_t global, const ArgBinder& bind_for_tuning)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    const cl::Device device = queue.getInfo<CL_QUEUE_DEVICE>();
+    const std::string kernel_name = kernel.getInfo<CL_KERNEL_FUNCTION_NAME>();
+    std::ostringstream key;
+    key << deviceKey(device) << "\t" << kernel_name << "\t" << shape << "/" << global;
+
+    auto found = mChoices.find(key.str());
+    if(found != mChoices.end()) return found->second;
+
+    std::vector<std::string> variants = {kernel_name};
+    auto registered = mVariants.find(kernel_name);
+    if(registered != mVariants.end()) {
+        variants.insert(variants.end(), registered->second.begin(), registered->second.end());
+    }
+
+    Choice best;
+    best.variant = kernel_name;
+    double best_time = std::numeric_limits<double>::infinity();
+    for(const auto& variant : variants) {
+        cl::Kernel* candidate = nullptr;
+        try {
+            candidate = &cachedKernel(kernel, variant);
+        } catch(cl::Error& error) {
+            // Variant not present in this program
+            continue;
+        }
+        bind_for_tuning(*candidate);
+        for(size_t local : candidateLocalSizes(*candidate, device, global)) {
+            double time = benchmark(queue, *candidate, global, local);
+            if(time < best_time) {
+                best_time = time;
+                best.variant = variant;
+                best.local = local;
+            }
+        }
+    }
+
+    mChoices[key.str()] = best;
+    save();
+    return best;
+}
+
+cl::Kernel& WorkGroupTuner::kernelFor(const cl::Kernel& kernel, const Choice& choice)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    return cachedKernel(kernel, choice.variant);
+}
+
+void WorkGroupTuner::load()
+{
+    std::ifstream file(mDatabasePath.c_str());
+    if(file.fail()) return;
+
+    // Format: device \t kernel \t shape/global \t variant \t local
+    std::string line;
+    while(std::getline(file, line)) {
+        size_t last = line.rfind('\t');
+        if(last == std::string::npos) continue;
+        size_t variant_pos = line.rfind('\t', last-1);
+        if(variant_pos == std::string::npos) continue;
+
+        Choice choice;
+        choice.variant = line.substr(variant_pos+1, last-variant_pos-1);
+        std::istringstream(line.substr(last+1)) >> choice.local;
+        mChoices[line.substr(0, variant_pos)] = choice;
+    }
+}
+
+void WorkGroupTuner::save() const
+{
+    std::ofstream file(mDatabasePath.c_str(), std::ios::trunc);
+    if(file.fail()) {
+        std::cout << "WorkGroupTuner: unable to write tuning database " << mDatabasePath << std::endl;
+        return;
+    }
+    for(const auto& entry : mChoices) {
+        file << entry.first << "\t" << entry.second.variant << "\t" << entry.second.local << "\n";
+    }
+}
@@ -0,0 +1,113 @@
+#ifndef __WORKGROUP_TUNER_HPP__
+#define __WORKGROUP_TUNER_HPP__
+
+#include "openCLUtilities.hpp"
+
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/**
+ * WorkGroupTuner
+ * ==============
+ *
+ * Picks the work-group (local) size and the kernel variant used for each
+ * kernel launch of the perceptron.
+ *
+ * Without a tuner, every kernel is enqueued with cl::NullRange as local size,
+ * leaving the choice to the driver. The best choice varies a lot between CPU
+ * OpenCL implementations and GPUs/accelerators, so the tuner benchmarks every
+ * candidate the first time a (device, kernel, layer shape) triple is seen and
+ * remembers the fastest one.
+ *
+ * Candidates are:
+ * - every registered variant of the kernel (see addVariant). A variant is
+ *   another kernel of the same program taking exactly the same arguments.
+ * - cl::NullRange, and every power of two that divides the global size and is
+ *   allowed by CL_KERNEL_WORK_GROUP_SIZE on the device.
+ *
+ * Results are stored in a plain text database (one entry per line) that is
+ * loaded on construction and rewritten whenever a new entry is tuned, so that
+ * later runs do not pay the benchmarking cost again.
+ *
+ * How to use
+ * ----------
+ * WorkGroupTuner tuner("perceptron_tuning.db");
+ * perceptron.setTuner(&tuner);
+ */
+class WorkGroupTuner
+{
+    public:
+        /**
+         * @brief Result of the tuning for one launch configuration
+         */
+        struct Choice {
+            // Name of the kernel variant to launch
+            std::string variant;
+            // Work-group size, 0 means cl::NullRange
+            size_t local = 0;
+        };
+
+        /**
+         * @brief Binds the kernel arguments before a benchmark launch.
+         * Must not have visible side effects when the kernel is launched
+         * several times in a row (eg. use a null learning rate for the weight
+         * update kernel).
+         */
+        typedef std::function<void(cl::Kernel&)> ArgBinder;
+
+        explicit WorkGroupTuner(const std::string& database_path = "perceptron_tuning.db");
+
+        /**
+         * @brief Registers variant_name as an alternative implementation of
+         * kernel_name. Both kernels must have the same arguments.
+         */
+        void addVariant(const std::string& kernel_name, const std::string& variant_name);
+
+        /**
+         * @brief Number of timed launches for each candidate
+         */
+        void setRepetitions(int repetitions);
+
+        /**
+         * @brief Returns the best configuration for kernel launched with a
+         * global size of global on the device of queue.
+         *
+         * If the configuration is not in the database yet, all candidates are
+         * benchmarked on queue (arguments bound by bind_for_tuning), and the
+         * database is saved.
+         *
+         * @param shape
+         *      Free-form description of the layer shape, part of the key
+         */
+        Choice select(const cl::CommandQueue& queue, const cl::Kernel& kernel, const std::string& shape, size_t global, const ArgBinder& bind_for_tuning);
+
+        /**
+         * @brief Returns the kernel named choice.variant, built from the same
+         * program as kernel. Kernels are cached, so arguments bound on the
+         * returned kernel persist until the next call binding them.
+         */
+        cl::Kernel& kernelFor(const cl::Kernel& kernel, const Choice& choice);
+
+        void load();
+        void save() const;
+
+    private:
+        std::string mDatabasePath;
+        int mRepetitions = 5;
+
+        std::map<std::string, std::vector<std::string>> mVariants;
+        std::map<std::string, Choice> mChoices;
+        // Variant kernels, keyed by program and kernel name
+        std::map<std::pair<cl_program, std::string>, cl::Kernel> mKernels;
+        std::mutex mMutex;
+
+        static std::string deviceKey(const cl::Device& device);
+        std::vector<size_t> candidateLocalSizes(const cl::Kernel& kernel, const cl::Device& device, size_t global) const;
+        double benchmark(const cl::CommandQueue& queue, cl::Kernel& kernel, size_t global, size_t local) const;
+        cl::Kernel& cachedKernel(const cl::Kernel& kernel, const std::string& name);
+};
+
+#endif